@@ -31,9 +31,120 @@ public class BleApi
     [DllImport("BleWinrtDll.dll", EntryPoint = "PollDevice")]
     public static extern ScanStatus PollDevice(ref DeviceUpdate device, bool block);
 
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct DeviceRecord
+    {
+        public ulong address;
+        public ulong generation;
+        public ulong lastSeenNs;
+        public uint updates;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+        public string id;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 50)]
+        public string name;
+        [MarshalAs(UnmanagedType.I1)]
+        public bool isConnectable;
+        [MarshalAs(UnmanagedType.I1)]
+        public bool isConnected;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetDeviceSnapshot")]
+    public static extern uint GetDeviceSnapshot([Out] DeviceRecord[] buffer, uint capacity, ulong sinceGeneration);
+
     [DllImport("BleWinrtDll.dll", EntryPoint = "StopDeviceScan")]
     public static extern void StopDeviceScan();
 
+    public const sbyte TX_POWER_NONE = 127;
+
+    // blittable like BLEDataV2; the offset/size pairs are views into payload, size 0 if absent
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct AdvertisementRecord
+    {
+        public ulong address;
+        public ulong receivedNs;
+        public short rssi;
+        public sbyte txPower;
+        public byte flags;
+        public byte kind;
+        public byte size;
+        public byte malformed;
+        public byte truncated;
+        public byte nameOffset;
+        public byte nameSize;
+        public byte uuid16Offset;
+        public byte uuid16Size;
+        public byte uuid32Offset;
+        public byte uuid32Size;
+        public byte uuid128Offset;
+        public byte uuid128Size;
+        public byte serviceDataOffset;
+        public byte serviceDataSize;
+        public byte serviceDataUuidSize;
+        public byte manufacturerDataOffset;
+        public byte manufacturerDataSize;
+        public ushort companyId;
+        public fixed byte payload[255];
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "StartAdvertisementScan")]
+    public static extern bool StartAdvertisementScan(bool active);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "StopAdvertisementScan")]
+    public static extern void StopAdvertisementScan();
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollAdvertisements")]
+    public static extern uint PollAdvertisements([Out] AdvertisementRecord[] buffer, uint capacity, uint timeoutMs);
+
+    public enum ScanFilterAction { ACCEPT, REJECT };
+
+    [Flags]
+    public enum ScanFilterCriteria : uint
+    {
+        NAME = 1 << 0,
+        SERVICE = 1 << 1,
+        MANUFACTURER = 1 << 2,
+        ADDRESS = 1 << 3,
+        MIN_RSSI = 1 << 4
+    };
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct ScanFilterRule
+    {
+        public ScanFilterAction action;
+        public ScanFilterCriteria criteria;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 50)]
+        public string name;
+        [MarshalAs(UnmanagedType.U1)]
+        public bool namePrefix;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+        public string serviceUuid;
+        public ushort companyId;
+        public byte dataSize;
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = 16)]
+        public byte[] dataMask;
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = 16)]
+        public byte[] dataValue;
+        public short minRssi;
+        public ulong address;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct ScanFilterStats
+    {
+        public ulong evaluated;
+        public ulong accepted;
+        public ulong rejected;
+        public ulong unmatched;
+        public uint rules;
+    };
+
+    // takes effect when the next scan starts
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetScanFilter")]
+    public static extern bool SetScanFilter([In] ScanFilterRule[] rules, uint count, ScanFilterAction unmatched);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetScanFilterStats")]
+    public static extern uint GetScanFilterStats(out ScanFilterStats stats, [Out] ulong[] ruleHits, uint capacity);
+
     [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
     public struct Service
     {
@@ -62,6 +173,45 @@ public class BleApi
     [DllImport("BleWinrtDll.dll", EntryPoint = "PollCharacteristic")]
     public static extern ScanStatus PollCharacteristic(out Characteristic characteristic, bool block);
 
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DiscoveryOptions
+    {
+        [MarshalAs(UnmanagedType.U1)]
+        public bool readUserDescriptions;
+        public uint maxConcurrentReads;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetDiscoveryOptions")]
+    public static extern bool SetDiscoveryOptions(in DiscoveryOptions options);
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct GattCacheOptions
+    {
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 260)]
+        public string path;
+        [MarshalAs(UnmanagedType.U1)]
+        public bool revalidate;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct GattCacheStats
+    {
+        public uint devices;
+        public ulong hits;
+        public ulong misses;
+        public ulong invalidations;
+        public ulong revalidations;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetGattCacheOptions")]
+    public static extern bool SetGattCacheOptions(in GattCacheOptions options);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "InvalidateGattCache", CharSet = CharSet.Unicode)]
+    public static extern bool InvalidateGattCache(string deviceId);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetGattCacheStats")]
+    public static extern void GetGattCacheStats(out GattCacheStats stats);
+
     [DllImport("BleWinrtDll.dll", EntryPoint = "SubscribeCharacteristic", CharSet = CharSet.Unicode)]
     public static extern bool SubscribeCharacteristic(string deviceId, string serviceId, string characteristicId, bool block);
 
@@ -83,9 +233,251 @@ public class BleApi
     [DllImport("BleWinrtDll.dll", EntryPoint = "PollData")]
     public static extern bool PollData(out BLEData data, bool block);
 
+    // blittable, marshals without managed allocations; requires unsafe code to be enabled in the player settings
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct BLEDataV2
+    {
+        public uint handle;
+        public ushort size;
+        public fixed byte buf[512];
+        public ulong sequence;
+        public ulong receivedNs;
+        public ulong dequeuedNs;
+    };
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct SubscriptionInfo
+    {
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 256)]
+        public string deviceId;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 256)]
+        public string serviceUuid;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 256)]
+        public string characteristicUuid;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SubscribeCharacteristicV2", CharSet = CharSet.Unicode)]
+    public static extern uint SubscribeCharacteristicV2(string deviceId, string serviceId, string characteristicId);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetTimestampNs")]
+    public static extern ulong GetTimestampNs();
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollDataV2")]
+    public static extern bool PollDataV2(out BLEDataV2 data, bool block);
+
+    // reuse the buffer across frames, the array is pinned and filled in place
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollDataBatch")]
+    public static extern uint PollDataBatch([Out] BLEDataV2[] buffer, uint capacity, uint timeoutMs);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollDataFor")]
+    public static extern uint PollDataFor(uint handle, [Out] BLEDataV2[] buffer, uint capacity, uint timeoutMs);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollDataForDevice", CharSet = CharSet.Unicode)]
+    public static extern uint PollDataForDevice(string deviceId, [Out] BLEDataV2[] buffer, uint capacity, uint timeoutMs);
+
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct LatestValue
+    {
+        public uint handle;
+        public ushort size;
+        public fixed byte buf[512];
+        public ulong sequence;
+        public ulong dropped;
+        public ulong receivedNs;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SubscribeCharacteristicLatest", CharSet = CharSet.Unicode)]
+    public static extern uint SubscribeCharacteristicLatest(string deviceId, string serviceId, string characteristicId);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "ReadLatest")]
+    public static extern bool ReadLatest(uint handle, out LatestValue value);
+
+    public enum OverflowPolicy { DROP_NEWEST, DROP_OLDEST, BLOCK };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DataQueueOptions
+    {
+        public uint capacity;
+        public OverflowPolicy policy;
+        public uint blockTimeoutMs;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DataQueueStats
+    {
+        public ulong enqueued;
+        public ulong dequeued;
+        public ulong droppedNewest;
+        public ulong droppedOldest;
+        public ulong blockedProducers;
+        public uint size;
+        public uint capacity;
+        public uint highWaterMark;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetDataQueueOptions")]
+    public static extern bool SetDataQueueOptions(in DataQueueOptions options);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetDataQueueStats")]
+    public static extern void GetDataQueueStats(out DataQueueStats stats);
+
+    public const uint LATENCY_BUCKETS = 24;
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct QueueStats
+    {
+        public ulong enqueued;
+        public ulong dequeued;
+        public uint size;
+        public uint highWaterMark;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct LatencyHistogram
+    {
+        public ulong count;
+        public ulong sumUs;
+        public ulong maxUs;
+        public fixed ulong buckets[24];
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct CacheStats
+    {
+        public ulong deviceHits;
+        public ulong deviceMisses;
+        public ulong serviceHits;
+        public ulong serviceMisses;
+        public ulong characteristicHits;
+        public ulong characteristicMisses;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct BleStats
+    {
+        public uint version;
+        public uint size;
+        public ulong timestampNs;
+        public QueueStats deviceQueue;
+        public QueueStats serviceQueue;
+        public QueueStats characteristicQueue;
+        public QueueStats connectionQueue;
+        public QueueStats dataQueue;
+        public ulong notifications;
+        public ulong writes;
+        public ulong writeFailures;
+        public LatencyHistogram writeLatency;
+        public CacheStats cache;
+        public QueueStats advertisementQueue;
+        public ulong advertisementsDropped;
+        public ulong writeCompletionsDropped;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DeviceStats
+    {
+        public ulong address;
+        public ulong notifications;
+        public ulong notificationBytes;
+        public ulong writes;
+        public ulong writeBytes;
+    };
+
+    // set stats.size = (uint)Marshal.SizeOf<BleStats>() before calling
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetStats")]
+    public static extern bool GetStats(ref BleStats stats);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetDeviceStats")]
+    public static extern uint GetDeviceStats([Out] DeviceStats[] devices, uint capacity);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetSubscriptionInfo")]
+    public static extern bool GetSubscriptionInfo(uint handle, out SubscriptionInfo info);
+
     [DllImport("BleWinrtDll.dll", EntryPoint = "SendData")]
     public static extern bool SendData(in BLEData data, bool block);
 
+    public enum SubscriptionMode { QUEUED, LATEST };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "ResolveCharacteristic", CharSet = CharSet.Unicode)]
+    public static extern uint ResolveCharacteristic(string deviceId, string serviceId, string characteristicId);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SendDataByHandle")]
+    public static extern bool SendDataByHandle(uint handle, byte[] data, ushort size, bool block);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SubscribeByHandle")]
+    public static extern bool SubscribeByHandle(uint handle, SubscriptionMode mode);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "UnsubscribeByHandle")]
+    public static extern bool UnsubscribeByHandle(uint handle);
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct PlanEntry
+    {
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+        public string serviceUuid;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+        public string characteristicUuid;
+        public SubscriptionMode mode;
+    };
+
+    public enum PlanStatus { SUBSCRIBED, RESOLVE_FAILED, SUBSCRIBE_FAILED, CANCELLED };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PlanEntryResult
+    {
+        public PlanStatus status;
+        public uint handle;
+        public ulong resolvedNs;
+        public ulong readyNs;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "ConnectWithPlan", CharSet = CharSet.Unicode)]
+    public static extern bool ConnectWithPlan(string deviceId, [In] PlanEntry[] entries, uint count, [Out] PlanEntryResult[] results, out ulong readyNs);
+
+    public enum WriteStatus { SUCCESS, UNREACHABLE, PROTOCOL_ERROR, ACCESS_DENIED, FAILED, CANCELLED };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct WriteCompletion
+    {
+        public uint writeId;
+        public uint handle;
+        public WriteStatus status;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct WriteOptions
+    {
+        public uint maxInFlight;
+        public uint maxQueued;
+        [MarshalAs(UnmanagedType.U1)]
+        public bool coalesce;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "QueueWrite")]
+    public static extern uint QueueWrite(uint handle, byte[] data, ushort size);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "PollWriteCompletion")]
+    public static extern bool PollWriteCompletion(out WriteCompletion completion, bool block);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetWriteOptions")]
+    public static extern bool SetWriteOptions(in WriteOptions options);
+
+    [Flags]
+    public enum BleEvent : uint
+    {
+        DEVICE = 1 << 0,
+        SERVICE = 1 << 1,
+        CHARACTERISTIC = 1 << 2,
+        CONNECTION = 1 << 3,
+        DATA = 1 << 4,
+        WRITE_COMPLETION = 1 << 5,
+        ADVERTISEMENT = 1 << 6,
+        ALL = (1 << 7) - 1
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "WaitEvents")]
+    public static extern BleEvent WaitEvents(BleEvent mask, uint timeoutMs, uint spinUs);
+
     [DllImport("BleWinrtDll.dll", EntryPoint = "Quit")]
     public static extern void Quit();
 
@@ -98,4 +490,72 @@ public class BleApi
 
     [DllImport("BleWinrtDll.dll", EntryPoint = "GetError")]
     public static extern void GetError(out ErrorMessage buf);
+
+    public enum ErrorCode { FAILED, INVALID_ARGUMENT, NOT_FOUND, COMMUNICATION, EXCEPTION };
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct ErrorEntry
+    {
+        public ulong sequence;
+        public ulong timestampNs;
+        public ulong operation;
+        public ErrorCode code;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string message;
+    };
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetErrors")]
+    public static extern uint GetErrors([Out] ErrorEntry[] buffer, uint capacity);
+
+    public enum LogLevel { VERBOSE, INFO, WARNING, FAILURE, OFF };
+
+    [Flags]
+    public enum LogCategory : uint
+    {
+        RADIO = 1 << 0,
+        SCAN = 1 << 1,
+        CONNECTION = 1 << 2,
+        GATT = 1 << 3,
+        DATA = 1 << 4,
+        ERRORS = 1 << 5,
+        ALL = (1 << 6) - 1
+    };
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    public struct LogRecord
+    {
+        public ulong timestampNs;
+        public LogLevel level;
+        public LogCategory category;
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string message;
+    };
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct LogStats
+    {
+        public ulong written;
+        public ulong delivered;
+        public ulong dropped;
+    };
+
+    // called from a background thread; keep the delegate referenced while it is set
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    public delegate void LogSink(string message);
+
+    // records points to count LogRecord structs, read them with Marshal.PtrToStructure before returning
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    public delegate void LogBatchSink(IntPtr records, uint count);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetLogSink")]
+    public static extern void SetLogSink(LogSink sink);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetLogBatchSink")]
+    public static extern void SetLogBatchSink(LogBatchSink sink);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "SetLogFilter")]
+    public static extern bool SetLogFilter(LogLevel level, LogCategory categories);
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "GetLogStats")]
+    public static extern void GetLogStats(out LogStats stats);
 }
\ No newline at end of file
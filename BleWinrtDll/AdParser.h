@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Parser of the AD structures in advertising and scan response payloads (Core Specification Vol 3, Part C, 11).
+// Every structure is a length byte, an AD type and length - 1 bytes of data. Nothing is copied: the results are
+// offsets into the caller's buffer, so the parser runs on recorded payloads just as on live ones.
+namespace AdParser
+{
+    // AD types, see the Assigned Numbers document
+    constexpr uint8_t FLAGS = 0x01;
+    constexpr uint8_t INCOMPLETE_UUID16 = 0x02;
+    constexpr uint8_t COMPLETE_UUID16 = 0x03;
+    constexpr uint8_t INCOMPLETE_UUID32 = 0x04;
+    constexpr uint8_t COMPLETE_UUID32 = 0x05;
+    constexpr uint8_t INCOMPLETE_UUID128 = 0x06;
+    constexpr uint8_t COMPLETE_UUID128 = 0x07;
+    constexpr uint8_t SHORTENED_NAME = 0x08;
+    constexpr uint8_t COMPLETE_NAME = 0x09;
+    constexpr uint8_t TX_POWER = 0x0A;
+    constexpr uint8_t SERVICE_DATA16 = 0x16;
+    constexpr uint8_t SERVICE_DATA32 = 0x20;
+    constexpr uint8_t SERVICE_DATA128 = 0x21;
+    constexpr uint8_t MANUFACTURER_DATA = 0xFF;
+
+    // data of one AD structure as offset and size into the payload
+    struct Field
+    {
+        uint16_t offset = 0;
+        uint16_t size = 0;
+
+        bool Present() const { return size > 0; }
+    };
+
+    struct Structure
+    {
+        uint8_t type;
+        Field data;
+    };
+
+    // Walks the AD structures of a payload. Stops at a zero length byte (the padding of legacy advertisements) or at
+    // the end of the payload; a structure that runs past the end marks the payload as malformed.
+    class Reader
+    {
+    public:
+        Reader(const uint8_t* payload, size_t size) : payload(payload), size(size) {}
+
+        bool Next(Structure& structure)
+        {
+            if (position >= size)
+                return false;
+            uint8_t length = payload[position];
+            if (length == 0)
+            {
+                position = size;
+                return false;
+            }
+            if (position + 1 + length > size)
+            {
+                malformed = true;
+                position = size;
+                return false;
+            }
+            structure.type = payload[position + 1];
+            structure.data.offset = static_cast<uint16_t>(position + 2);
+            structure.data.size = static_cast<uint16_t>(length - 1);
+            position += 1 + length;
+            return true;
+        }
+
+        bool Malformed() const { return malformed; }
+
+    private:
+        const uint8_t* payload;
+        size_t size;
+        size_t position = 0;
+        bool malformed = false;
+    };
+
+    // What ParseAdvertisement found; of repeated AD types only the first structure is recorded.
+    struct Advertisement
+    {
+        uint8_t flags = 0;
+        bool hasFlags = false;
+        int8_t txPower = 0;
+        bool hasTxPower = false;
+        bool completeName = false;
+        bool malformed = false;
+        Field name;             // UTF-8, without terminating nul
+        Field uuid16;           // little endian UUIDs, 2, 4 or 16 bytes each
+        Field uuid32;
+        Field uuid128;
+        Field serviceData;      // UUID of the service (2, 4 or 16 bytes by serviceDataUuidSize) followed by its data
+        uint8_t serviceDataUuidSize = 0;
+        Field manufacturerData; // little endian company identifier followed by the data
+    };
+
+    inline void Remember(Field& field, Field const& data)
+    {
+        if (!field.Present())
+            field = data;
+    }
+
+    // returns false if the payload is malformed; everything up to the broken structure is still reported
+    inline bool ParseAdvertisement(const uint8_t* payload, size_t size, Advertisement& out)
+    {
+        out = Advertisement{};
+        Reader reader(payload, size);
+        Structure structure;
+        while (reader.Next(structure))
+        {
+            auto const& data = structure.data;
+            switch (structure.type)
+            {
+            case FLAGS:
+                if (data.size >= 1 && !out.hasFlags)
+                {
+                    out.flags = payload[data.offset];
+                    out.hasFlags = true;
+                }
+                break;
+            case TX_POWER:
+                if (data.size >= 1 && !out.hasTxPower)
+                {
+                    out.txPower = static_cast<int8_t>(payload[data.offset]);
+                    out.hasTxPower = true;
+                }
+                break;
+            case COMPLETE_NAME:
+                // a complete name wins over a shortened one
+                if (!out.completeName)
+                {
+                    out.name = data;
+                    out.completeName = true;
+                }
+                break;
+            case SHORTENED_NAME:
+                Remember(out.name, data);
+                break;
+            case INCOMPLETE_UUID16:
+            case COMPLETE_UUID16:
+                Remember(out.uuid16, data);
+                break;
+            case INCOMPLETE_UUID32:
+            case COMPLETE_UUID32:
+                Remember(out.uuid32, data);
+                break;
+            case INCOMPLETE_UUID128:
+            case COMPLETE_UUID128:
+                Remember(out.uuid128, data);
+                break;
+            case SERVICE_DATA16:
+            case SERVICE_DATA32:
+            case SERVICE_DATA128:
+            {
+                uint8_t uuidSize = structure.type == SERVICE_DATA16 ? 2 : structure.type == SERVICE_DATA32 ? 4 : 16;
+                if (data.size >= uuidSize && !out.serviceData.Present())
+                {
+                    out.serviceData = data;
+                    out.serviceDataUuidSize = uuidSize;
+                }
+                break;
+            }
+            case MANUFACTURER_DATA:
+                if (data.size >= 2)
+                    Remember(out.manufacturerData, data);
+                break;
+            default:
+                break;
+            }
+        }
+        out.malformed = reader.Malformed();
+        return !out.malformed;
+    }
+
+    inline uint16_t ReadUint16(const uint8_t* bytes)
+    {
+        return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A lazily started thread that calls work whenever pending returns true, checking every period and whenever Wake is
+// called. Stop lets it finish what is pending first. The thread belongs to the object, whose destructor stops it too,
+// so a host that unloads the module or exits without calling Quit never destroys a joinable std::thread. At most one
+// thread runs work at a time: a thread that was stopped from inside its own work (Quit from a callback) keeps running
+// if it is started again before it returned, and otherwise Start waits until it has finished.
+class BackgroundWorker
+{
+public:
+    BackgroundWorker(std::function<bool()> pending, std::function<void()> work, std::chrono::milliseconds period)
+        : pending(std::move(pending)), work(std::move(work)), period(period)
+    {
+    }
+
+    BackgroundWorker(BackgroundWorker const&) = delete;
+    BackgroundWorker& operator=(BackgroundWorker const&) = delete;
+
+    ~BackgroundWorker()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!worker.joinable())
+            return;
+        stop = true;
+        signal.notify_all();
+        // Windows terminates the other threads before it runs the destructors of an exiting process, so the wait is
+        // bounded; and the thread is detached rather than joined, as joining under the loader lock can deadlock.
+        if (worker.get_id() != std::this_thread::get_id())
+            exitSignal.wait_for(guard, std::chrono::seconds(1), [this] { return exited; });
+        worker.detach();
+    }
+
+    void Start()
+    {
+        if (running.load(std::memory_order_acquire))
+            return;
+        std::unique_lock<std::mutex> guard(lock);
+        if (running.load(std::memory_order_relaxed))
+            return;
+        if (worker.joinable())
+        {
+            if (worker.get_id() == std::this_thread::get_id())
+            {
+                // started again from inside work after a Stop, the loop just carries on
+                stop = false;
+                running.store(true, std::memory_order_release);
+                return;
+            }
+            exitSignal.wait(guard, [this] { return exited; });
+            worker.join();
+        }
+        stop = false;
+        exited = false;
+        worker = std::thread(&BackgroundWorker::Run, this);
+        running.store(true, std::memory_order_release);
+    }
+
+    // Waits until the thread finished what is pending and ended. From inside work it only asks the thread to end once
+    // work returns.
+    void Stop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!worker.joinable())
+            return;
+        stop = true;
+        running.store(false, std::memory_order_release);
+        signal.notify_all();
+        if (worker.get_id() == std::this_thread::get_id())
+            return;
+        exitSignal.wait(guard, [this] { return exited; });
+        worker.join();
+    }
+
+    // doesn't take the lock; a wake that slips in before the thread waits is covered by the period
+    void Wake() { signal.notify_one(); }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;)
+        {
+            signal.wait_for(guard, period, [this] { return stop || pending(); });
+            if (!pending())
+            {
+                if (stop)
+                    break;
+                continue;
+            }
+            guard.unlock();
+            work();
+            guard.lock();
+        }
+        exited = true;
+        exitSignal.notify_all();
+    }
+
+    std::function<bool()> pending;
+    std::function<void()> work;
+    std::chrono::milliseconds period;
+
+    std::mutex lock;
+    std::condition_variable signal;
+    std::condition_variable exitSignal;
+    std::thread worker;
+    bool stop = false;
+    bool exited = false;
+    std::atomic<bool> running{ false };
+};
@@ -0,0 +1,1847 @@
+// BleCore.cpp : backend-neutral part of the exported API, see BleCore.h.
+
+#include "BleCore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <queue>
+#include <thread>
+#include <utility>
+
+#include "BleWinrtDll.h"
+#include "AdParser.h"
+#include "BackgroundWorker.h"
+#include "ErrorJournal.h"
+#include "FlatTable.h"
+#include "RingBuffer.h"
+#include "ScanFilter.h"
+
+using namespace std;
+
+#define __WFILE__ L"BleCore.cpp"
+
+// ---- errors and log ----
+
+ErrorJournal errorJournal(ERROR_JOURNAL_SIZE);
+// GetError reports "Ok" as long as no error newer than this was raised
+atomic<uint64_t> errorsClearedThrough{ 0 };
+atomic<uint64_t> lastOperation{ 0 };
+thread_local uint64_t currentOperation = 0;
+
+atomic<int32_t> logLevel{ static_cast<int32_t>(LogLevel::INFO) };
+atomic<uint32_t> logCategories{ BLE_LOG_ALL };
+atomic<BleLogSinkFn> logSink{ nullptr };
+atomic<BleLogBatchSinkFn> logBatchSink{ nullptr };
+BoundedRing<LogRecord> logRing(LOG_RING_SIZE);
+atomic<uint64_t> logWritten{ 0 };
+atomic<uint64_t> logDelivered{ 0 };
+atomic<uint64_t> logDropped{ 0 };
+
+// drainer thread only, see logDrainer
+uint64_t drainedThrough = 0;
+LogRecord drainBatch[LOG_BATCH_SIZE];
+
+OperationScope::OperationScope() : outermost(currentOperation == 0)
+{
+	if (outermost)
+		currentOperation = lastOperation.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+OperationScope::~OperationScope()
+{
+	if (outermost)
+		currentOperation = 0;
+}
+
+bool LogPending()
+{
+	return errorJournal.Last() > drainedThrough || logRing.Size() > 0;
+}
+
+void DeliverLog(uint32_t count)
+{
+	if (auto batchSink = logBatchSink.load(memory_order_acquire))
+		batchSink(drainBatch, count);
+	else if (auto sink = logSink.load(memory_order_acquire)) {
+		for (uint32_t i = 0; i < count; i++)
+			sink(drainBatch[i].message);
+	}
+	else {
+		for (uint32_t i = 0; i < count; i++)
+			wcout << drainBatch[i].message << L'\n';
+		wcout.flush();
+	}
+	logDelivered.fetch_add(count, memory_order_relaxed);
+}
+
+// errors first, then the ring, in batches of up to LOG_BATCH_SIZE records
+void DrainPending()
+{
+	uint32_t count = 0;
+	ErrorEntry entry;
+	for (auto last = errorJournal.Last(); drainedThrough < last; drainedThrough++) {
+		auto sequence = drainedThrough + 1;
+		bool lost = false;
+		// the entry may still be written; it is lost once a newer one took its slot
+		while (!errorJournal.Read(sequence, entry)) {
+			if (errorJournal.Last() - sequence >= errorJournal.Capacity()) {
+				lost = true;
+				break;
+			}
+			this_thread::yield();
+		}
+		if (!LogEnabled(LogLevel::FAILURE, BLE_LOG_ERRORS))
+			continue;
+		if (lost) {
+			logDropped.fetch_add(1, memory_order_relaxed);
+			continue;
+		}
+		logWritten.fetch_add(1, memory_order_relaxed);
+		auto& record = drainBatch[count++];
+		record.timestampNs = entry.timestampNs;
+		record.level = LogLevel::FAILURE;
+		record.category = BLE_LOG_ERRORS;
+		CopyString(record.message, entry.message);
+		if (count == LOG_BATCH_SIZE) {
+			DeliverLog(count);
+			count = 0;
+		}
+	}
+	while (auto popped = logRing.TryPopBulk(drainBatch + count, LOG_BATCH_SIZE - count)) {
+		count += static_cast<uint32_t>(popped);
+		if (count == LOG_BATCH_SIZE) {
+			DeliverLog(count);
+			count = 0;
+		}
+	}
+	if (count > 0)
+		DeliverLog(count);
+}
+
+// The drainer hands the error journal and the log ring to the sink or the console. The first error or log record
+// starts it and Quit stops it once it caught up; what is raised while quitting waits until it starts again.
+BackgroundWorker logDrainer(LogPending, DrainPending, chrono::milliseconds(100));
+
+void StartLogDrainer()
+{
+	if (!ShouldQuit())
+		logDrainer.Start();
+}
+
+void clearError() {
+	errorsClearedThrough.store(errorJournal.Last(), memory_order_relaxed);
+}
+
+void saveErrorV(ErrorCode code, const wchar_t* message, va_list args) {
+	ErrorEntry entry;
+	vswprintf(entry.message, sizeof(entry.message) / sizeof(entry.message[0]), message, args);
+	entry.message[sizeof(entry.message) / sizeof(entry.message[0]) - 1] = L'\0';
+	entry.timestampNs = TimestampNs();
+	entry.operation = currentOperation;
+	entry.code = code;
+	errorJournal.Append(entry);
+	StartLogDrainer();
+	logDrainer.Wake();
+}
+
+void saveError(const wchar_t* message, ...) {
+	va_list args;
+	va_start(args, message);
+	saveErrorV(ErrorCode::FAILED, message, args);
+	va_end(args);
+}
+
+void saveError(ErrorCode code, const wchar_t* message, ...) {
+	va_list args;
+	va_start(args, message);
+	saveErrorV(code, message, args);
+	va_end(args);
+}
+
+void GetError(ErrorMessage* buf) {
+	auto cleared = errorsClearedThrough.load(memory_order_relaxed);
+	ErrorEntry entry;
+	// the newest entry may still be written, fall back to the one before
+	for (auto sequence = errorJournal.Last(); sequence > cleared; sequence--) {
+		if (errorJournal.Read(sequence, entry)) {
+			CopyString(buf->msg, entry.message);
+			return;
+		}
+		if (errorJournal.Last() - sequence >= errorJournal.Capacity())
+			break;
+	}
+	CopyString(buf->msg, L"Ok");
+}
+
+uint32_t GetErrors(ErrorEntry* buffer, uint32_t capacity) {
+	if (buffer == nullptr)
+		return 0;
+	return errorJournal.Recent(buffer, capacity);
+}
+
+void Log(LogLevel level, uint32_t category, const wchar_t* message, ...) {
+	auto timestampNs = TimestampNs();
+	va_list args;
+	va_start(args, message);
+	bool pushed = logRing.TryPushWith([&](LogRecord& record) {
+		record.timestampNs = timestampNs;
+		record.level = level;
+		record.category = category;
+		vswprintf(record.message, sizeof(record.message) / sizeof(record.message[0]), message, args);
+		record.message[sizeof(record.message) / sizeof(record.message[0]) - 1] = L'\0';
+	});
+	va_end(args);
+	if (!pushed) {
+		logDropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	logWritten.fetch_add(1, memory_order_relaxed);
+	StartLogDrainer();
+	// the drainer polls every 100 ms anyway, only wake it for the first record of a batch
+	if (logRing.Size() == 1)
+		logDrainer.Wake();
+}
+
+bool SetLogFilter(LogLevel level, uint32_t categories) {
+	if (level < LogLevel::VERBOSE || level > LogLevel::OFF) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d Unknown log level %d.", __WFILE__, __LINE__, static_cast<int32_t>(level));
+		return false;
+	}
+	logLevel.store(static_cast<int32_t>(level), memory_order_relaxed);
+	logCategories.store(categories, memory_order_relaxed);
+	clearError();
+	return true;
+}
+
+void SetLogSink(BleLogSinkFn sink) {
+	logSink.store(sink, memory_order_release);
+}
+
+void SetLogBatchSink(BleLogBatchSinkFn sink) {
+	logBatchSink.store(sink, memory_order_release);
+}
+
+void GetLogStats(LogStats* stats) {
+	if (stats == nullptr)
+		return;
+	stats->written = logWritten.load(memory_order_relaxed);
+	stats->delivered = logDelivered.load(memory_order_relaxed);
+	stats->dropped = logDropped.load(memory_order_relaxed);
+}
+
+atomic<bool> quitFlag{ false };
+
+void RequestQuit() {
+	quitFlag.store(true, memory_order_release);
+}
+
+void ResetQuit() {
+	quitFlag.store(false, memory_order_release);
+}
+
+bool ShouldQuit() {
+	return quitFlag.load(memory_order_acquire);
+}
+
+bool QuittableWait(condition_variable& signal, unique_lock<mutex>& waitLock) {
+	if (ShouldQuit())
+		return true;
+	signal.wait(waitLock);
+	return ShouldQuit();
+}
+
+uint64_t TimestampNs()
+{
+	return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint64_t GetTimestampNs()
+{
+	return TimestampNs();
+}
+
+bool ParseDeviceAddress(const wchar_t* deviceId, uint64_t& address)
+{
+	size_t length = wcslen(deviceId);
+	if (length < 17)
+		return false;
+	const wchar_t* p = deviceId + length - 17;
+	uint64_t result = 0;
+	for (int i = 0; i < 17; i++) {
+		wchar_t c = p[i];
+		if (i % 3 == 2) {
+			if (c != L':')
+				return false;
+			continue;
+		}
+		uint64_t digit;
+		if (c >= L'0' && c <= L'9')
+			digit = c - L'0';
+		else if (c >= L'a' && c <= L'f')
+			digit = 10 + c - L'a';
+		else if (c >= L'A' && c <= L'F')
+			digit = 10 + c - L'A';
+		else
+			return false;
+		result = (result << 4) | digit;
+	}
+	address = result;
+	return true;
+}
+
+// ---- statistics ----
+
+QueueCounter deviceQueueCounter;
+QueueCounter serviceQueueCounter;
+QueueCounter characteristicQueueCounter;
+QueueCounter connectionQueueCounter;
+CacheCounters cacheCounters;
+Log2Histogram<LATENCY_BUCKETS> writeLatencyUs;
+atomic<uint64_t> writeFailures{ 0 };
+// only locked to hand out references and for snapshots
+FlatTable<uint64_t, shared_ptr<DeviceCounters>> deviceCounters;
+mutex deviceCountersLock;
+
+shared_ptr<DeviceCounters> CountersFor(uint64_t address)
+{
+	lock_guard guard(deviceCountersLock);
+	auto& counters = deviceCounters.Insert(address);
+	if (!counters)
+	{
+		counters = make_shared<DeviceCounters>();
+		counters->address = address;
+	}
+	return counters;
+}
+
+void RecordWrite(DeviceCounters* counters, uint32_t writes, size_t bytes, uint64_t startNs, bool succeeded)
+{
+	writeLatencyUs.Record((TimestampNs() - startNs) / 1000);
+	if (!succeeded)
+		writeFailures.fetch_add(writes, memory_order_relaxed);
+	if (counters != nullptr) {
+		counters->writes.fetch_add(writes, memory_order_relaxed);
+		counters->writeBytes.fetch_add(bytes, memory_order_relaxed);
+	}
+}
+
+// ---- handles ----
+
+// The low bits of a handle are index + 1 into handleTable, the high bits a generation that is bumped whenever the
+// entry is invalidated (DisconnectDevice, Quit), so that stale handles are rejected instead of silently reaching a new
+// connection. The identity strings are formatted once at registration; the legacy PollData expands them from here.
+constexpr uint32_t HANDLE_INDEX_BITS = 20;
+constexpr uint32_t HANDLE_INDEX_MASK = (1u << HANDLE_INDEX_BITS) - 1;
+constexpr uint32_t HANDLE_GENERATION_MASK = (1u << (32 - HANDLE_INDEX_BITS)) - 1;
+struct HandleEntry {
+	SubscriptionInfo info;
+	CharacteristicId id;
+	uint32_t generation = 0;
+	bool valid = false;
+	// set by the first subscription of either mode; shared with the notification sink which may outlive the entry
+	shared_ptr<DataShard> shard;
+	shared_ptr<LatestSlot> latest;
+	shared_ptr<DeviceCounters> counters;
+};
+deque<HandleEntry> handleTable;
+// index + 1 into handleTable per characteristic identity
+FlatTable<CharacteristicId, uint32_t> handleIndex;
+mutex handleTableLock;
+
+uint32_t MakeHandle(size_t index, uint32_t generation)
+{
+	return (generation << HANDLE_INDEX_BITS) | static_cast<uint32_t>(index + 1);
+}
+
+// identity of a handle, also for stale handles as an index always refers to the same characteristic; expects
+// handleTableLock to be held
+HandleEntry* FindHandleEntry(uint32_t handle)
+{
+	uint32_t index = handle & HANDLE_INDEX_MASK;
+	if (index == 0 || index > handleTable.size())
+		return nullptr;
+	return &handleTable[index - 1];
+}
+
+// like FindHandleEntry, but only for handles that are still valid
+HandleEntry* FindValidHandleEntry(uint32_t handle)
+{
+	auto* entry = FindHandleEntry(handle);
+	if (entry == nullptr || !entry->valid || (handle >> HANDLE_INDEX_BITS) != entry->generation)
+		return nullptr;
+	return entry;
+}
+
+uint32_t RegisterHandle(CharacteristicId const& id, const wchar_t* deviceId)
+{
+	auto counters = CountersFor(id.address);
+
+	lock_guard guard(handleTableLock);
+	auto& index = handleIndex.Insert(id);
+	if (index == 0)
+	{
+		if (handleTable.size() >= HANDLE_INDEX_MASK)
+		{
+			handleIndex.Erase(id);
+			saveError(L"%ls:%d Out of characteristic handles.", __WFILE__, __LINE__);
+			return 0;
+		}
+		HandleEntry entry{};
+		entry.id = id;
+		entry.counters = move(counters);
+		CopyString(entry.info.deviceId, deviceId);
+		GuidCodec::Format(id.service, entry.info.serviceUuid, GuidCodec::FormattedCapacity);
+		GuidCodec::Format(id.characteristic, entry.info.characteristicUuid, GuidCodec::FormattedCapacity);
+		handleTable.push_back(move(entry));
+		index = static_cast<uint32_t>(handleTable.size());
+	}
+	auto& entry = handleTable[index - 1];
+	entry.valid = true;
+	return MakeHandle(index - 1, entry.generation);
+}
+
+bool IsValidHandle(uint32_t handle)
+{
+	lock_guard guard(handleTableLock);
+	return FindValidHandleEntry(handle) != nullptr;
+}
+
+void RetireDataShards(vector<shared_ptr<DataShard>> const& retired);
+
+void InvalidateHandles(uint64_t address)
+{
+	vector<shared_ptr<DataShard>> retired;
+	{
+		lock_guard guard(handleTableLock);
+		for (auto& entry : handleTable)
+		{
+			if (address != 0 && entry.id.address != address)
+				continue;
+			if (entry.valid)
+				entry.generation = (entry.generation + 1) & HANDLE_GENERATION_MASK;
+			entry.valid = false;
+			entry.latest = nullptr;
+			if (entry.shard)
+				retired.push_back(move(entry.shard));
+		}
+	}
+	RetireDataShards(retired);
+}
+
+bool GetSubscriptionInfo(uint32_t handle, SubscriptionInfo* info)
+{
+	lock_guard guard(handleTableLock);
+	auto* entry = FindHandleEntry(handle);
+	if (entry == nullptr)
+		return false;
+	*info = entry->info;
+	return true;
+}
+
+// ---- data queue ----
+
+// Every queued subscription has its own lock-free ring, a shard, so producers of different characteristics never
+// touch the same queue. PollData, PollDataV2 and PollDataBatch merge the shards round robin; PollDataFor and
+// PollDataForDevice drain a subset. The mutex and condition variable are only used to park blocking pollers, producers
+// touch them only if someone is actually waiting.
+constexpr size_t DATA_QUEUE_CAPACITY = 4096;
+
+struct DataShard {
+	DataShard(uint64_t address, size_t capacity) : address(address), ring(capacity) {}
+
+	uint64_t address;
+	BoundedRing<BLEDataV2> ring;
+	// set when the handle is invalidated; the shard leaves the merge once it is drained
+	atomic<bool> retired{ false };
+	// written by the producer of this shard only, summed up by GetDataQueueStats
+	atomic<uint64_t> enqueued{ 0 };
+	atomic<uint64_t> droppedNewest{ 0 };
+	atomic<uint64_t> droppedOldest{ 0 };
+	atomic<uint64_t> blockedProducers{ 0 };
+	atomic<uint32_t> highWaterMark{ 0 };
+};
+
+using DataShardList = vector<shared_ptr<DataShard>>;
+
+// copy on write; pollers keep a reference to the current list and scan it without holding the lock, and only come
+// back for a new one when the version changed
+shared_ptr<const DataShardList> dataShards = make_shared<const DataShardList>();
+atomic<uint64_t> dataShardsVersion{ 1 };
+mutex dataShardsLock;
+// set by a poller that found a drained, retired shard
+atomic<bool> dataShardsPrune{ false };
+// start of the next round robin pass
+atomic<size_t> dataShardCursor{ 0 };
+atomic<size_t> dataShardCapacity{ DATA_QUEUE_CAPACITY };
+
+mutex dataQueueLock;
+condition_variable dataQueueSignal;
+atomic<uint32_t> dataQueueWaiters{ 0 };
+
+// overflow handling, see OverflowPolicy; producers blocked on a full shard park on dataSpaceSignal
+atomic<OverflowPolicy> dataQueuePolicy{ OverflowPolicy::DROP_NEWEST };
+atomic<uint32_t> dataQueueBlockTimeoutMs{ 10 };
+mutex dataSpaceLock;
+condition_variable dataSpaceSignal;
+atomic<uint32_t> dataSpaceWaiters{ 0 };
+
+struct DataQueueTotals {
+	uint64_t enqueued = 0;
+	uint64_t droppedNewest = 0;
+	uint64_t droppedOldest = 0;
+	uint64_t blockedProducers = 0;
+	uint32_t size = 0;
+	uint32_t highWaterMark = 0;
+
+	void Add(DataShard const& shard) {
+		enqueued += shard.enqueued.load(memory_order_relaxed);
+		droppedNewest += shard.droppedNewest.load(memory_order_relaxed);
+		droppedOldest += shard.droppedOldest.load(memory_order_relaxed);
+		blockedProducers += shard.blockedProducers.load(memory_order_relaxed);
+		size += static_cast<uint32_t>(shard.ring.Size());
+		highWaterMark = max(highWaterMark, shard.highWaterMark.load(memory_order_relaxed));
+	}
+};
+// counters of the shards that left the list; guarded by dataShardsLock
+DataQueueTotals retiredShardTotals;
+atomic<uint64_t> dataQueueDequeued{ 0 };
+
+// drops drained, retired shards and publishes the list; expects dataShardsLock to be held
+void PublishDataShards(DataShardList&& shards)
+{
+	auto drained = remove_if(shards.begin(), shards.end(), [](shared_ptr<DataShard> const& shard) {
+		if (!shard->retired.load(memory_order_relaxed) || !shard->ring.Empty())
+			return false;
+		retiredShardTotals.Add(*shard);
+		return true;
+	});
+	shards.erase(drained, shards.end());
+	dataShards = make_shared<const DataShardList>(move(shards));
+	dataShardsVersion.fetch_add(1, memory_order_release);
+}
+
+// current list of shards, valid until the calling thread asks again
+const DataShardList& DataShards()
+{
+	thread_local shared_ptr<const DataShardList> cached;
+	thread_local uint64_t cachedVersion = 0;
+	if (dataShardsPrune.load(memory_order_relaxed) || dataShardsVersion.load(memory_order_acquire) != cachedVersion) {
+		lock_guard guard(dataShardsLock);
+		if (dataShardsPrune.exchange(false, memory_order_relaxed))
+			PublishDataShards(DataShardList(*dataShards));
+		cached = dataShards;
+		cachedVersion = dataShardsVersion.load(memory_order_relaxed);
+	}
+	return *cached;
+}
+
+shared_ptr<DataShard> AddDataShard(uint64_t address)
+{
+	auto shard = make_shared<DataShard>(address, dataShardCapacity.load(memory_order_relaxed));
+	lock_guard guard(dataShardsLock);
+	DataShardList shards(*dataShards);
+	shards.push_back(shard);
+	PublishDataShards(move(shards));
+	return shard;
+}
+
+// shards of invalidated handles keep their notifications for the merged polls until drained
+void RetireDataShards(vector<shared_ptr<DataShard>> const& retired)
+{
+	if (retired.empty())
+		return;
+	for (auto const& shard : retired)
+		shard->retired.store(true, memory_order_relaxed);
+	lock_guard guard(dataShardsLock);
+	PublishDataShards(DataShardList(*dataShards));
+}
+
+// blocks a producer until the consumer made room, see OverflowPolicy::BLOCK
+bool WaitForDataSpace(DataShard& shard, BLEDataV2 const& data)
+{
+	shard.blockedProducers.fetch_add(1, memory_order_relaxed);
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(dataQueueBlockTimeoutMs.load(memory_order_relaxed));
+	unique_lock<mutex> lock(dataSpaceLock);
+	dataSpaceWaiters.fetch_add(1, memory_order_seq_cst);
+	atomic_thread_fence(memory_order_seq_cst);
+	bool pushed = false;
+	while (!(pushed = shard.ring.TryPush(data)) && !ShouldQuit()) {
+		if (dataSpaceSignal.wait_until(lock, deadline) == cv_status::timeout) {
+			pushed = shard.ring.TryPush(data);
+			break;
+		}
+	}
+	dataSpaceWaiters.fetch_sub(1, memory_order_relaxed);
+	return pushed;
+}
+
+void PublishData(DataShard& shard, BLEDataV2 const& data)
+{
+	auto& ring = shard.ring;
+	if (!ring.TryPush(data)) {
+		switch (dataQueuePolicy.load(memory_order_relaxed)) {
+		case OverflowPolicy::DROP_OLDEST: {
+			BLEDataV2 evicted;
+			bool pushed = false;
+			while (!pushed && ring.TryPop(evicted)) {
+				shard.droppedOldest.fetch_add(1, memory_order_relaxed);
+				pushed = ring.TryPush(data);
+			}
+			if (!pushed && !ring.TryPush(data)) {
+				shard.droppedNewest.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			break;
+		}
+		case OverflowPolicy::BLOCK:
+			if (!WaitForDataSpace(shard, data)) {
+				shard.droppedNewest.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			break;
+		default:
+			// consumer is not keeping up, drop the newest sample instead of growing without bound
+			shard.droppedNewest.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+	}
+	shard.enqueued.fetch_add(1, memory_order_relaxed);
+
+	AtomicMax(shard.highWaterMark, static_cast<uint32_t>(ring.Size()));
+
+	// pairs with the fence after a poller registers: either it sees the value or we see the poller. Without it the
+	// load may be ordered before the push's release store, and both sides miss each other.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (dataQueueWaiters.load(memory_order_seq_cst) > 0) {
+		// taking the lock orders the notify after the waiter's last emptiness check; all waiters, as a selective
+		// poller may not be interested in this shard
+		lock_guard queueGuard(dataQueueLock);
+		dataQueueSignal.notify_all();
+	}
+	SignalEvents(BLE_EVENT_DATA);
+}
+
+// bookkeeping after a poller took count entries out of the shards
+void DataDequeued(BLEDataV2* data, size_t count)
+{
+	if (count == 0)
+		return;
+	auto now = TimestampNs();
+	for (size_t i = 0; i < count; i++)
+		data[i].dequeuedNs = now;
+	dataQueueDequeued.fetch_add(count, memory_order_relaxed);
+	// pairs with the fence in WaitForDataSpace, see PublishData
+	atomic_thread_fence(memory_order_seq_cst);
+	if (dataSpaceWaiters.load(memory_order_seq_cst) > 0) {
+		lock_guard spaceGuard(dataSpaceLock);
+		dataSpaceSignal.notify_all();
+	}
+}
+
+NotificationSink::NotificationSink(uint32_t handle, shared_ptr<DataShard> shard, shared_ptr<LatestSlot> latest, shared_ptr<DeviceCounters> counters)
+	: handle(handle), shard(move(shard)), latest(move(latest)), counters(move(counters))
+{
+}
+
+void NotificationSink::OnValue(uint64_t receivedNs, const uint8_t* data, size_t size)
+{
+	if (ShouldQuit())
+		return;
+
+	auto length = static_cast<uint16_t>(min(size, LatestSlot::MaxSize));
+	counters->notifications.fetch_add(1, memory_order_relaxed);
+	counters->notificationBytes.fetch_add(length, memory_order_relaxed);
+	if (latest) {
+		latest->Write(data, length, receivedNs);
+		return;
+	}
+	// late callbacks after DisconnectDevice would land in a shard that nobody polls anymore
+	if (shard->retired.load(memory_order_relaxed))
+		return;
+
+	BLEDataV2 packet;
+	packet.handle = handle;
+	packet.size = length;
+	memcpy(packet.buf, data, length);
+	packet.sequence = ++sequence;
+	packet.receivedNs = receivedNs;
+	packet.dequeuedNs = 0;
+	PublishData(*shard, packet);
+}
+
+// Pops up to capacity notifications from the shards accepted by filter. Every pass takes at most an even share from
+// each shard, starting one shard further on every call, so that a busy stream can't starve the others. Notifications
+// of one subscription stay in order; across subscriptions, receivedNs tells the order of arrival.
+template <typename Filter>
+uint32_t PopDataShards(BLEDataV2* buffer, uint32_t capacity, Filter const& filter)
+{
+	auto& shards = DataShards();
+	auto count = shards.size();
+	if (count == 0)
+		return 0;
+	auto start = dataShardCursor.fetch_add(1, memory_order_relaxed);
+	uint32_t popped = 0;
+	bool progress = true;
+	while (popped < capacity && progress) {
+		progress = false;
+		auto share = max<uint32_t>(1, static_cast<uint32_t>((capacity - popped) / count));
+		for (size_t i = 0; i < count && popped < capacity; i++) {
+			auto& shard = *shards[(start + i) % count];
+			if (!filter(shard))
+				continue;
+			auto n = static_cast<uint32_t>(shard.ring.TryPopBulk(buffer + popped, min(share, capacity - popped)));
+			if (n == 0 && shard.retired.load(memory_order_relaxed))
+				dataShardsPrune.store(true, memory_order_relaxed);
+			popped += n;
+			progress |= n > 0;
+		}
+	}
+	return popped;
+}
+
+constexpr uint32_t WAIT_FOREVER = UINT32_MAX;
+
+// Runs pop, and if it came back empty, waits up to timeoutMs for producers and runs it again.
+template <typename Pop>
+uint32_t PollDataShards(BLEDataV2* buffer, uint32_t timeoutMs, Pop const& pop)
+{
+	auto count = pop();
+	if (count > 0 || timeoutMs == 0) {
+		DataDequeued(buffer, count);
+		return count;
+	}
+
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	unique_lock<mutex> lock(dataQueueLock);
+	dataQueueWaiters.fetch_add(1, memory_order_seq_cst);
+	// pairs with the fence in PublishData
+	atomic_thread_fence(memory_order_seq_cst);
+	for (;;) {
+		count = pop();
+		if (count > 0 || ShouldQuit())
+			break;
+		if (timeoutMs == WAIT_FOREVER) {
+			if (QuittableWait(dataQueueSignal, lock))
+				break;
+		}
+		else if (dataQueueSignal.wait_until(lock, deadline) == cv_status::timeout) {
+			count = pop();
+			break;
+		}
+	}
+	dataQueueWaiters.fetch_sub(1, memory_order_relaxed);
+	lock.unlock();
+	DataDequeued(buffer, count);
+	return count;
+}
+
+uint32_t PollAllShards(BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs)
+{
+	return PollDataShards(buffer, timeoutMs, [&] { return PopDataShards(buffer, capacity, [](DataShard const&) { return true; }); });
+}
+
+bool PollDataV2(BLEDataV2* data, bool block) {
+	return PollAllShards(data, 1, block ? WAIT_FOREVER : 0) > 0;
+}
+
+uint32_t PollDataBatch(BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs) {
+	if (buffer == nullptr || capacity == 0)
+		return 0;
+	return PollAllShards(buffer, capacity, timeoutMs);
+}
+
+uint32_t PollDataFor(uint32_t handle, BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs) {
+	if (buffer == nullptr || capacity == 0)
+		return 0;
+	shared_ptr<DataShard> shard;
+	{
+		lock_guard guard(handleTableLock);
+		if (auto* entry = FindValidHandleEntry(handle))
+			shard = entry->shard;
+	}
+	if (!shard) {
+		saveError(ErrorCode::NOT_FOUND, L"%ls:%d PollDataFor: handle %u is not a queued subscription.", __WFILE__, __LINE__, handle);
+		return 0;
+	}
+	return PollDataShards(buffer, timeoutMs, [&] { return static_cast<uint32_t>(shard->ring.TryPopBulk(buffer, capacity)); });
+}
+
+uint32_t PollDataForDevice(wchar_t* deviceId, BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs) {
+	if (buffer == nullptr || capacity == 0)
+		return 0;
+	uint64_t address = 0;
+	if (!ParseDeviceAddress(deviceId, address)) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d PollDataForDevice: no device address in %ls.", __WFILE__, __LINE__, deviceId);
+		return 0;
+	}
+	return PollDataShards(buffer, timeoutMs, [&] {
+		return PopDataShards(buffer, capacity, [address](DataShard const& shard) { return shard.address == address; });
+	});
+}
+
+bool PollData(BLEData* data, bool block) {
+	BLEDataV2 packet;
+	if (!PollDataV2(&packet, block))
+		return false;
+
+	data->size = packet.size;
+	memcpy(data->buf, packet.buf, packet.size);
+	lock_guard guard(handleTableLock);
+	if (auto* entry = FindHandleEntry(packet.handle)) {
+		CopyString(data->deviceId, entry->info.deviceId);
+		CopyString(data->serviceUuid, entry->info.serviceUuid);
+		CopyString(data->characteristicUuid, entry->info.characteristicUuid);
+	}
+	else {
+		data->deviceId[0] = data->serviceUuid[0] = data->characteristicUuid[0] = L'\0';
+	}
+	return true;
+}
+
+// discards everything queued and retires all shards; subscribing again creates new ones
+void DiscardDataShards()
+{
+	vector<shared_ptr<DataShard>> retired;
+	{
+		lock_guard guard(handleTableLock);
+		for (auto& entry : handleTable)
+			if (entry.shard)
+				retired.push_back(move(entry.shard));
+	}
+	for (auto const& shard : DataShards())
+		dataQueueDequeued.fetch_add(shard->ring.Clear(), memory_order_relaxed);
+	RetireDataShards(retired);
+}
+
+bool SetDataQueueOptions(DataQueueOptions* options) {
+	auto capacity = dataShardCapacity.load(memory_order_relaxed);
+	if (options->capacity != 0 && BoundedRing<BLEDataV2>::RoundedCapacity(options->capacity) != capacity) {
+		if (Backend().HasSubscriptions()) {
+			saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetDataQueueOptions: capacity can't be changed while subscriptions are active.", __WFILE__, __LINE__);
+			return false;
+		}
+		dataShardCapacity.store(BoundedRing<BLEDataV2>::RoundedCapacity(options->capacity), memory_order_relaxed);
+		DiscardDataShards();
+		lock_guard guard(dataShardsLock);
+		retiredShardTotals.highWaterMark = 0;
+	}
+	dataQueuePolicy.store(options->policy, memory_order_relaxed);
+	dataQueueBlockTimeoutMs.store(options->blockTimeoutMs, memory_order_relaxed);
+	clearError();
+	return true;
+}
+
+DataQueueTotals SumDataShards()
+{
+	lock_guard guard(dataShardsLock);
+	auto totals = retiredShardTotals;
+	totals.size = 0;
+	for (auto const& shard : *dataShards)
+		totals.Add(*shard);
+	return totals;
+}
+
+void GetDataQueueStats(DataQueueStats* stats) {
+	auto totals = SumDataShards();
+	stats->enqueued = totals.enqueued;
+	stats->dequeued = dataQueueDequeued.load(memory_order_relaxed);
+	stats->droppedNewest = totals.droppedNewest;
+	stats->droppedOldest = totals.droppedOldest;
+	stats->blockedProducers = totals.blockedProducers;
+	stats->size = totals.size;
+	stats->capacity = static_cast<uint32_t>(dataShardCapacity.load(memory_order_relaxed));
+	stats->highWaterMark = totals.highWaterMark;
+}
+
+// ---- subscriptions ----
+
+shared_ptr<NotificationSink> MakeSink(uint32_t handle, SubscriptionMode mode)
+{
+	shared_ptr<NotificationSink> sink;
+	{
+		lock_guard guard(handleTableLock);
+		auto* entry = FindValidHandleEntry(handle);
+		if (entry != nullptr) {
+			if (mode == SubscriptionMode::LATEST && !entry->latest)
+				entry->latest = make_shared<LatestSlot>();
+			if (mode == SubscriptionMode::QUEUED && !entry->shard)
+				entry->shard = AddDataShard(entry->id.address);
+			if (mode == SubscriptionMode::LATEST)
+				sink = make_shared<NotificationSink>(handle, nullptr, entry->latest, entry->counters);
+			else
+				sink = make_shared<NotificationSink>(handle, entry->shard, nullptr, entry->counters);
+		}
+	}
+	if (!sink)
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SubscribeByHandle: invalid handle %u.", __WFILE__, __LINE__, handle);
+	return sink;
+}
+
+bool SubscribeByHandle(uint32_t handle, SubscriptionMode mode)
+{
+	OperationScope operation;
+	auto sink = MakeSink(handle, mode);
+	return sink && Backend().Subscribe(handle, sink);
+}
+
+bool UnsubscribeByHandle(uint32_t handle)
+{
+	OperationScope operation;
+	return Backend().Unsubscribe(handle);
+}
+
+bool ReadLatest(uint32_t handle, LatestValue* value)
+{
+	shared_ptr<LatestSlot> slot;
+	{
+		lock_guard guard(handleTableLock);
+		if (auto* entry = FindValidHandleEntry(handle))
+			slot = entry->latest;
+	}
+	if (!slot)
+		return false;
+	value->handle = handle;
+	value->sequence = slot->Read(value->buf, value->size, value->receivedNs, value->dropped);
+	return value->sequence > 0;
+}
+
+// ---- connection plans ----
+
+// State of one ConnectWithPlan call; shared with the backend callbacks, which may outlive the call after Quit.
+struct PlanRun
+{
+	vector<PlanEntryResult> results;
+	vector<SubscriptionMode> modes;
+	uint64_t startNs = 0;
+	uint64_t readyNs = 0;
+	uint32_t pending = 0;
+};
+
+// one lock and signal for all plans, so that ShutdownCore can wake them
+mutex planLock;
+condition_variable planSignal;
+
+void FinishPlanEntry(shared_ptr<PlanRun> const& run, uint32_t index, PlanStatus status)
+{
+	auto now = TimestampNs();
+	lock_guard lock(planLock);
+	auto& result = run->results[index];
+	result.status = status;
+	if (status == PlanStatus::SUBSCRIBED) {
+		result.readyNs = now - run->startNs;
+		run->readyNs = max(run->readyNs, result.readyNs);
+	}
+	if (--run->pending == 0)
+		planSignal.notify_all();
+}
+
+void PlanEntryResolved(shared_ptr<PlanRun> const& run, uint32_t index, uint32_t handle)
+{
+	SubscriptionMode mode;
+	{
+		lock_guard lock(planLock);
+		run->results[index].handle = handle;
+		run->results[index].resolvedNs = TimestampNs() - run->startNs;
+		mode = run->modes[index];
+	}
+	shared_ptr<NotificationSink> sink;
+	if (handle != 0 && !ShouldQuit())
+		sink = MakeSink(handle, mode);
+	if (!sink) {
+		FinishPlanEntry(run, index, handle == 0 ? PlanStatus::RESOLVE_FAILED : PlanStatus::SUBSCRIBE_FAILED);
+		return;
+	}
+	Backend().SubscribeAsync(handle, sink, [run, index](bool subscribed)
+	{
+		FinishPlanEntry(run, index, subscribed ? PlanStatus::SUBSCRIBED : PlanStatus::SUBSCRIBE_FAILED);
+	});
+}
+
+bool ConnectWithPlan(wchar_t* deviceId, PlanEntry* entries, uint32_t count, PlanEntryResult* results, uint64_t* readyNs)
+{
+	OperationScope operation;
+	if (deviceId == nullptr || entries == nullptr || results == nullptr || count == 0 || count > PLAN_MAX_ENTRIES) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d ConnectWithPlan: invalid plan.", __WFILE__, __LINE__);
+		return false;
+	}
+	auto run = make_shared<PlanRun>();
+	run->results.assign(count, PlanEntryResult{ PlanStatus::CANCELLED, 0, 0, 0 });
+	for (uint32_t i = 0; i < count; i++)
+		run->modes.push_back(entries[i].mode);
+	run->pending = count;
+	run->startNs = TimestampNs();
+
+	// every entry resolves its service and characteristic and writes its CCCD on its own; the backend overlaps the
+	// round trips
+	for (uint32_t i = 0; i < count; i++) {
+		Backend().ResolveAsync(deviceId, entries[i].serviceUuid, entries[i].characteristicUuid, [run, i](uint32_t handle)
+		{
+			PlanEntryResolved(run, i, handle);
+		});
+	}
+
+	bool subscribedAll = true;
+	{
+		unique_lock lock(planLock);
+		while (run->pending > 0) {
+			if (QuittableWait(planSignal, lock))
+				break;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			results[i] = run->results[i];
+			subscribedAll &= results[i].status == PlanStatus::SUBSCRIBED;
+		}
+		if (readyNs != nullptr)
+			*readyNs = run->readyNs;
+	}
+	// the failures reported their own errors
+	if (subscribedAll)
+		clearError();
+	return subscribedAll;
+}
+
+// ---- writes ----
+
+shared_ptr<DeviceCounters> ValidHandleCounters(uint32_t handle, uint64_t* address = nullptr)
+{
+	lock_guard guard(handleTableLock);
+	auto* entry = FindValidHandleEntry(handle);
+	if (entry == nullptr)
+		return nullptr;
+	if (address != nullptr)
+		*address = entry->id.address;
+	return entry->counters;
+}
+
+// Writes to a characteristic resolved with ResolveCharacteristic, without the string parsing and cache lookups of
+// SendData.
+bool SendDataByHandle(uint32_t handle, uint8_t* data, uint16_t size, bool block) {
+	OperationScope operation;
+	auto counters = ValidHandleCounters(handle);
+	if (!counters) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SendDataByHandle: invalid handle %u.", __WFILE__, __LINE__, handle);
+		return false;
+	}
+	auto startNs = TimestampNs();
+	if (!block) {
+		Backend().Write(handle, vector<uint8_t>(data, data + size), [handle, size, startNs, counters](WriteStatus status) {
+			RecordWrite(counters.get(), 1, size, startNs, status == WriteStatus::SUCCESS);
+			if (status != WriteStatus::SUCCESS)
+				saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error writing value to handle %u", __WFILE__, __LINE__, handle);
+		});
+		return true;
+	}
+	promise<WriteStatus> done;
+	auto result = done.get_future();
+	Backend().Write(handle, vector<uint8_t>(data, data + size), [&done](WriteStatus status) { done.set_value(status); });
+	auto status = result.get();
+	RecordWrite(counters.get(), 1, size, startNs, status == WriteStatus::SUCCESS);
+	if (status != WriteStatus::SUCCESS) {
+		saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error writing value to handle %u", __WFILE__, __LINE__, handle);
+		return false;
+	}
+	return true;
+}
+
+// Write engine. Every handle written with QueueWrite gets a channel with a FIFO of pending writes. Pumping hands
+// writes from the FIFO to the backend while fewer than maxInFlight are outstanding. Only one thread issues per channel
+// at a time, so the backend sees the writes in queue order; completions report the status and pump again.
+constexpr size_t WRITE_COMPLETION_CAPACITY = 4096;
+
+struct PendingWrite {
+	uint32_t id;
+	vector<uint8_t> data;
+};
+struct WriteChannel {
+	uint64_t address = 0;
+	shared_ptr<DeviceCounters> counters;
+	deque<PendingWrite> pending;
+	uint32_t inFlight = 0;
+	// upper bound for coalesced writes, see SetMaxWritePayload
+	uint16_t maxPayload = ATT_DEFAULT_MTU - ATT_WRITE_HEADER;
+	bool issuing = false;
+};
+// one write handed to the backend, carrying one or more coalesced queued writes
+struct WriteBatch {
+	vector<uint32_t> ids;
+	vector<uint8_t> data;
+};
+
+FlatTable<uint32_t, WriteChannel> writeChannels;
+// negotiated payload per device address, for channels created later
+FlatTable<uint64_t, uint16_t> writePayloads;
+mutex writeLock;
+WriteOptions writeOptions{ 4, 256, false };
+atomic<uint32_t> nextWriteId{ 0 };
+
+queue<WriteCompletion> writeCompletionQueue;
+mutex writeCompletionLock;
+condition_variable writeCompletionSignal;
+atomic<uint64_t> writeCompletionsDropped{ 0 };
+
+void ReportWrites(uint32_t handle, vector<uint32_t> const& ids, WriteStatus status)
+{
+	{
+		lock_guard guard(writeCompletionLock);
+		for (auto id : ids)
+		{
+			// keep the newest if nobody polls completions
+			if (writeCompletionQueue.size() >= WRITE_COMPLETION_CAPACITY)
+			{
+				writeCompletionQueue.pop();
+				writeCompletionsDropped.fetch_add(1, memory_order_relaxed);
+			}
+			writeCompletionQueue.push(WriteCompletion{ id, handle, status });
+		}
+	}
+	writeCompletionSignal.notify_one();
+	SignalEvents(BLE_EVENT_WRITE_COMPLETION);
+}
+
+void SetMaxWritePayload(uint64_t address, uint16_t payload)
+{
+	lock_guard guard(writeLock);
+	writePayloads.Insert(address) = payload;
+	writeChannels.ForEach([&](uint32_t, WriteChannel& channel)
+	{
+		if (channel.address == address)
+			channel.maxPayload = payload;
+	});
+}
+
+// takes writes from the front of the queue while the window allows; expects writeLock to be held
+vector<WriteBatch> TakeWriteBatches(WriteChannel& channel)
+{
+	vector<WriteBatch> batches;
+	while (channel.inFlight < writeOptions.maxInFlight && !channel.pending.empty())
+	{
+		WriteBatch batch;
+		batch.data = move(channel.pending.front().data);
+		batch.ids.push_back(channel.pending.front().id);
+		channel.pending.pop_front();
+		while (writeOptions.coalesce && !channel.pending.empty()
+			&& batch.data.size() + channel.pending.front().data.size() <= channel.maxPayload)
+		{
+			auto& write = channel.pending.front();
+			batch.data.insert(batch.data.end(), write.data.begin(), write.data.end());
+			batch.ids.push_back(write.id);
+			channel.pending.pop_front();
+		}
+		batches.push_back(move(batch));
+		channel.inFlight++;
+	}
+	return batches;
+}
+
+void IssueWrite(DeviceCounters* counters, uint32_t handle, WriteBatch& batch);
+
+void PumpWrites(uint32_t handle)
+{
+	unique_lock lock(writeLock);
+	auto* channel = writeChannels.Find(handle);
+	if (channel == nullptr || channel->issuing)
+		return;
+	channel->issuing = true;
+	for (;;)
+	{
+		auto batches = TakeWriteBatches(*channel);
+		if (batches.empty())
+		{
+			channel->issuing = false;
+			return;
+		}
+		auto counters = channel->counters;
+		// completions may run synchronously, so the backend is called without holding the lock
+		lock.unlock();
+		for (auto& batch : batches)
+			IssueWrite(counters.get(), handle, batch);
+		lock.lock();
+		channel = writeChannels.Find(handle);
+		if (channel == nullptr)
+			return;
+	}
+}
+
+void WriteCompleted(uint32_t handle, vector<uint32_t> const& ids, WriteStatus status)
+{
+	{
+		lock_guard guard(writeLock);
+		if (auto* channel = writeChannels.Find(handle); channel != nullptr && channel->inFlight > 0)
+			channel->inFlight--;
+	}
+	ReportWrites(handle, ids, status);
+	PumpWrites(handle);
+}
+
+// counters is a raw pointer as deviceCounters never drops an entry, so it stays valid after the channel is gone
+void IssueWrite(DeviceCounters* counters, uint32_t handle, WriteBatch& batch)
+{
+	auto startNs = TimestampNs();
+	auto size = batch.data.size();
+	Backend().Write(handle, move(batch.data), [handle, counters, ids = move(batch.ids), size, startNs](WriteStatus status)
+	{
+		RecordWrite(counters, static_cast<uint32_t>(ids.size()), size, startNs, status == WriteStatus::SUCCESS);
+		WriteCompleted(handle, ids, status);
+	});
+}
+
+// drops the queued writes of one device, or of all devices if address is 0, and reports them as cancelled. Writes
+// already handed to the backend still report their own status.
+void CancelWrites(uint64_t address)
+{
+	vector<pair<uint32_t, vector<uint32_t>>> cancelled;
+	{
+		lock_guard guard(writeLock);
+		writeChannels.EraseIf([&](uint32_t handle, WriteChannel& channel)
+		{
+			if (address != 0 && channel.address != address)
+				return false;
+			vector<uint32_t> ids;
+			for (auto const& write : channel.pending)
+				ids.push_back(write.id);
+			if (!ids.empty())
+				cancelled.emplace_back(handle, move(ids));
+			return true;
+		});
+		if (address == 0)
+			writePayloads.Clear();
+		else
+			writePayloads.Erase(address);
+	}
+	for (auto const& [handle, ids] : cancelled)
+		ReportWrites(handle, ids, WriteStatus::CANCELLED);
+}
+
+uint32_t QueueWrite(uint32_t handle, uint8_t* data, uint16_t size)
+{
+	OperationScope operation;
+	uint64_t address = 0;
+	auto counters = ValidHandleCounters(handle, &address);
+	if (!counters)
+	{
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d QueueWrite: invalid handle %u.", __WFILE__, __LINE__, handle);
+		return 0;
+	}
+
+	uint32_t id;
+	{
+		lock_guard guard(writeLock);
+		// CancelWrites of a ReleaseDevice that invalidated the handle since may already have run; a channel created now
+		// would never be erased
+		if (!IsValidHandle(handle))
+		{
+			saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d QueueWrite: invalid handle %u.", __WFILE__, __LINE__, handle);
+			return 0;
+		}
+		auto& channel = writeChannels.Insert(handle);
+		if (!channel.counters)
+		{
+			channel.address = address;
+			channel.counters = move(counters);
+			if (auto* payload = writePayloads.Find(address))
+				channel.maxPayload = *payload;
+		}
+		if (channel.pending.size() >= writeOptions.maxQueued)
+		{
+			saveError(L"%ls:%d QueueWrite: queue of handle %u is full.", __WFILE__, __LINE__, handle);
+			return 0;
+		}
+		do {
+			id = nextWriteId.fetch_add(1, memory_order_relaxed) + 1;
+		} while (id == 0);
+		channel.pending.push_back(PendingWrite{ id, vector<uint8_t>(data, data + size) });
+	}
+
+	PumpWrites(handle);
+	return id;
+}
+
+bool PollWriteCompletion(WriteCompletion* completion, bool block)
+{
+	unique_lock<mutex> lock(writeCompletionLock);
+	while (writeCompletionQueue.empty())
+	{
+		if (!block)
+			return false;
+		if (QuittableWait(writeCompletionSignal, lock))
+			return false;
+	}
+	*completion = writeCompletionQueue.front();
+	writeCompletionQueue.pop();
+	return true;
+}
+
+bool SetWriteOptions(WriteOptions* options)
+{
+	if (options->maxInFlight == 0 || options->maxQueued == 0)
+	{
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetWriteOptions: maxInFlight and maxQueued must be at least 1.", __WFILE__, __LINE__);
+		return false;
+	}
+	lock_guard guard(writeLock);
+	writeOptions = *options;
+	return true;
+}
+
+// ---- discovery ----
+
+DiscoveryOptions discoveryOptions{ true, 4 };
+mutex discoveryOptionsLock;
+
+bool SetDiscoveryOptions(DiscoveryOptions* options)
+{
+	if (options->maxConcurrentReads == 0)
+	{
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetDiscoveryOptions: maxConcurrentReads must be at least 1.", __WFILE__, __LINE__);
+		return false;
+	}
+	lock_guard guard(discoveryOptionsLock);
+	discoveryOptions = *options;
+	return true;
+}
+
+DiscoveryOptions CurrentDiscoveryOptions()
+{
+	lock_guard guard(discoveryOptionsLock);
+	return discoveryOptions;
+}
+
+// ---- connection updates ----
+
+queue<ConnectionUpdate> connectionQueue{};
+mutex connectionQueueLock;
+condition_variable connectionQueueSignal;
+
+void EnqueueConnectionUpdate(const wchar_t* deviceId, int32_t status)
+{
+	if (ShouldQuit())
+		return;
+
+	ConnectionUpdate update{};
+	CopyString(update.deviceId, deviceId);
+	update.status = status;
+	{
+		lock_guard queueLock(connectionQueueLock);
+		connectionQueue.push(update);
+		connectionQueueCounter.Enqueued(connectionQueue.size());
+	}
+	connectionQueueSignal.notify_one();
+	SignalEvents(BLE_EVENT_CONNECTION);
+}
+
+bool PollConnection(ConnectionUpdate* update, bool block)
+{
+	unique_lock<mutex> lock(connectionQueueLock);
+	while (connectionQueue.empty())
+	{
+		if (!block)
+			return false;
+		if (QuittableWait(connectionQueueSignal, lock))
+			return false;
+	}
+	*update = connectionQueue.front();
+	connectionQueue.pop();
+	connectionQueueCounter.Dequeued();
+	return true;
+}
+
+// ---- device table ----
+
+FlatTable<uint64_t, DeviceRecord> deviceTable;
+uint64_t deviceTableGeneration = 0;
+mutex deviceTableLock;
+
+bool MergeDevice(DeviceObservation const& observation)
+{
+	auto const& update = observation.update;
+	uint64_t address = observation.address;
+	if (address == 0 && !ParseDeviceAddress(update.id, address))
+		return false;
+
+	lock_guard guard(deviceTableLock);
+	auto& record = deviceTable.Insert(address);
+	bool changed = record.address == 0;
+	record.address = address;
+	if (wcscmp(record.id, update.id) != 0) {
+		CopyString(record.id, update.id);
+		changed = true;
+	}
+	if (update.nameUpdated && wcscmp(record.name, update.name) != 0) {
+		CopyString(record.name, update.name);
+		changed = true;
+	}
+	if (update.isConnectableUpdated && record.isConnectable != update.isConnectable) {
+		record.isConnectable = update.isConnectable;
+		changed = true;
+	}
+	if (observation.isConnectedUpdated && record.isConnected != observation.isConnected) {
+		record.isConnected = observation.isConnected;
+		changed = true;
+	}
+	record.updates++;
+	record.lastSeenNs = TimestampNs();
+	if (changed)
+		record.generation = ++deviceTableGeneration;
+	return changed;
+}
+
+uint32_t GetDeviceSnapshot(DeviceRecord* buffer, uint32_t capacity, uint64_t sinceGeneration)
+{
+	vector<DeviceRecord const*> changed;
+	lock_guard guard(deviceTableLock);
+	deviceTable.ForEach([&](uint64_t, DeviceRecord& record) {
+		if (record.generation > sinceGeneration)
+			changed.push_back(&record);
+	});
+	if (buffer == nullptr)
+		return static_cast<uint32_t>(changed.size());
+	auto count = min<size_t>(changed.size(), capacity);
+	// oldest changes first, so that the generation of the last record copied continues a truncated snapshot
+	partial_sort(changed.begin(), changed.begin() + count, changed.end(),
+		[](DeviceRecord const* a, DeviceRecord const* b) { return a->generation < b->generation; });
+	for (size_t i = 0; i < count; i++)
+		buffer[i] = *changed[i];
+	return static_cast<uint32_t>(count);
+}
+
+// ---- scan filter ----
+
+// Rules wait here until the next scan start compiles them, so that a scan never sees half of a new rule set.
+vector<ScanFilterRule> scanFilterRules;
+ScanFilterAction scanFilterUnmatched = ScanFilterAction::ACCEPT;
+bool scanFilterChanged = false;
+// null lets everything through
+shared_ptr<ScanMatcher> scanMatcher;
+mutex scanFilterLock;
+
+bool SetScanFilter(ScanFilterRule* rules, uint32_t count, ScanFilterAction unmatched)
+{
+	constexpr uint32_t knownCriteria = SCAN_FILTER_NAME | SCAN_FILTER_SERVICE | SCAN_FILTER_MANUFACTURER
+		| SCAN_FILTER_ADDRESS | SCAN_FILTER_MIN_RSSI;
+	if (count > SCAN_FILTER_MAX_RULES || (count > 0 && rules == nullptr)) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetScanFilter: at most %u rules.", __WFILE__, __LINE__, SCAN_FILTER_MAX_RULES);
+		return false;
+	}
+	if (unmatched != ScanFilterAction::ACCEPT && unmatched != ScanFilterAction::REJECT) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetScanFilter: unknown unmatched action %d.", __WFILE__, __LINE__,
+			static_cast<int>(unmatched));
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		auto const& rule = rules[i];
+		const wchar_t* problem = nullptr;
+		BleGuid service;
+		if (rule.action != ScanFilterAction::ACCEPT && rule.action != ScanFilterAction::REJECT)
+			problem = L"unknown action";
+		else if (rule.criteria & ~knownCriteria)
+			problem = L"unknown criteria";
+		else if ((rule.criteria & SCAN_FILTER_NAME) && rule.name[0] == L'\0')
+			problem = L"empty name";
+		else if ((rule.criteria & SCAN_FILTER_SERVICE) && !GuidCodec::TryParse(rule.serviceUuid, service))
+			problem = L"malformed service UUID";
+		else if ((rule.criteria & SCAN_FILTER_MANUFACTURER) && rule.dataSize > SCAN_FILTER_DATA_SIZE)
+			problem = L"dataSize too large";
+		if (problem != nullptr) {
+			saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SetScanFilter: rule %u: %ls.", __WFILE__, __LINE__, i, problem);
+			return false;
+		}
+	}
+	lock_guard guard(scanFilterLock);
+	scanFilterRules.assign(rules, rules + count);
+	scanFilterUnmatched = unmatched;
+	scanFilterChanged = true;
+	return true;
+}
+
+void CompileScanFilter()
+{
+	lock_guard guard(scanFilterLock);
+	if (!scanFilterChanged)
+		return;
+	scanFilterChanged = false;
+	if (scanFilterRules.empty() && scanFilterUnmatched == ScanFilterAction::ACCEPT)
+		scanMatcher = nullptr;
+	else
+		scanMatcher = make_shared<ScanMatcher>(scanFilterRules.data(), static_cast<uint32_t>(scanFilterRules.size()),
+			scanFilterUnmatched);
+}
+
+shared_ptr<ScanMatcher> CurrentScanMatcher()
+{
+	lock_guard guard(scanFilterLock);
+	return scanMatcher;
+}
+
+bool ScanFilterAccepts(DeviceObservation const& observation)
+{
+	auto matcher = CurrentScanMatcher();
+	if (!matcher)
+		return true;
+	auto const& update = observation.update;
+	ScanSubject subject;
+	subject.address = observation.address;
+	if (subject.address == 0)
+		ParseDeviceAddress(update.id, subject.address);
+	// updates without a name are judged by the name merged into the device table
+	wchar_t name[50] = {};
+	if (update.nameUpdated)
+		CopyString(name, update.name);
+	else {
+		lock_guard guard(deviceTableLock);
+		if (auto* record = deviceTable.Find(subject.address))
+			CopyString(name, record->name);
+	}
+	subject.name = name;
+	return matcher->Accepts(subject);
+}
+
+uint32_t GetScanFilterStats(ScanFilterStats* stats, uint64_t* ruleHits, uint32_t capacity)
+{
+	ScanFilterStats snapshot{};
+	uint32_t rules = 0;
+	if (auto matcher = CurrentScanMatcher())
+		rules = matcher->Snapshot(snapshot, ruleHits, capacity);
+	if (stats != nullptr)
+		*stats = snapshot;
+	return rules;
+}
+
+// ---- advertisements ----
+
+// Filled by the backend's advertisement callback, drained by PollAdvertisements. An advertisement stream is only
+// interesting while it is fresh, so a full queue evicts its oldest entries instead of refusing new ones.
+constexpr size_t ADVERTISEMENT_QUEUE_CAPACITY = 1024;
+BoundedRing<AdvertisementRecord> advertisementQueue(ADVERTISEMENT_QUEUE_CAPACITY);
+QueueCounter advertisementQueueCounter;
+atomic<uint64_t> advertisementsDropped{ 0 };
+mutex advertisementLock;
+condition_variable advertisementSignal;
+atomic<uint32_t> advertisementWaiters{ 0 };
+
+void PublishAdvertisement(uint64_t address, int16_t rssi, uint8_t kind, const uint8_t* payload, size_t size,
+	uint64_t receivedNs)
+{
+	if (ShouldQuit())
+		return;
+
+	AdvertisementRecord record{};
+	record.address = address;
+	record.receivedNs = receivedNs;
+	record.rssi = rssi;
+	record.kind = kind;
+	record.truncated = size > sizeof(record.payload);
+	record.size = static_cast<uint8_t>(min(size, sizeof(record.payload)));
+	memcpy(record.payload, payload, record.size);
+
+	// the views fit into uint8_t as they are offsets into the copied payload
+	AdParser::Advertisement parsed;
+	record.malformed = !AdParser::ParseAdvertisement(record.payload, record.size, parsed);
+	record.flags = parsed.flags;
+	record.txPower = parsed.hasTxPower ? parsed.txPower : BLE_TX_POWER_NONE;
+	auto view = [](AdParser::Field const& field, uint8_t& offset, uint8_t& size) {
+		offset = static_cast<uint8_t>(field.offset);
+		size = static_cast<uint8_t>(field.size);
+	};
+	view(parsed.name, record.nameOffset, record.nameSize);
+	view(parsed.uuid16, record.uuid16Offset, record.uuid16Size);
+	view(parsed.uuid32, record.uuid32Offset, record.uuid32Size);
+	view(parsed.uuid128, record.uuid128Offset, record.uuid128Size);
+	view(parsed.serviceData, record.serviceDataOffset, record.serviceDataSize);
+	record.serviceDataUuidSize = parsed.serviceDataUuidSize;
+	view(parsed.manufacturerData, record.manufacturerDataOffset, record.manufacturerDataSize);
+	if (parsed.manufacturerData.Present())
+		record.companyId = AdParser::ReadUint16(record.payload + parsed.manufacturerData.offset);
+
+	if (auto matcher = CurrentScanMatcher()) {
+		ScanSubject subject;
+		subject.address = address;
+		subject.hasRssi = true;
+		subject.rssi = rssi;
+		subject.payload = record.payload;
+		subject.advertisement = &parsed;
+		if (parsed.name.Present()) {
+			subject.nameUtf8 = record.payload + parsed.name.offset;
+			subject.nameUtf8Size = parsed.name.size;
+		}
+		if (!matcher->Accepts(subject))
+			return;
+	}
+
+	while (!advertisementQueue.TryPush(record)) {
+		AdvertisementRecord evicted;
+		if (advertisementQueue.TryPop(evicted)) {
+			advertisementsDropped.fetch_add(1, memory_order_relaxed);
+			advertisementQueueCounter.Dequeued();
+		}
+	}
+	advertisementQueueCounter.Enqueued(advertisementQueue.Size());
+	// pairs with the fence in PollAdvertisements, see PublishData
+	atomic_thread_fence(memory_order_seq_cst);
+	if (advertisementWaiters.load(memory_order_seq_cst) > 0) {
+		lock_guard guard(advertisementLock);
+		advertisementSignal.notify_all();
+	}
+	SignalEvents(BLE_EVENT_ADVERTISEMENT);
+}
+
+uint32_t PollAdvertisements(AdvertisementRecord* buffer, uint32_t capacity, uint32_t timeoutMs)
+{
+	if (buffer == nullptr || capacity == 0)
+		return 0;
+	auto pop = [&] { return static_cast<uint32_t>(advertisementQueue.TryPopBulk(buffer, capacity)); };
+	auto count = pop();
+	if (count == 0 && timeoutMs != 0) {
+		auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+		unique_lock<mutex> lock(advertisementLock);
+		advertisementWaiters.fetch_add(1, memory_order_seq_cst);
+		atomic_thread_fence(memory_order_seq_cst);
+		for (;;) {
+			count = pop();
+			if (count > 0 || ShouldQuit())
+				break;
+			if (timeoutMs == WAIT_FOREVER) {
+				if (QuittableWait(advertisementSignal, lock))
+					break;
+			}
+			else if (advertisementSignal.wait_until(lock, deadline) == cv_status::timeout) {
+				count = pop();
+				break;
+			}
+		}
+		advertisementWaiters.fetch_sub(1, memory_order_relaxed);
+	}
+	advertisementQueueCounter.Dequeued(count);
+	return count;
+}
+
+// ---- event wait ----
+
+// WaitEvents parks on one condition variable that every event source signals. A source only signals while a waiter
+// is interested in it, so producers pay a load otherwise. Spinning waiters watch eventEpoch instead of parking.
+constexpr uint32_t EVENT_SOURCES = 7;
+mutex eventLock;
+condition_variable eventSignal;
+// waiters, spinning or parked, per source bit
+atomic<uint32_t> eventInterest[EVENT_SOURCES];
+atomic<uint64_t> eventEpoch{ 0 };
+
+void SignalEvents(uint32_t events)
+{
+	// pairs with the fence in RegisterEventInterest, see PublishData
+	atomic_thread_fence(memory_order_seq_cst);
+	bool interested = false;
+	for (uint32_t source = 0; source < EVENT_SOURCES && !interested; source++)
+		interested = (events & (1u << source)) && eventInterest[source].load(memory_order_seq_cst) > 0;
+	if (!interested)
+		return;
+	eventEpoch.fetch_add(1, memory_order_release);
+	// taking the lock orders the notify after a parked waiter's last readiness check
+	lock_guard guard(eventLock);
+	eventSignal.notify_all();
+}
+
+void RegisterEventInterest(uint32_t mask, int32_t delta)
+{
+	for (uint32_t source = 0; source < EVENT_SOURCES; source++)
+		if (mask & (1u << source))
+			eventInterest[source].fetch_add(static_cast<uint32_t>(delta), memory_order_seq_cst);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+uint32_t ReadyEvents(uint32_t mask)
+{
+	uint32_t ready = Backend().ReadyEvents(mask);
+	if (mask & BLE_EVENT_CONNECTION) {
+		lock_guard guard(connectionQueueLock);
+		if (!connectionQueue.empty())
+			ready |= BLE_EVENT_CONNECTION;
+	}
+	if (mask & BLE_EVENT_DATA) {
+		for (auto const& shard : DataShards())
+			if (!shard->ring.Empty()) {
+				ready |= BLE_EVENT_DATA;
+				break;
+			}
+	}
+	if (mask & BLE_EVENT_WRITE_COMPLETION) {
+		lock_guard guard(writeCompletionLock);
+		if (!writeCompletionQueue.empty())
+			ready |= BLE_EVENT_WRITE_COMPLETION;
+	}
+	if ((mask & BLE_EVENT_ADVERTISEMENT) && !advertisementQueue.Empty())
+		ready |= BLE_EVENT_ADVERTISEMENT;
+	return ready & mask;
+}
+
+uint32_t WaitEvents(uint32_t mask, uint32_t timeoutMs, uint32_t spinUs)
+{
+	auto ready = ReadyEvents(mask);
+	if (ready != 0 || timeoutMs == 0 || ShouldQuit())
+		return ready;
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::milliseconds(timeoutMs);
+	RegisterEventInterest(mask, 1);
+
+	// spin first, for consumers that would rather burn a core than pay for a wakeup
+	auto spinDeadline = min(deadline, start + chrono::microseconds(spinUs));
+	auto epoch = eventEpoch.load(memory_order_acquire);
+	// a source may have become ready before it could see our interest
+	ready = ReadyEvents(mask);
+	while (ready == 0 && !ShouldQuit() && chrono::steady_clock::now() < spinDeadline) {
+		auto current = eventEpoch.load(memory_order_acquire);
+		if (current != epoch) {
+			epoch = current;
+			ready = ReadyEvents(mask);
+		}
+		else
+			this_thread::yield();
+	}
+
+	if (ready == 0) {
+		unique_lock<mutex> lock(eventLock);
+		for (;;) {
+			ready = ReadyEvents(mask);
+			if (ready != 0 || ShouldQuit())
+				break;
+			if (eventSignal.wait_until(lock, deadline) == cv_status::timeout) {
+				ready = ReadyEvents(mask);
+				break;
+			}
+		}
+	}
+	RegisterEventInterest(mask, -1);
+	return ready;
+}
+
+// ---- lifecycle ----
+
+void ReleaseDevice(uint64_t address)
+{
+	InvalidateHandles(address);
+	CancelWrites(address);
+}
+
+void ShutdownCore()
+{
+	{
+		lock_guard lock(dataQueueLock);
+		dataQueueSignal.notify_all();
+	}
+	{
+		lock_guard lock(dataSpaceLock);
+		dataSpaceSignal.notify_all();
+	}
+	{
+		lock_guard lock(eventLock);
+		eventSignal.notify_all();
+	}
+	{
+		lock_guard lock(advertisementLock);
+		advertisementSignal.notify_all();
+	}
+	{
+		lock_guard lock(planLock);
+		planSignal.notify_all();
+	}
+	advertisementQueueCounter.Dequeued(advertisementQueue.Clear());
+	{
+		// generations keep counting, so that a caller's sinceGeneration stays meaningful after a restart
+		lock_guard lock(deviceTableLock);
+		deviceTable.Clear();
+	}
+	for (auto const& shard : DataShards())
+		dataQueueDequeued.fetch_add(shard->ring.Clear(), memory_order_relaxed);
+	InvalidateHandles(0);
+	CancelWrites(0);
+	{
+		lock_guard lock(writeCompletionLock);
+		writeCompletionQueue = {};
+		writeCompletionSignal.notify_all();
+	}
+	{
+		lock_guard lock(connectionQueueLock);
+		connectionQueueCounter.Dequeued(connectionQueue.size());
+		connectionQueue = {};
+		connectionQueueSignal.notify_all();
+	}
+	StopGattFlusher();
+	logDrainer.Stop();
+}
+
+// ---- statistics exports ----
+
+void SnapshotQueue(QueueCounter const& counter, QueueStats& stats) {
+	stats.enqueued = counter.enqueued.load(memory_order_relaxed);
+	stats.dequeued = counter.dequeued.load(memory_order_relaxed);
+	stats.size = stats.enqueued > stats.dequeued ? static_cast<uint32_t>(stats.enqueued - stats.dequeued) : 0;
+	stats.highWaterMark = counter.highWaterMark.load(memory_order_relaxed);
+}
+
+bool GetStats(BleStats* stats) {
+	if (stats->size == 0) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d GetStats: size must be set to sizeof(BleStats).", __WFILE__, __LINE__);
+		return false;
+	}
+	BleStats snapshot{};
+	snapshot.version = BLE_STATS_VERSION;
+	snapshot.size = static_cast<uint32_t>(min<size_t>(stats->size, sizeof(BleStats)));
+	snapshot.timestampNs = TimestampNs();
+
+	SnapshotQueue(deviceQueueCounter, snapshot.deviceQueue);
+	SnapshotQueue(serviceQueueCounter, snapshot.serviceQueue);
+	SnapshotQueue(characteristicQueueCounter, snapshot.characteristicQueue);
+	SnapshotQueue(connectionQueueCounter, snapshot.connectionQueue);
+	auto dataTotals = SumDataShards();
+	snapshot.dataQueue.enqueued = dataTotals.enqueued;
+	snapshot.dataQueue.dequeued = dataQueueDequeued.load(memory_order_relaxed);
+	snapshot.dataQueue.size = dataTotals.size;
+	snapshot.dataQueue.highWaterMark = dataTotals.highWaterMark;
+
+	{
+		lock_guard guard(deviceCountersLock);
+		deviceCounters.ForEach([&](uint64_t, shared_ptr<DeviceCounters>& counters) {
+			snapshot.notifications += counters->notifications.load(memory_order_relaxed);
+			snapshot.writes += counters->writes.load(memory_order_relaxed);
+		});
+	}
+	snapshot.writeFailures = writeFailures.load(memory_order_relaxed);
+	auto& latency = snapshot.writeLatency;
+	writeLatencyUs.Snapshot(latency.buckets, latency.count, latency.sumUs, latency.maxUs);
+
+	snapshot.cache.deviceHits = cacheCounters.deviceHits.load(memory_order_relaxed);
+	snapshot.cache.deviceMisses = cacheCounters.deviceMisses.load(memory_order_relaxed);
+	snapshot.cache.serviceHits = cacheCounters.serviceHits.load(memory_order_relaxed);
+	snapshot.cache.serviceMisses = cacheCounters.serviceMisses.load(memory_order_relaxed);
+	snapshot.cache.characteristicHits = cacheCounters.characteristicHits.load(memory_order_relaxed);
+	snapshot.cache.characteristicMisses = cacheCounters.characteristicMisses.load(memory_order_relaxed);
+	SnapshotQueue(advertisementQueueCounter, snapshot.advertisementQueue);
+	snapshot.advertisementsDropped = advertisementsDropped.load(memory_order_relaxed);
+	snapshot.writeCompletionsDropped = writeCompletionsDropped.load(memory_order_relaxed);
+
+	// callers built against an older BleStats get the prefix they know about
+	memcpy(stats, &snapshot, snapshot.size);
+	return true;
+}
+
+uint32_t GetDeviceStats(DeviceStats* devices, uint32_t capacity) {
+	const uint32_t bufferCapacity = (devices != nullptr) ? capacity : 0;
+	uint32_t count = 0;
+	lock_guard guard(deviceCountersLock);
+	deviceCounters.ForEach([&](uint64_t address, shared_ptr<DeviceCounters>& counters) {
+		if (count < bufferCapacity) {
+			auto& out = devices[count];
+			out.address = address;
+			out.notifications = counters->notifications.load(memory_order_relaxed);
+			out.notificationBytes = counters->notificationBytes.load(memory_order_relaxed);
+			out.writes = counters->writes.load(memory_order_relaxed);
+			out.writeBytes = counters->writeBytes.load(memory_order_relaxed);
+		}
+		count++;
+	});
+	return count;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BleTypes.h"
+#include "GuidCodec.h"
+#include "LatestValue.h"
+#include "Stats.h"
+
+// Backend-neutral engine of the DLL: handle table, notification queues, conflating slots, write engine, connection
+// updates, statistics and the last error. Nothing in here depends on WinRT. A backend resolves characteristics,
+// registers them with RegisterHandle and feeds their notifications into a NotificationSink; the engine calls back into
+// the backend through IBleBackend. The backend is picked at link time: BleWinrtDll.cpp for the DLL,
+// SimulatedBackend.cpp for builds without a radio.
+
+// binary identity of a characteristic
+struct CharacteristicId {
+    uint64_t address;
+    BleGuid service;
+    BleGuid characteristic;
+    bool operator==(CharacteristicId const& other) const {
+        return address == other.address && service == other.service && characteristic == other.characteristic;
+    }
+};
+
+// Per device counters, see GetDeviceStats. Hot paths hold a reference instead of looking them up.
+struct DeviceCounters {
+    uint64_t address = 0;
+    std::atomic<uint64_t> notifications{ 0 };
+    std::atomic<uint64_t> notificationBytes{ 0 };
+    std::atomic<uint64_t> writes{ 0 };
+    std::atomic<uint64_t> writeBytes{ 0 };
+};
+
+// queue of one subscription, defined in BleCore.cpp
+struct DataShard;
+
+// Receives the notifications of one subscription. The engine creates it for SubscribeByHandle with everything the
+// callback needs already resolved, the backend calls OnValue from its notification callback.
+class NotificationSink
+{
+public:
+    // exactly one of shard (queued) and latest (conflating) is set
+    NotificationSink(uint32_t handle, std::shared_ptr<DataShard> shard, std::shared_ptr<LatestSlot> latest,
+        std::shared_ptr<DeviceCounters> counters);
+
+    // receivedNs should be taken on entry of the backend callback, see TimestampNs. Calls for one sink must not
+    // overlap, which holds as a characteristic raises its notifications from one thread at a time.
+    void OnValue(uint64_t receivedNs, const uint8_t* data, size_t size);
+
+    uint32_t Handle() const { return handle; }
+
+private:
+    uint32_t handle;
+    uint64_t sequence = 0;
+    std::shared_ptr<DataShard> shard;
+    std::shared_ptr<LatestSlot> latest;
+    std::shared_ptr<DeviceCounters> counters;
+};
+
+// The sink SubscribeByHandle hands to the backend, creating the queue or slot of mode on first use. Reports the error
+// and returns nullptr for an invalid handle.
+std::shared_ptr<NotificationSink> MakeSink(uint32_t handle, SubscriptionMode mode);
+
+using WriteDone = std::function<void(WriteStatus)>;
+using ResolveDone = std::function<void(uint32_t handle)>;
+using SubscribeDone = std::function<void(bool subscribed)>;
+
+// What the engine needs from a transport.
+class IBleBackend
+{
+public:
+    virtual ~IBleBackend() = default;
+
+    // Starts a write without response to the characteristic of handle. done is called exactly once, possibly before
+    // Write returns.
+    virtual void Write(uint32_t handle, std::vector<uint8_t>&& data, WriteDone done) = 0;
+
+    // Enables notifications of handle and routes them to sink. Reports the error and returns false on failure.
+    virtual bool Subscribe(uint32_t handle, std::shared_ptr<NotificationSink> const& sink) = 0;
+
+    // Like ResolveCharacteristic without blocking; done gets the handle, 0 on failure, and is called exactly once,
+    // possibly before ResolveAsync returns.
+    virtual void ResolveAsync(std::wstring deviceId, std::wstring serviceId, std::wstring characteristicId,
+        ResolveDone done) = 0;
+
+    // Like Subscribe without blocking on the CCCD write; same contract for done as ResolveAsync.
+    virtual void SubscribeAsync(uint32_t handle, std::shared_ptr<NotificationSink> const& sink, SubscribeDone done) = 0;
+
+    virtual bool Unsubscribe(uint32_t handle) = 0;
+
+    // the data queues can only be resized while nothing is subscribed
+    virtual bool HasSubscriptions() = 0;
+
+    // which of the scan sources in mask (BLE_EVENT_DEVICE, _SERVICE, _CHARACTERISTIC) have something to poll,
+    // including a finished scan whose FINISHED wasn't polled yet, see WaitEvents
+    virtual uint32_t ReadyEvents(uint32_t mask) = 0;
+};
+
+// defined by the backend linked into the binary
+IBleBackend& Backend();
+
+// Errors go to the journal, see GetErrors and GetError. Messages are wide printf formats; pass strings with %ls, which
+// works everywhere. Without a code the error counts as ErrorCode::FAILED.
+void clearError();
+void saveError(const wchar_t* message, ...);
+void saveError(ErrorCode code, const wchar_t* message, ...);
+
+// Log records are checked against the filter before anything is formatted, formatted straight into a preallocated ring
+// and handed to the sink in batches by the drainer thread. When the sink falls a full ring behind, new records are
+// dropped and counted instead of waiting. Use BLE_LOG, which doesn't even evaluate the arguments of filtered records.
+extern std::atomic<int32_t> logLevel;
+extern std::atomic<uint32_t> logCategories;
+
+inline bool LogEnabled(LogLevel level, uint32_t category)
+{
+    return static_cast<int32_t>(level) >= logLevel.load(std::memory_order_relaxed)
+        && (logCategories.load(std::memory_order_relaxed) & category) != 0;
+}
+
+void Log(LogLevel level, uint32_t category, const wchar_t* message, ...);
+
+#define BLE_LOG(level, category, ...) \
+    do { if (LogEnabled(level, category)) Log(level, category, __VA_ARGS__); } while (0)
+
+// Tags the errors raised on this thread with a new operation id until it goes out of scope, see ErrorEntry. A nested
+// scope keeps the outer id.
+class OperationScope
+{
+public:
+    OperationScope();
+    ~OperationScope();
+    OperationScope(OperationScope const&) = delete;
+    OperationScope& operator=(OperationScope const&) = delete;
+
+private:
+    bool outermost;
+};
+
+template <size_t N>
+void CopyString(wchar_t (&out)[N], const wchar_t* text)
+{
+    wcsncpy(out, text, N - 1);
+    out[N - 1] = L'\0';
+}
+
+// global flag to release calling threads; atomic so that the notification callbacks can check it without a lock
+void RequestQuit();
+void ResetQuit();
+bool ShouldQuit();
+// waits on signal unless quitting; returns true if the caller should give up because of Quit
+bool QuittableWait(std::condition_variable& signal, std::unique_lock<std::mutex>& waitLock);
+
+// monotonic clock of all timestamps handed out by the API, see GetTimestampNs
+uint64_t TimestampNs();
+
+// WinRT ids of LE peripherals end in the peripheral address, e.g.
+// BluetoothLE#BluetoothLE00:1a:7d:da:71:13-c4:64:e3:6b:2f:a1
+bool ParseDeviceAddress(const wchar_t* deviceId, uint64_t& address);
+
+// Handles identify a resolved characteristic, both for writes and for the notifications of its subscription.
+// Registering the same characteristic again returns the same handle until it is invalidated.
+uint32_t RegisterHandle(CharacteristicId const& id, const wchar_t* deviceId);
+bool IsValidHandle(uint32_t handle);
+// invalidates the handles of one device, or of all devices if address is 0
+void InvalidateHandles(uint64_t address);
+
+// invalidates the handles of a device that was disconnected and cancels its queued writes
+void ReleaseDevice(uint64_t address);
+// wakes every thread blocked in the engine and drops all queued state, for Quit
+void ShutdownCore();
+
+// ATT payload of a write without response is the MTU minus opcode and attribute handle
+constexpr uint16_t ATT_WRITE_HEADER = 3;
+constexpr uint16_t ATT_DEFAULT_MTU = 23;
+
+// largest payload of a coalesced write to a device, usually the negotiated MTU minus the ATT header
+void SetMaxWritePayload(uint64_t address, uint16_t payload);
+
+// see SetDiscoveryOptions
+DiscoveryOptions CurrentDiscoveryOptions();
+
+// Persistent GATT database, see SetGattCacheOptions; defined in GattCache.cpp. The backends answer scans from it and
+// store what they discovered over the air. Everything is a no-op, and every lookup a miss, while it is disabled.
+struct GattCharacteristicLayout {
+    BleGuid uuid;
+    uint32_t properties = 0;    // GattCharacteristicProperties
+    std::wstring userDescription;
+    std::vector<BleGuid> descriptors;
+};
+struct GattServiceLayout {
+    BleGuid uuid;
+    bool characteristicsKnown = false;
+    bool descriptionsKnown = false; // userDescription was read when the characteristics were stored
+    std::vector<GattCharacteristicLayout> characteristics;
+};
+bool GattCacheEnabled();
+bool LookupGattServices(uint64_t address, std::vector<BleGuid>& services);
+bool LookupGattCharacteristics(uint64_t address, BleGuid const& service, bool withDescriptions,
+    std::vector<GattCharacteristicLayout>& characteristics);
+void StoreGattServices(uint64_t address, std::vector<BleGuid> const& services);
+// only stored for services of a device whose service list is stored
+void StoreGattCharacteristics(uint64_t address, BleGuid const& service, bool withDescriptions,
+    std::vector<GattCharacteristicLayout> const& characteristics);
+// drops the layout of one device, or of all devices if address is 0
+void InvalidateGattLayout(uint64_t address);
+// true once per device and session if revalidation is on; the backend then rediscovers the device uncached and hands
+// the result to RevalidateGattLayout, which drops the stored layout if it differs
+bool ShouldRevalidateGatt(uint64_t address);
+bool RevalidateGattLayout(uint64_t address, std::vector<GattServiceLayout> const& live);
+// writes pending changes of the database and ends the thread that writes them in the background, see Quit
+void StopGattFlusher();
+
+void EnqueueConnectionUpdate(const wchar_t* deviceId, int32_t status);
+
+// A device reported by a scan. Properties not flagged as updated keep their value in the device table.
+struct DeviceObservation {
+    DeviceUpdate update;
+    uint64_t address = 0;   // 0 takes the address from update.id
+    bool isConnected = false;
+    bool isConnectedUpdated = false;
+};
+
+// merges into the device table, see GetDeviceSnapshot; returns false if no field changed
+bool MergeDevice(DeviceObservation const& observation);
+
+// builds the matcher from the rules of SetScanFilter if they changed since; called by the backends when a scan starts
+void CompileScanFilter();
+// whether a device update passes the scan filter, to be checked before it is queued for PollDevice
+bool ScanFilterAccepts(DeviceObservation const& observation);
+
+// parses an advertisement or scan response of AD structures and queues it for PollAdvertisements, unless the scan
+// filter rejects it
+void PublishAdvertisement(uint64_t address, int16_t rssi, uint8_t kind, const uint8_t* payload, size_t size,
+    uint64_t receivedNs);
+
+// wakes WaitEvents callers after a source in events became ready; costs a load unless someone is waiting
+void SignalEvents(uint32_t events);
+
+// statistics fed by the backend, see GetStats
+extern QueueCounter deviceQueueCounter;
+extern QueueCounter serviceQueueCounter;
+extern QueueCounter characteristicQueueCounter;
+struct CacheCounters {
+    std::atomic<uint64_t> deviceHits{ 0 };
+    std::atomic<uint64_t> deviceMisses{ 0 };
+    std::atomic<uint64_t> serviceHits{ 0 };
+    std::atomic<uint64_t> serviceMisses{ 0 };
+    std::atomic<uint64_t> characteristicHits{ 0 };
+    std::atomic<uint64_t> characteristicMisses{ 0 };
+};
+extern CacheCounters cacheCounters;
+
+// counters of a device, created on first use and never dropped
+std::shared_ptr<DeviceCounters> CountersFor(uint64_t address);
+void RecordWrite(DeviceCounters* counters, uint32_t writes, size_t bytes, uint64_t startNs, bool succeeded);
@@ -2,7 +2,18 @@
 
 #include <cstdint>
 
-typedef void(__cdecl* BleLogSinkFn)(const wchar_t* msg);
+// exported functions and callbacks; the portable core also builds as a shared object on other platforms
+#ifdef _WIN32
+#define BLE_API __declspec(dllexport)
+#define BLE_CALLBACK __cdecl
+#else
+#define BLE_API __attribute__((visibility("default")))
+#define BLE_CALLBACK
+#endif
+
+typedef void(BLE_CALLBACK* BleLogSinkFn)(const wchar_t* msg);
+struct LogRecord;
+typedef void(BLE_CALLBACK* BleLogBatchSinkFn)(const LogRecord* records, uint32_t count);
 
 struct RadioInfo {
     wchar_t name[256];
@@ -19,6 +30,89 @@ struct DeviceUpdate {
     bool nameUpdated = false;
 };
 
+// Scan results coalesced per device, see GetDeviceSnapshot.
+struct DeviceRecord {
+    uint64_t address;       // Bluetooth address, from System.Devices.Aep.DeviceAddress
+    uint64_t generation;    // of the last change to any of the fields below
+    uint64_t lastSeenNs;    // newest update, see GetTimestampNs; changes without a new generation
+    uint32_t updates;       // raw updates merged into this record
+    wchar_t id[100];
+    wchar_t name[50];
+    bool isConnectable;
+    bool isConnected;       // System.Devices.Aep.IsConnected
+};
+
+// TX power of an advertisement without the TX power level AD structure
+constexpr int8_t BLE_TX_POWER_NONE = 127;
+
+// One received advertisement or scan response, see PollAdvertisements. The fields found by the AD parser are views
+// into payload: offset and size in bytes, size 0 if the structure was absent.
+struct AdvertisementRecord {
+    uint64_t address;
+    uint64_t receivedNs;    // see GetTimestampNs
+    int16_t rssi;           // dBm
+    int8_t txPower;         // dBm from the advertisement, BLE_TX_POWER_NONE if absent
+    uint8_t flags;          // AD flags, 0 if absent
+    uint8_t kind;           // Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementType
+    uint8_t size;           // bytes used in payload
+    bool malformed;         // an AD structure ran past the end; the ones before it are still reported
+    bool truncated;         // the payload was longer than the record holds
+    uint8_t nameOffset;     // UTF-8, complete name or else the shortened one, not nul terminated
+    uint8_t nameSize;
+    uint8_t uuid16Offset;   // list of 16 bit service UUIDs, little endian
+    uint8_t uuid16Size;
+    uint8_t uuid32Offset;
+    uint8_t uuid32Size;
+    uint8_t uuid128Offset;
+    uint8_t uuid128Size;
+    uint8_t serviceDataOffset;  // service UUID of serviceDataUuidSize bytes followed by the data
+    uint8_t serviceDataSize;
+    uint8_t serviceDataUuidSize;
+    uint8_t manufacturerDataOffset; // little endian company identifier followed by the data
+    uint8_t manufacturerDataSize;
+    uint16_t companyId;     // decoded from the manufacturer data, 0 if absent
+    uint8_t payload[255];   // AD structures as received, [length][type][data]...
+};
+
+// Scan filter, see SetScanFilter. The first rule whose criteria all match decides.
+enum class ScanFilterAction : int32_t {
+    ACCEPT,
+    REJECT
+};
+
+enum ScanFilterCriteria : uint32_t {
+    SCAN_FILTER_NAME = 1 << 0,          // name, or its prefix with namePrefix
+    SCAN_FILTER_SERVICE = 1 << 1,       // serviceUuid among the advertised service UUIDs or service data
+    SCAN_FILTER_MANUFACTURER = 1 << 2,  // manufacturer data of companyId whose first dataSize bytes match under dataMask
+    SCAN_FILTER_ADDRESS = 1 << 3,
+    SCAN_FILTER_MIN_RSSI = 1 << 4       // rssi of at least minRssi
+};
+
+constexpr uint32_t SCAN_FILTER_DATA_SIZE = 16;
+constexpr uint32_t SCAN_FILTER_MAX_RULES = 1024;
+
+struct ScanFilterRule {
+    ScanFilterAction action;
+    uint32_t criteria;      // ScanFilterCriteria bits, 0 matches everything
+    wchar_t name[50];
+    bool namePrefix;
+    wchar_t serviceUuid[100];
+    uint16_t companyId;
+    uint8_t dataSize;       // bytes of dataMask/dataValue compared after the company identifier
+    uint8_t dataMask[SCAN_FILTER_DATA_SIZE];
+    uint8_t dataValue[SCAN_FILTER_DATA_SIZE];
+    int16_t minRssi;        // dBm
+    uint64_t address;
+};
+
+struct ScanFilterStats {
+    uint64_t evaluated;     // devices and advertisements run through the filter
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t unmatched;     // decided by the unmatched action, as no rule matched
+    uint32_t rules;
+};
+
 struct Service {
     wchar_t uuid[100];
 };
@@ -36,13 +130,259 @@ struct BLEData {
     wchar_t characteristicUuid[256];
 };
 
+// Compact notification record of the handle based data path. Blittable, the identity of the characteristic is the
+// subscription handle returned by SubscribeCharacteristicV2, see GetSubscriptionInfo.
+struct BLEDataV2 {
+    uint32_t handle;
+    uint16_t size;
+    uint8_t buf[512];
+    uint64_t sequence;      // per subscription, starting at 1; a gap means notifications were dropped
+    uint64_t receivedNs;    // entry of the notification callback, see GetTimestampNs
+    uint64_t dequeuedNs;    // when PollDataV2/PollDataBatch took it from the queue
+};
+
+// Newest value of a subscription made with SubscribeCharacteristicLatest, see ReadLatest.
+struct LatestValue {
+    uint32_t handle;
+    uint16_t size;
+    uint8_t buf[512];
+    uint64_t sequence;  // number of notifications received for this subscription so far
+    uint64_t dropped;   // notifications overwritten unread since the previous ReadLatest of the handle
+    uint64_t receivedNs;    // arrival of the newest value, see GetTimestampNs
+};
+
+enum class SubscriptionMode : int32_t {
+    QUEUED,     // notifications go to the subscription's queue, see PollData/PollDataV2/PollDataBatch/PollDataFor
+    LATEST      // notifications overwrite a slot read with ReadLatest
+};
+
+// One characteristic to subscribe in ConnectWithPlan.
+struct PlanEntry {
+    wchar_t serviceUuid[100];
+    wchar_t characteristicUuid[100];
+    SubscriptionMode mode;
+};
+
+enum class PlanStatus : int32_t {
+    SUBSCRIBED,
+    RESOLVE_FAILED,     // service or characteristic not found, see GetError
+    SUBSCRIBE_FAILED,   // the CCCD write failed, see GetError
+    CANCELLED           // Quit was called before the entry finished
+};
+
+constexpr uint32_t PLAN_MAX_ENTRIES = 256;
+
+struct PlanEntryResult {
+    PlanStatus status;
+    uint32_t handle;        // 0 if resolving failed
+    uint64_t resolvedNs;    // since the start of the plan
+    uint64_t readyNs;       // since the start of the plan, when notifications were enabled
+};
+
+// What a queued subscription does with a notification when its queue is full.
+enum class OverflowPolicy : int32_t {
+    DROP_NEWEST,    // discard the incoming notification
+    DROP_OLDEST,    // evict the subscription's oldest queued notification to make room
+    BLOCK           // wait up to blockTimeoutMs for the consumer, then discard the incoming notification
+};
+
+struct DataQueueOptions {
+    uint32_t capacity;  // per subscription, rounded up to a power of two
+    OverflowPolicy policy;
+    uint32_t blockTimeoutMs;
+};
+
+struct DataQueueStats {
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t droppedNewest;
+    uint64_t droppedOldest;
+    uint64_t blockedProducers;  // notifications that had to wait for space under OverflowPolicy::BLOCK
+    uint32_t size;          // summed over the subscriptions' queues
+    uint32_t capacity;      // of each queue
+    uint32_t highWaterMark; // fullest any single queue has been
+};
+
+struct SubscriptionInfo {
+    wchar_t deviceId[256];
+    wchar_t serviceUuid[256];
+    wchar_t characteristicUuid[256];
+};
+
+// Outcome of a write queued with QueueWrite. The first values mirror GattCommunicationStatus.
+enum class WriteStatus : int32_t {
+    SUCCESS,
+    UNREACHABLE,
+    PROTOCOL_ERROR,
+    ACCESS_DENIED,
+    FAILED,     // the write threw, see GetError
+    CANCELLED   // discarded before it was sent, by DisconnectDevice or Quit
+};
+
+struct WriteCompletion {
+    uint32_t writeId;
+    uint32_t handle;
+    WriteStatus status;
+};
+
+struct WriteOptions {
+    uint32_t maxInFlight;   // writes per characteristic handed to the stack before earlier ones completed
+    uint32_t maxQueued;     // writes per characteristic waiting to be sent; QueueWrite fails beyond this
+    // merge consecutive queued writes up to the negotiated MTU. Only for characteristics that treat writes as a byte
+    // stream, as the peripheral can no longer tell the writes apart.
+    bool coalesce;
+};
+
+struct DiscoveryOptions {
+    // read the User Description descriptor of every characteristic ScanCharacteristics reports; without it
+    // Characteristic::userDescription stays empty and discovery costs no extra round trips
+    bool readUserDescriptions;
+    uint32_t maxConcurrentReads;    // descriptor lookups and reads in flight per characteristic scan
+};
+
+struct GattCacheOptions {
+    // file of the persistent GATT database, empty to disable it
+    wchar_t path[260];
+    // rediscover a device uncached once per session after its first scan was answered from the file, and drop its
+    // layout if it changed
+    bool revalidate;
+};
+
+struct GattCacheStats {
+    uint32_t devices;       // with a stored layout
+    uint64_t hits;          // scans answered from the database
+    uint64_t misses;        // scans that had to discover over the air
+    uint64_t invalidations; // layouts dropped by InvalidateGattCache, a services changed event or revalidation
+    uint64_t revalidations;
+};
+
+// Layout version of BleStats, bumped whenever fields are added. Fields are only ever appended.
+constexpr uint32_t BLE_STATS_VERSION = 3;
+constexpr uint32_t LATENCY_BUCKETS = 24;
+
+struct QueueStats {
+    uint64_t enqueued;
+    uint64_t dequeued;  // including entries discarded by Quit
+    uint32_t size;
+    uint32_t highWaterMark;
+};
+
+// buckets[0] counts latencies below 2us, buckets[i] latencies in [2^i, 2^(i+1)) us, the last bucket everything beyond
+struct LatencyHistogram {
+    uint64_t count;
+    uint64_t sumUs;
+    uint64_t maxUs;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct CacheStats {
+    uint64_t deviceHits;
+    uint64_t deviceMisses;
+    uint64_t serviceHits;
+    uint64_t serviceMisses;
+    uint64_t characteristicHits;
+    uint64_t characteristicMisses;
+};
+
+struct BleStats {
+    uint32_t version;       // set by GetStats to BLE_STATS_VERSION
+    uint32_t size;          // set by the caller to sizeof(BleStats); GetStats fills at most that many bytes
+    uint64_t timestampNs;   // see GetTimestampNs; rates are deltas between two snapshots over the elapsed time
+    QueueStats deviceQueue;
+    QueueStats serviceQueue;
+    QueueStats characteristicQueue;
+    QueueStats connectionQueue;
+    QueueStats dataQueue;
+    uint64_t notifications;
+    uint64_t writes;
+    uint64_t writeFailures;
+    LatencyHistogram writeLatency;  // from issuing a write to its completion
+    CacheStats cache;
+    // version 2
+    QueueStats advertisementQueue;
+    uint64_t advertisementsDropped; // oldest advertisements evicted because nobody polled them
+    // version 3
+    uint64_t writeCompletionsDropped;   // oldest write completions evicted because nobody polled them
+};
+
+// Cumulative per device counters, see GetDeviceStats.
+struct DeviceStats {
+    uint64_t address;
+    uint64_t notifications;
+    uint64_t notificationBytes;
+    uint64_t writes;
+    uint64_t writeBytes;
+};
+
 struct ErrorMessage {
     wchar_t msg[1024];
 };
 
+enum class ErrorCode : int32_t {
+    FAILED,             // not classified further, see the message
+    INVALID_ARGUMENT,
+    NOT_FOUND,          // device, service, characteristic, handle or subscription unknown
+    COMMUNICATION,      // the device answered with an error status or didn't answer
+    EXCEPTION           // the platform threw
+};
+
+constexpr uint32_t ERROR_JOURNAL_SIZE = 128;
+
+// One error of the journal, see GetErrors.
+struct ErrorEntry {
+    uint64_t sequence;      // starting at 1; a gap means older entries were overwritten before they were read
+    uint64_t timestampNs;   // see GetTimestampNs
+    uint64_t operation;     // id of the API call that raised it, 0 for background work like scans and callbacks
+    ErrorCode code;
+    wchar_t message[512];
+};
+
+// Log levels in increasing severity; a filter at a level passes that level and the ones above.
+enum class LogLevel : int32_t { VERBOSE, INFO, WARNING, FAILURE, OFF };
+
+// Sources of log records, combined into masks, see SetLogFilter.
+enum BleLogCategory : uint32_t {
+    BLE_LOG_RADIO = 1 << 0,         // radio enumeration and availability
+    BLE_LOG_SCAN = 1 << 1,
+    BLE_LOG_CONNECTION = 1 << 2,
+    BLE_LOG_GATT = 1 << 3,
+    BLE_LOG_DATA = 1 << 4,
+    BLE_LOG_ERRORS = 1 << 5,        // the error journal, at LogLevel::FAILURE
+    BLE_LOG_ALL = (1 << 6) - 1
+};
+
+constexpr uint32_t LOG_RING_SIZE = 256;
+// records handed to the sink at once at most
+constexpr uint32_t LOG_BATCH_SIZE = 32;
+
+struct LogRecord {
+    uint64_t timestampNs;   // see GetTimestampNs
+    LogLevel level;
+    uint32_t category;      // one BleLogCategory bit
+    wchar_t message[512];
+};
+
+struct LogStats {
+    uint64_t written;       // records that passed the filter, including errors
+    uint64_t delivered;     // records handed to the sink or the console
+    uint64_t dropped;       // records lost because the sink fell LOG_RING_SIZE records behind
+};
+
 struct ConnectionUpdate {
     wchar_t deviceId[256];
     int32_t status;   // Windows::Devices::Bluetooth::BluetoothConnectionStatus
 };
 
 enum class ScanStatus { PROCESSING, AVAILABLE, FINISHED };
+
+// Sources of WaitEvents, combined into masks. A source is ready while its poll function would return something.
+enum BleEvent : uint32_t {
+    BLE_EVENT_DEVICE = 1 << 0,          // PollDevice
+    BLE_EVENT_SERVICE = 1 << 1,         // PollService
+    BLE_EVENT_CHARACTERISTIC = 1 << 2,  // PollCharacteristic
+    BLE_EVENT_CONNECTION = 1 << 3,      // PollConnection
+    BLE_EVENT_DATA = 1 << 4,            // PollData, PollDataV2, PollDataBatch
+    BLE_EVENT_WRITE_COMPLETION = 1 << 5,    // PollWriteCompletion
+    BLE_EVENT_ADVERTISEMENT = 1 << 6,   // PollAdvertisements
+    BLE_EVENT_ALL = (1 << 7) - 1
+};
@@ -4,6 +4,10 @@
 #include "stdafx.h"
 
 #include "BleWinrtDll.h"
+#include "BleCore.h"
+#include "FlatTable.h"
+#include "GuidCodec.h"
+#include "SubscriptionRegistry.h"
 
 #pragma comment(lib, "windowsapp")
 
@@ -17,6 +21,7 @@ using namespace Windows::Foundation;
 using namespace Windows::Foundation::Collections;
 
 using namespace Windows::Devices::Bluetooth;
+using namespace Windows::Devices::Bluetooth::Advertisement;
 using namespace Windows::Devices::Bluetooth::GenericAttributeProfile;
 using namespace Windows::Devices::Enumeration;
 
@@ -24,157 +29,203 @@ using namespace Windows::Storage::Streams;
 
 using namespace Windows::Devices::Radios;
 
-union to_guid
+constexpr guid to_winrt_guid(BleGuid const& g)
 {
-	uint8_t buf[16];
-	guid guid;
-};
+	return guid(g.Data1, g.Data2, g.Data3,
+		{ g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7] });
+}
 
-const uint8_t BYTE_ORDER[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+BleGuid to_ble_guid(guid const& g)
+{
+	BleGuid result;
+	static_assert(sizeof(result) == sizeof(g), "guid layout mismatch");
+	memcpy(&result, &g, sizeof(result));
+	return result;
+}
 
+// canonical ids take the validating (vectorized) path, anything else falls back to the lenient single pass parser
 guid make_guid(const wchar_t* value)
 {
-	to_guid to_guid;
-	memset(&to_guid, 0, sizeof(to_guid));
-	int offset = 0;
-	for (int i = 0; i < wcslen(value); i++) {
-		if (value[i] >= '0' && value[i] <= '9')
-		{
-			uint8_t digit = value[i] - '0';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else if (value[i] >= 'A' && value[i] <= 'F')
-		{
-			uint8_t digit = 10 + value[i] - 'A';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else if (value[i] >= 'a' && value[i] <= 'f')
-		{
-			uint8_t digit = 10 + value[i] - 'a';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else
-		{
-			// skip char
-		}
-	}
+	return to_winrt_guid(GuidCodec::Parse(value));
+}
 
-	return to_guid.guid;
+// formats like to_hstring(guid), but into a caller buffer
+template <size_t N>
+void format_guid(guid const& value, wchar_t (&out)[N])
+{
+	static_assert(N >= GuidCodec::FormattedCapacity, "buffer too small for a formatted guid");
+	GuidCodec::Format(to_ble_guid(value), out, N);
 }
 
 // implement own caching instead of using the system-provicded cache as there is an AccessDenied error when trying to
 // call GetCharacteristicsAsync on a service for which a reference is hold in global scope
 // cf. https://stackoverflow.com/a/36106137
 
-mutex errorLock;
-wchar_t last_error[2048];
+// The cache is keyed on binary identities: the Bluetooth address of the peripheral and the service/characteristic
+// GUIDs. A lookup is a single hash of the key and a full key comparison, so distinct characteristics never collide.
+struct ServiceKey {
+	uint64_t address;
+	guid service;
+	bool operator==(ServiceKey const& other) const { return address == other.address && service == other.service; }
+};
+struct CharacteristicKey {
+	uint64_t address;
+	guid service;
+	guid characteristic;
+	bool operator==(CharacteristicKey const& other) const {
+		return address == other.address && service == other.service && characteristic == other.characteristic;
+	}
+};
+// FlatTable default constructs its values, so the WinRT references are wrapped to start out as nullptr
 struct CharacteristicCacheEntry {
 	GattCharacteristic characteristic = nullptr;
 };
 struct ServiceCacheEntry {
 	GattDeviceService service = nullptr;
-	map<long, CharacteristicCacheEntry> characteristics = { };
 };
 struct DeviceCacheEntry {
     BluetoothLEDevice device = nullptr;
-    map<long, ServiceCacheEntry> services = { };
     BluetoothLEDevice::ConnectionStatusChanged_revoker statusChangedRevoker{};
+    // the system's report of a Service Changed indication, drops the device from the GATT database
+    BluetoothLEDevice::GattServicesChanged_revoker servicesChangedRevoker{};
     bool statusSubscribed = false;
 };
-map<long, DeviceCacheEntry> cache;
-void EnsureStatusSubscription(long key, BluetoothLEDevice const& device);
-
-
-// using hashes of uuids to omit storing the c-strings in reliable storage
-long hsh(wchar_t* wstr)
+mutex cacheLock;
+FlatTable<uint64_t, DeviceCacheEntry> deviceCache;
+FlatTable<ServiceKey, ServiceCacheEntry> serviceCache;
+FlatTable<CharacteristicKey, CharacteristicCacheEntry> characteristicCache;
+// device ids that don't end in a Bluetooth address, mapped to the address reported by the device
+map<wstring, uint64_t> deviceAddressAliases;
+void EnsureStatusSubscription(DeviceCacheEntry& entry);
+
+bool ResolveDeviceAddress(const wchar_t* deviceId, uint64_t& address)
 {
-	long hash = 5381;
-	int c;
-	while (c = *wstr++)
-		hash = ((hash << 5) + hash) + c;
-	return hash;
-}
-
-void clearError() {
-	lock_guard error_lock(errorLock);
-	wcscpy_s(last_error, L"Ok");
-}
-
-void saveError(const wchar_t* message, ...) {
-	lock_guard error_lock(errorLock);
-	va_list args;
-	va_start(args, message);
-	vswprintf_s(last_error, message, args);
-	va_end(args);
-	wcout << last_error << endl;
+	if (ParseDeviceAddress(deviceId, address))
+		return true;
+	lock_guard lock(cacheLock);
+	auto it = deviceAddressAliases.find(deviceId);
+	if (it == deviceAddressAliases.end())
+		return false;
+	address = it->second;
+	return true;
 }
 
 IAsyncOperation<BluetoothLEDevice> retrieveDevice(wchar_t* deviceId)
 {
-    auto key = hsh(deviceId);
-
-    if (auto it = cache.find(key); it != cache.end())
+    uint64_t address = 0;
+    bool addressKnown = ResolveDeviceAddress(deviceId, address);
+    if (addressKnown)
     {
-        EnsureStatusSubscription(key, it->second.device);
-        co_return it->second.device;
+        BluetoothLEDevice cached = nullptr;
+        {
+            lock_guard lock(cacheLock);
+            if (auto* entry = deviceCache.Find(address))
+            {
+                EnsureStatusSubscription(*entry);
+                cached = entry->device;
+            }
+        }
+        if (cached)
+        {
+            cacheCounters.deviceHits.fetch_add(1, memory_order_relaxed);
+            co_return cached;
+        }
     }
+    cacheCounters.deviceMisses.fetch_add(1, memory_order_relaxed);
 
     BluetoothLEDevice result = co_await BluetoothLEDevice::FromIdAsync(deviceId);
     if (!result)
     {
-        saveError(L"%s:%d Failed to connect to device.", __WFILE__, __LINE__);
+        saveError(ErrorCode::COMMUNICATION, L"%ls:%d Failed to connect to device.", __WFILE__, __LINE__);
         co_return nullptr;
     }
 
     clearError();
-    auto& entry = cache[key];
-    entry.device = result;
-    EnsureStatusSubscription(key, entry.device);
-    co_return entry.device;
+    lock_guard lock(cacheLock);
+    if (!addressKnown)
+    {
+        address = result.BluetoothAddress();
+        deviceAddressAliases[deviceId] = address;
+    }
+    auto& entry = deviceCache.Insert(address);
+    if (!entry.device)
+        entry.device = result;
+    EnsureStatusSubscription(entry);
+    result = entry.device;
+    co_return result;
 }
 IAsyncOperation<GattDeviceService> retrieveService(wchar_t* deviceId, wchar_t* serviceId) {
 	auto device = co_await retrieveDevice(deviceId);
 	if (device == nullptr)
 		co_return nullptr;
-	if (cache[hsh(deviceId)].services.count(hsh(serviceId)))
-		co_return cache[hsh(deviceId)].services[hsh(serviceId)].service;
-	GattDeviceServicesResult result = co_await device.GetGattServicesForUuidAsync(make_guid(serviceId), BluetoothCacheMode::Cached);
+	ServiceKey key{ 0, make_guid(serviceId) };
+	if (!ResolveDeviceAddress(deviceId, key.address))
+		co_return nullptr;
+	{
+		GattDeviceService cached = nullptr;
+		{
+			lock_guard lock(cacheLock);
+			if (auto* entry = serviceCache.Find(key))
+				cached = entry->service;
+		}
+		if (cached) {
+			cacheCounters.serviceHits.fetch_add(1, memory_order_relaxed);
+			co_return cached;
+		}
+	}
+	cacheCounters.serviceMisses.fetch_add(1, memory_order_relaxed);
+	GattDeviceServicesResult result = co_await device.GetGattServicesForUuidAsync(key.service, BluetoothCacheMode::Cached);
 	if (result.Status() != GattCommunicationStatus::Success) {
-		saveError(L"%s:%d Failed retrieving services.", __WFILE__, __LINE__);
+		saveError(ErrorCode::COMMUNICATION, L"%ls:%d Failed retrieving services.", __WFILE__, __LINE__);
 		co_return nullptr;
 	}
 	else if (result.Services().Size() == 0) {
-		saveError(L"%s:%d No service found with uuid ", __WFILE__, __LINE__);
+		saveError(ErrorCode::NOT_FOUND, L"%ls:%d No service found with uuid %ls", __WFILE__, __LINE__, serviceId);
 		co_return nullptr;
 	}
 	else {
 		clearError();
-		cache[hsh(deviceId)].services[hsh(serviceId)] = { result.Services().GetAt(0) };
-		co_return cache[hsh(deviceId)].services[hsh(serviceId)].service;
+		auto service = result.Services().GetAt(0);
+		lock_guard lock(cacheLock);
+		serviceCache.Insert(key).service = service;
+		co_return service;
 	}
 }
 IAsyncOperation<GattCharacteristic> retrieveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId) {
+	CharacteristicKey key{ 0, make_guid(serviceId), make_guid(characteristicId) };
+	if (ResolveDeviceAddress(deviceId, key.address)) {
+		GattCharacteristic cached = nullptr;
+		{
+			lock_guard lock(cacheLock);
+			if (auto* entry = characteristicCache.Find(key))
+				cached = entry->characteristic;
+		}
+		if (cached) {
+			cacheCounters.characteristicHits.fetch_add(1, memory_order_relaxed);
+			co_return cached;
+		}
+	}
+	cacheCounters.characteristicMisses.fetch_add(1, memory_order_relaxed);
 	auto service = co_await retrieveService(deviceId, serviceId);
 	if (service == nullptr)
 		co_return nullptr;
-	if (cache[hsh(deviceId)].services[hsh(serviceId)].characteristics.count(hsh(characteristicId)))
-		co_return cache[hsh(deviceId)].services[hsh(serviceId)].characteristics[hsh(characteristicId)].characteristic;
-	GattCharacteristicsResult result = co_await service.GetCharacteristicsForUuidAsync(make_guid(characteristicId), BluetoothCacheMode::Cached);
+	// the address is known by now, retrieveService resolved the device
+	ResolveDeviceAddress(deviceId, key.address);
+	GattCharacteristicsResult result = co_await service.GetCharacteristicsForUuidAsync(key.characteristic, BluetoothCacheMode::Cached);
 	if (result.Status() != GattCommunicationStatus::Success) {
-		saveError(L"%s:%d Error scanning characteristics from service %s with status %d", __WFILE__, __LINE__, serviceId, result.Status());
+		saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error scanning characteristics from service %ls with status %d", __WFILE__, __LINE__, serviceId, static_cast<int>(result.Status()));
 		co_return nullptr;
 	}
 	else if (result.Characteristics().Size() == 0) {
-		saveError(L"%s:%d No characteristic found with uuid %s", __WFILE__, __LINE__, characteristicId);
+		saveError(ErrorCode::NOT_FOUND, L"%ls:%d No characteristic found with uuid %ls", __WFILE__, __LINE__, characteristicId);
 		co_return nullptr;
 	}
 	else {
 		clearError();
-		cache[hsh(deviceId)].services[hsh(serviceId)].characteristics[hsh(characteristicId)] = { result.Characteristics().GetAt(0) };
-		co_return cache[hsh(deviceId)].services[hsh(serviceId)].characteristics[hsh(characteristicId)].characteristic;
+		auto characteristic = result.Characteristics().GetAt(0);
+		lock_guard lock(cacheLock);
+		characteristicCache.Insert(key).characteristic = characteristic;
+		co_return characteristic;
 	}
 }
 
@@ -189,32 +240,42 @@ queue<DeviceUpdate> deviceQueue{};
 mutex deviceQueueLock;
 condition_variable deviceQueueSignal;
 bool deviceScanFinished;
+// a scan finished, but nobody polled FINISHED yet, see WaitEvents
+bool deviceScanFinishPending;
 
 queue<Service> serviceQueue{};
 mutex serviceQueueLock;
 condition_variable serviceQueueSignal;
 bool serviceScanFinished;
+bool serviceScanFinishPending;
 
 queue<Characteristic> characteristicQueue{};
 mutex characteristicQueueLock;
 condition_variable characteristicQueueSignal;
 bool characteristicScanFinished;
+bool characteristicScanFinishPending;
 
-// global flag to release calling thread
-mutex quitLock;
-bool quitFlag = false;
-
+// the revoker detaches the ValueChanged handler when the subscription is destroyed
 struct Subscription {
 	GattCharacteristic characteristic = nullptr;
 	GattCharacteristic::ValueChanged_revoker revoker;
+	CharacteristicId id{};
+	uint32_t handle = 0;
 };
-list<Subscription*> subscriptions;
+SubscriptionRegistry<Subscription> subscriptions;
 mutex subscribeQueueLock;
 condition_variable subscribeQueueSignal;
 
-queue<BLEData> dataQueue{};
-mutex dataQueueLock;
-condition_variable dataQueueSignal;
+// WinRT objects behind the handles of the engine, see RegisterCharacteristic. Entries of a device are dropped
+// together with its handles.
+struct ResolvedCharacteristic {
+	GattCharacteristic characteristic = nullptr;
+	uint64_t address = 0;
+};
+FlatTable<uint32_t, ResolvedCharacteristic> resolvedCharacteristics;
+// devices whose negotiated MTU was already requested, see ResolveWritePayloadAsync
+FlatTable<uint64_t, bool> payloadRequested;
+mutex resolvedLock;
 
 namespace
 {
@@ -252,23 +313,39 @@ namespace
         return update;
     }
 
-	inline bool ShouldQuit()
+    // adds the properties StartDeviceScan requests for the device table
+    DeviceObservation MakeObservation(DeviceUpdate const& update, IMapView<hstring, IInspectable> const& properties)
     {
-        std::lock_guard guard(quitLock);
-        return quitFlag;
+        DeviceObservation observation{};
+        observation.update = update;
+        if (properties.HasKey(L"System.Devices.Aep.DeviceAddress"))
+        {
+            auto address = unbox_value_or<hstring>(properties.Lookup(L"System.Devices.Aep.DeviceAddress"), L"");
+            ParseDeviceAddress(address.c_str(), observation.address);
+        }
+        if (properties.HasKey(L"System.Devices.Aep.IsConnected"))
+        {
+            observation.isConnected = unbox_value_or<bool>(properties.Lookup(L"System.Devices.Aep.IsConnected"), false);
+            observation.isConnectedUpdated = true;
+        }
+        return observation;
     }
 
     inline void Enqueue(DeviceUpdate const& update)
     {
-        std::lock_guard guard(deviceQueueLock);
-        deviceQueue.push(update);
-        deviceQueueSignal.notify_one();
+        {
+            std::lock_guard guard(deviceQueueLock);
+            deviceQueue.push(update);
+            deviceQueueCounter.Enqueued(deviceQueue.size());
+            deviceQueueSignal.notify_one();
+        }
+        SignalEvents(BLE_EVENT_DEVICE);
     }
 
 	Service MakeService(GattDeviceService const& svc)
     {
         Service s{};
-        wcscpy_s(s.uuid, _countof(s.uuid), to_hstring(svc.Uuid()).c_str());
+        format_guid(svc.Uuid(), s.uuid);
         return s;
     }
 
@@ -276,83 +353,137 @@ namespace
                                       wchar_t const* userDescription)
     {
         Characteristic ch{};
-        wcscpy_s(ch.uuid, _countof(ch.uuid), to_hstring(c.Uuid()).c_str());
+        format_guid(c.Uuid(), ch.uuid);
         wcscpy_s(ch.userDescription, _countof(ch.userDescription), userDescription);
         return ch;
     }
 
+    Service MakeService(BleGuid const& uuid)
+    {
+        Service s{};
+        GuidCodec::Format(uuid, s.uuid, _countof(s.uuid));
+        return s;
+    }
+
+    Characteristic MakeCharacteristic(GattCharacteristicLayout const& layout, bool withDescription)
+    {
+        Characteristic ch{};
+        GuidCodec::Format(layout.uuid, ch.uuid, _countof(ch.uuid));
+        if (withDescription)
+            wcscpy_s(ch.userDescription, _countof(ch.userDescription), layout.userDescription.c_str());
+        return ch;
+    }
+
 	void EnqueueService(Service const& svc)
     {
-        std::lock_guard guard(serviceQueueLock);
-        serviceQueue.push(svc);
-        serviceQueueSignal.notify_one();
+        {
+            std::lock_guard guard(serviceQueueLock);
+            serviceQueue.push(svc);
+            serviceQueueCounter.Enqueued(serviceQueue.size());
+            serviceQueueSignal.notify_one();
+        }
+        SignalEvents(BLE_EVENT_SERVICE);
     }
 
     void EnqueueCharacteristic(Characteristic const& ch)
     {
-        std::lock_guard guard(characteristicQueueLock);
-        characteristicQueue.push(ch);
-        characteristicQueueSignal.notify_one();
+        {
+            std::lock_guard guard(characteristicQueueLock);
+            characteristicQueue.push(ch);
+            characteristicQueueCounter.Enqueued(characteristicQueue.size());
+            characteristicQueueSignal.notify_one();
+        }
+        SignalEvents(BLE_EVENT_CHARACTERISTIC);
     }
 
-    std::wstring ReadCharacteristicDescription(GattCharacteristic const& ch)
+    IAsyncOperation<hstring> ReadCharacteristicDescriptionAsync(GattCharacteristic ch)
     {
-        constexpr auto userDescUuid = L"00002901-0000-1000-8000-00805F9B34FB";
-        auto descScan = ch.GetDescriptorsForUuidAsync(make_guid(userDescUuid), BluetoothCacheMode::Uncached).get();
-        if (descScan.Descriptors().Size() == 0)
-            return L"no description available";
+        constexpr guid userDescUuid = to_winrt_guid(WellKnownUuids::UserDescription);
+        auto descScan = co_await ch.GetDescriptorsForUuidAsync(userDescUuid, BluetoothCacheMode::Uncached);
+        if (descScan.Status() != GattCommunicationStatus::Success || descScan.Descriptors().Size() == 0)
+            co_return L"no description available";
 
         auto descriptor = descScan.Descriptors().GetAt(0);
-        auto value = descriptor.ReadValueAsync().get();
+        auto value = co_await descriptor.ReadValueAsync();
         if (value.Status() != GattCommunicationStatus::Success)
             throw hresult_error(E_FAIL, L"ReadValueAsync failed");
 
         auto reader = DataReader::FromBuffer(value.Value());
-        return std::wstring(reader.ReadString(reader.UnconsumedBufferLength()));
+        co_return reader.ReadString(reader.UnconsumedBufferLength());
     }
-}
 
-bool QuittableWait(condition_variable& signal, unique_lock<mutex>& waitLock) {
-	{
-		lock_guard quit_lock(quitLock);
-		if (quitFlag)
-			return true;
-	}
-	signal.wait(waitLock);
-	lock_guard quit_lock(quitLock);
-	return quitFlag;
+    // characteristics of one scan whose descriptions are read, and descriptors listed, by a few workers at once
+    struct DescriptionWork
+    {
+        std::vector<GattCharacteristic> characteristics;
+        bool readDescriptions = false;      // read and report, otherwise they were reported already
+        bool listDescriptors = false;       // for the GATT database
+        std::vector<hstring> descriptions;  // by index of characteristics, for the GATT database
+        std::vector<std::vector<BleGuid>> descriptors;
+        std::atomic<size_t> next{ 0 };
+    };
+
+    // Takes characteristics off work until none is left and reports each one as soon as its description was read, so
+    // one slow descriptor doesn't hold back the others.
+    IAsyncAction DescribeCharacteristicsAsync(std::shared_ptr<DescriptionWork> work)
+    {
+        for (;;)
+        {
+            size_t index = work->next.fetch_add(1, std::memory_order_relaxed);
+            if (index >= work->characteristics.size() || ShouldQuit())
+                co_return;
+            auto const& characteristic = work->characteristics[index];
+            if (work->readDescriptions)
+            {
+                hstring description;
+                try
+                {
+                    description = co_await ReadCharacteristicDescriptionAsync(characteristic);
+                }
+                catch (hresult_error const& ex)
+                {
+                    // the characteristic is still reported, just without its description
+                    saveError(ErrorCode::EXCEPTION, L"%ls:%d Reading the description of a characteristic failed: %ls", __WFILE__, __LINE__, ex.message().c_str());
+                }
+                if (ShouldQuit())
+                    co_return;
+                work->descriptions[index] = description;
+                EnqueueCharacteristic(MakeCharacteristic(characteristic, description.c_str()));
+            }
+            if (work->listDescriptors)
+            {
+                // the uncached discovery of the scan leaves the descriptors in the system cache
+                auto descriptors = co_await characteristic.GetDescriptorsAsync(BluetoothCacheMode::Cached);
+                if (descriptors.Status() == GattCommunicationStatus::Success)
+                    for (auto&& d : descriptors.Descriptors())
+                        work->descriptors[index].push_back(to_ble_guid(d.Uuid()));
+            }
+        }
+    }
 }
 
 void DeviceWatcher_Added(DeviceWatcher, DeviceInformation info)
 {
     if (ShouldQuit()) return;
-    Enqueue(MakeDeviceUpdate(info));
+    auto observation = MakeObservation(MakeDeviceUpdate(info), info.Properties());
+    MergeDevice(observation);
+    if (ScanFilterAccepts(observation))
+        Enqueue(observation.update);
 }
 
 void DeviceWatcher_Updated(DeviceWatcher, DeviceInformationUpdate info)
 {
     if (ShouldQuit()) return;
-    Enqueue(MakeDeviceUpdate(info));
+    auto observation = MakeObservation(MakeDeviceUpdate(info), info.Properties());
+    MergeDevice(observation);
+    if (ScanFilterAccepts(observation))
+        Enqueue(observation.update);
 }
 
 void DeviceWatcher_EnumerationCompleted(DeviceWatcher sender, IInspectable const&) {
 	// StopDeviceScan();
 }
 
-// ---- logging sink (no windows.h) ----
-static BleLogSinkFn g_logSink = nullptr;
-
-void SetLogSink(BleLogSinkFn sink)
-{
-    g_logSink = sink;
-}
-
-static inline void LogLine(const std::wstring& s)
-{
-    if (g_logSink) g_logSink(s.c_str());
-    else           std::wcerr << s << L'\n'; // simple fallback
-}
-
 static inline void ensure_apartment()
 {
     try
@@ -383,13 +514,13 @@ uint32_t GetRadios(RadioInfo* radios, uint32_t capacity)
         auto accessStatus = Radio::RequestAccessAsync().get();
         if (accessStatus != RadioAccessStatus::Allowed)
         {
-            saveError(L"%s:%d Bluetooth radio access denied (status %d).",
+            saveError(ErrorCode::COMMUNICATION, L"%ls:%d Bluetooth radio access denied (status %d).",
                       __WFILE__, __LINE__, static_cast<int32_t>(accessStatus));
             return 0;
         }
 
         auto radiosVector = Radio::GetRadiosAsync().get();
-        LogLine(L"[BleWinrtDll] ---- Bluetooth radio enumeration ----");
+        BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll] ---- Bluetooth radio enumeration ----");
 
         for (auto const& radio : radiosVector)
         {
@@ -415,7 +546,8 @@ uint32_t GetRadios(RadioInfo* radios, uint32_t capacity)
 
         if (bufferCapacity && bluetoothCount > bufferCapacity)
         {
-            LogLine(L"[BleWinrtDll] Warning: radio buffer truncated.");
+            BLE_LOG(LogLevel::WARNING, BLE_LOG_RADIO, L"[BleWinrtDll] Warning: radio buffer truncated (%u of %u).",
+                    bufferCapacity, bluetoothCount);
         }
 
         clearError();
@@ -423,12 +555,12 @@ uint32_t GetRadios(RadioInfo* radios, uint32_t capacity)
     }
     catch (hresult_error const& e)
     {
-        saveError(L"%s:%d Bluetooth radio enumeration failed: %s",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d Bluetooth radio enumeration failed: %ls",
                   __WFILE__, __LINE__, e.message().c_str());
     }
     catch (...)
     {
-        saveError(L"%s:%d Bluetooth radio enumeration failed: unknown exception.",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d Bluetooth radio enumeration failed: unknown exception.",
                   __WFILE__, __LINE__);
     }
 
@@ -443,18 +575,15 @@ bool IsBluetoothAvailable()
         ensure_apartment();
 
         auto radios = Radio::GetRadiosAsync().get();
-        LogLine(L"[BleWinrtDll] ---- Radio enumeration ----");
-        LogLine(L"[BleWinrtDll] Count = " + std::to_wstring(radios.Size()));
+        BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll] ---- Radio enumeration ----");
+        BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll] Count = %u", radios.Size());
 
         bool anyBt = false, btOn = false;
 
         for (auto const& r : radios)
         {
-            std::wstring name = r.Name().c_str();
-            std::wstring line = L"[BleWinrtDll]  - Name=\"" + name +
-                                L"\", Kind=" + std::to_wstring(static_cast<int32_t>(r.Kind())) +
-                                L", State=" + std::to_wstring(static_cast<int32_t>(r.State()));
-            LogLine(line);
+            BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll]  - Name=\"%ls\", Kind=%d, State=%d",
+                    r.Name().c_str(), static_cast<int32_t>(r.Kind()), static_cast<int32_t>(r.State()));
 
             if (r.Kind() == RadioKind::Bluetooth) {
                 anyBt = true;
@@ -462,30 +591,29 @@ bool IsBluetoothAvailable()
             }
         }
 
-        if (!anyBt) LogLine(L"[BleWinrtDll] No Bluetooth radio found.");
-        LogLine(L"[BleWinrtDll] ---- End enumeration ----");
+        if (!anyBt) BLE_LOG(LogLevel::WARNING, BLE_LOG_RADIO, L"[BleWinrtDll] No Bluetooth radio found.");
+        BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll] ---- End enumeration ----");
 
         return btOn;
     }
     catch (hresult_error const& e)
     {
-        LogLine(std::wstring(L"[BleWinrtDll] Radio enumeration failed: ") + e.message().c_str());
+        BLE_LOG(LogLevel::WARNING, BLE_LOG_RADIO, L"[BleWinrtDll] Radio enumeration failed: %ls", e.message().c_str());
         return false;
     }
     catch (...)
     {
-        LogLine(L"[BleWinrtDll] Radio enumeration failed: unknown exception.");
+        BLE_LOG(LogLevel::WARNING, BLE_LOG_RADIO, L"[BleWinrtDll] Radio enumeration failed: unknown exception.");
         return false;
     }
 }
 
 void StartDeviceScan(uint32_t seconds) {
+	OperationScope operation;
 	// as this is the first function that must be called, if Quit() was called before, assume here that the client wants to restart
-	{
-		lock_guard lock(quitLock);
-		quitFlag = false;
-		clearError();
-	}
+	ResetQuit();
+	clearError();
+	CompileScanFilter();
 
 	IVector<hstring> requestedProperties = single_threaded_vector<hstring>({ L"System.Devices.Aep.DeviceAddress", L"System.Devices.Aep.IsConnected", L"System.Devices.Aep.Bluetooth.Le.IsConnectable" });
 	hstring aqsAllBluetoothLEDevices = L"(System.Devices.Aep.ProtocolId:=\"{bb7bb05e-5972-42b5-94fc-76eaa7084d49}\")"; // list Bluetooth LE devices
@@ -498,8 +626,9 @@ void StartDeviceScan(uint32_t seconds) {
 	deviceWatcherAddedRevoker = deviceWatcher.Added(auto_revoke, &DeviceWatcher_Added);
 	deviceWatcherUpdatedRevoker = deviceWatcher.Updated(auto_revoke, &DeviceWatcher_Updated);
 	deviceWatcherCompletedRevoker = deviceWatcher.EnumerationCompleted(auto_revoke, &DeviceWatcher_EnumerationCompleted);
-	// ~30 seconds scan ; for permanent scanning use BluetoothLEAdvertisementWatcher, see the BluetoothAdvertisement.zip sample
+	// ~30 seconds scan; for permanent scanning see StartAdvertisementScan
 	deviceScanFinished = false;
+	deviceScanFinishPending = false;
 	deviceWatcher.Start();
 
 	if (seconds > 0) {
@@ -511,16 +640,95 @@ void StartDeviceScan(uint32_t seconds) {
 }
 
 void StopDeviceScan() {
-	lock_guard lock(deviceQueueLock);
-	if (deviceWatcher != nullptr) {
-		deviceWatcherAddedRevoker.revoke();
-		deviceWatcherUpdatedRevoker.revoke();
-		deviceWatcherCompletedRevoker.revoke();
-		deviceWatcher.Stop();
-		deviceWatcher = nullptr;
+	{
+		lock_guard lock(deviceQueueLock);
+		if (deviceWatcher != nullptr) {
+			deviceWatcherAddedRevoker.revoke();
+			deviceWatcherUpdatedRevoker.revoke();
+			deviceWatcherCompletedRevoker.revoke();
+			deviceWatcher.Stop();
+			deviceWatcher = nullptr;
+		}
+		deviceScanFinished = true;
+		deviceScanFinishPending = true;
+		deviceQueueSignal.notify_one();
+	}
+	SignalEvents(BLE_EVENT_DEVICE);
+}
+
+BluetoothLEAdvertisementWatcher advertisementWatcher{ nullptr };
+BluetoothLEAdvertisementWatcher::Received_revoker advertisementReceivedRevoker;
+BluetoothLEAdvertisementWatcher::Stopped_revoker advertisementStoppedRevoker;
+mutex advertisementWatcherLock;
+
+void AdvertisementWatcher_Received(BluetoothLEAdvertisementWatcher const&, BluetoothLEAdvertisementReceivedEventArgs const& args)
+{
+	uint64_t receivedNs = TimestampNs();
+	if (ShouldQuit()) return;
+	// The watcher only hands out the parsed sections; put the AD structures back together so that the core parses
+	// the same format for every backend. Larger than AdvertisementRecord::payload, so that truncation is reported.
+	uint8_t payload[512];
+	size_t size = 0;
+	for (auto const& section : args.Advertisement().DataSections()) {
+		auto data = section.Data();
+		uint32_t length = data.Length();
+		if (length > 254 || size + 2 + length > sizeof(payload))
+			break;
+		payload[size++] = static_cast<uint8_t>(length + 1);
+		payload[size++] = section.DataType();
+		memcpy(payload + size, data.data(), length);
+		size += length;
 	}
-	deviceScanFinished = true;
-	deviceQueueSignal.notify_one();
+	PublishAdvertisement(args.BluetoothAddress(), args.RawSignalStrengthInDBm(),
+		static_cast<uint8_t>(args.AdvertisementType()), payload, size, receivedNs);
+}
+
+void AdvertisementWatcher_Stopped(BluetoothLEAdvertisementWatcher const&, BluetoothLEAdvertisementWatcherStoppedEventArgs const& args)
+{
+	// also raised when the radio is turned off or taken by another app
+	if (args.Error() != BluetoothError::Success)
+		saveError(ErrorCode::COMMUNICATION, L"%ls:%d Advertisement scan stopped with BluetoothError %d", __WFILE__, __LINE__, static_cast<int>(args.Error()));
+}
+
+void StopAdvertisementWatcher()
+{
+	if (advertisementWatcher != nullptr) {
+		advertisementReceivedRevoker.revoke();
+		advertisementStoppedRevoker.revoke();
+		advertisementWatcher.Stop();
+		advertisementWatcher = nullptr;
+	}
+}
+
+bool StartAdvertisementScan(bool active) {
+	OperationScope operation;
+	// can be the first call after Quit just like StartDeviceScan
+	ResetQuit();
+	clearError();
+
+	CompileScanFilter();
+	lock_guard lock(advertisementWatcherLock);
+	StopAdvertisementWatcher();
+	try {
+		advertisementWatcher = BluetoothLEAdvertisementWatcher();
+		advertisementWatcher.ScanningMode(active ? BluetoothLEScanningMode::Active : BluetoothLEScanningMode::Passive);
+		advertisementReceivedRevoker = advertisementWatcher.Received(auto_revoke, &AdvertisementWatcher_Received);
+		advertisementStoppedRevoker = advertisementWatcher.Stopped(auto_revoke, &AdvertisementWatcher_Stopped);
+		advertisementWatcher.Start();
+	}
+	catch (hresult_error const& ex) {
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d StartAdvertisementScan failed: %ls", __WFILE__, __LINE__, ex.message().c_str());
+		advertisementReceivedRevoker.revoke();
+		advertisementStoppedRevoker.revoke();
+		advertisementWatcher = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void StopAdvertisementScan() {
+	lock_guard lock(advertisementWatcherLock);
+	StopAdvertisementWatcher();
 }
 
 ScanStatus PollDevice(DeviceUpdate* device, bool block)
@@ -530,7 +738,10 @@ ScanStatus PollDevice(DeviceUpdate* device, bool block)
     while (deviceQueue.empty())
     {
         if (deviceScanFinished)
+        {
+            deviceScanFinishPending = false;
             return ScanStatus::FINISHED;
+        }
 
         if (!block)
             return ScanStatus::PROCESSING;
@@ -541,32 +752,14 @@ ScanStatus PollDevice(DeviceUpdate* device, bool block)
 
     *device = deviceQueue.front();
     deviceQueue.pop();
+    deviceQueueCounter.Dequeued();
     return ScanStatus::AVAILABLE;
 }
 
 // Connect
-queue<ConnectionUpdate> connectionQueue{};
-mutex connectionQueueLock;
-condition_variable connectionQueueSignal;
-
-
-
 void EnqueueConnectionUpdate(const wchar_t* deviceId, BluetoothConnectionStatus status)
 {
-    ConnectionUpdate update{};
-    wcsncpy_s(update.deviceId, _countof(update.deviceId), deviceId, _TRUNCATE);
-    update.status = static_cast<int32_t>(status);
-
-    {
-        lock_guard lock(quitLock);
-        if (quitFlag)
-            return;
-    }
-    {
-        lock_guard queueLock(connectionQueueLock);
-        connectionQueue.push(update);
-    }
-    connectionQueueSignal.notify_one();
+    EnqueueConnectionUpdate(deviceId, static_cast<int32_t>(status));
 }
 
 void BluetoothLEDevice_ConnectionStatusChanged(BluetoothLEDevice const& sender, IInspectable const&)
@@ -574,30 +767,21 @@ void BluetoothLEDevice_ConnectionStatusChanged(BluetoothLEDevice const& sender,
     EnqueueConnectionUpdate(sender.DeviceId().c_str(), sender.ConnectionStatus());
 }
 
-void EnsureStatusSubscription(long key, BluetoothLEDevice const& device)
+void BluetoothLEDevice_GattServicesChanged(BluetoothLEDevice const& sender, IInspectable const&)
 {
-    auto& entry = cache[key];
-    if (!entry.statusSubscribed)
-    {
-        entry.statusChangedRevoker = device.ConnectionStatusChanged(auto_revoke, &BluetoothLEDevice_ConnectionStatusChanged);
-        entry.statusSubscribed = true;
-        EnqueueConnectionUpdate(device.DeviceId().c_str(), device.ConnectionStatus());
-    }
+    InvalidateGattLayout(sender.BluetoothAddress());
 }
 
-bool PollConnection(ConnectionUpdate* update, bool block)
+// expects cacheLock to be held
+void EnsureStatusSubscription(DeviceCacheEntry& entry)
 {
-    unique_lock<mutex> lock(connectionQueueLock);
-    while (connectionQueue.empty())
+    if (!entry.statusSubscribed)
     {
-        if (!block)
-            return false;
-        if (QuittableWait(connectionQueueSignal, lock))
-            return false;
+        entry.statusChangedRevoker = entry.device.ConnectionStatusChanged(auto_revoke, &BluetoothLEDevice_ConnectionStatusChanged);
+        entry.servicesChangedRevoker = entry.device.GattServicesChanged(auto_revoke, &BluetoothLEDevice_GattServicesChanged);
+        entry.statusSubscribed = true;
+        EnqueueConnectionUpdate(entry.device.DeviceId().c_str(), entry.device.ConnectionStatus());
     }
-    *update = connectionQueue.front();
-    connectionQueue.pop();
-    return true;
 }
 
 IAsyncOperation<bool> ConnectDeviceAsync(wchar_t* deviceId)
@@ -607,7 +791,7 @@ IAsyncOperation<bool> ConnectDeviceAsync(wchar_t* deviceId)
         auto device = co_await retrieveDevice(deviceId);
         if (!device)
         {
-            saveError(L"%s:%d ConnectDeviceAsync: device not cached/available.", __WFILE__, __LINE__);
+            saveError(ErrorCode::NOT_FOUND, L"%ls:%d ConnectDeviceAsync: device not cached/available.", __WFILE__, __LINE__);
             co_return false;
         }
 
@@ -615,7 +799,7 @@ IAsyncOperation<bool> ConnectDeviceAsync(wchar_t* deviceId)
         auto probe = co_await device.GetGattServicesAsync(BluetoothCacheMode::Cached);
         if (probe.Status() != GattCommunicationStatus::Success)
         {
-            saveError(L"%s:%d ConnectDeviceAsync: probe failed with status %d.",
+            saveError(ErrorCode::COMMUNICATION, L"%ls:%d ConnectDeviceAsync: probe failed with status %d.",
                       __WFILE__, __LINE__, static_cast<int>(probe.Status()));
             co_return false;
         }
@@ -625,13 +809,13 @@ IAsyncOperation<bool> ConnectDeviceAsync(wchar_t* deviceId)
     }
     catch (hresult_error const& e)
     {
-        saveError(L"%s:%d ConnectDeviceAsync threw: %s",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d ConnectDeviceAsync threw: %ls",
                   __WFILE__, __LINE__, e.message().c_str());
         co_return false;
     }
     catch (...)
     {
-        saveError(L"%s:%d ConnectDeviceAsync: unknown exception.",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d ConnectDeviceAsync: unknown exception.",
                   __WFILE__, __LINE__);
         co_return false;
     }
@@ -639,6 +823,7 @@ IAsyncOperation<bool> ConnectDeviceAsync(wchar_t* deviceId)
 
 bool ConnectDevice(wchar_t* deviceId, bool block)
 {
+    OperationScope operation;
     auto op = ConnectDeviceAsync(deviceId);
     return block ? op.get() : (op.Completed([](auto&&, auto&&) {}), true);
 }
@@ -646,60 +831,72 @@ bool ConnectDevice(wchar_t* deviceId, bool block)
 // Disconnect
 bool DisconnectDevice(wchar_t* deviceId)
 {
+    OperationScope operation;
     try
     {
-        auto key = hsh(deviceId);
-        auto it = cache.find(key);
-        if (it == cache.end())
+        uint64_t address = 0;
+        unique_lock lock(cacheLock, defer_lock);
+        DeviceCacheEntry* entry = nullptr;
+        if (ResolveDeviceAddress(deviceId, address))
+        {
+            lock.lock();
+            entry = deviceCache.Find(address);
+        }
+        if (entry == nullptr)
         {
-            saveError(L"%s:%d DisconnectDevice: device %s not cached.",
+            saveError(ErrorCode::NOT_FOUND, L"%ls:%d DisconnectDevice: device %ls not cached.",
                       __WFILE__, __LINE__, deviceId);
             return false;
         }
 
+        // take everything of the device out of the caches; revoking, closing and reporting happen after unlocking
+        vector<unique_ptr<Subscription>> taken;
         {
             std::lock_guard subLock(subscribeQueueLock);
-            for (auto iter = subscriptions.begin(); iter != subscriptions.end();)
-            {
-                auto* sub = *iter;
-                if (sub && sub->characteristic.Service().Device().DeviceId() == deviceId)
-                {
-                    sub->revoker.revoke();
-                    delete sub;
-                    iter = subscriptions.erase(iter);
-                }
-                else
-                {
-                    ++iter;
-                }
-            }
+            taken = subscriptions.TakeDevice(address);
         }
-
-        if (it->second.statusSubscribed)
+        DeviceCacheEntry device = move(*entry);
+        deviceCache.Erase(address);
+        vector<GattDeviceService> services;
+        characteristicCache.EraseIf([address](CharacteristicKey const& key, CharacteristicCacheEntry&) { return key.address == address; });
+        serviceCache.EraseIf([address, &services](ServiceKey const& key, ServiceCacheEntry& entry)
+        {
+            if (key.address != address)
+                return false;
+            services.push_back(entry.service);
+            return true;
+        });
+        lock.unlock();
+
+        taken.clear();
+        if (device.statusSubscribed)
         {
-            it->second.statusChangedRevoker.revoke();
-            it->second.statusSubscribed = false;
+            device.statusChangedRevoker.revoke();
+            device.servicesChangedRevoker.revoke();
+            device.statusSubscribed = false;
         }
-        EnqueueConnectionUpdate(deviceId, BluetoothConnectionStatus::Disconnected);
-
-        for (auto& svcPair : it->second.services)
+        ReleaseDevice(address);
         {
-            svcPair.second.service.Close();
+            lock_guard guard(resolvedLock);
+            resolvedCharacteristics.EraseIf([address](uint32_t, ResolvedCharacteristic& resolved) { return resolved.address == address; });
+            payloadRequested.Erase(address);
         }
-        it->second.device.Close();
-        cache.erase(it);
+        EnqueueConnectionUpdate(deviceId, BluetoothConnectionStatus::Disconnected);
+        for (auto& service : services)
+            service.Close();
+        device.device.Close();
 
         clearError();
         return true;
     }
     catch (hresult_error const& e)
     {
-        saveError(L"%s:%d DisconnectDevice failed: %s",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d DisconnectDevice failed: %ls",
                   __WFILE__, __LINE__, e.message().c_str());
     }
     catch (...)
     {
-        saveError(L"%s:%d DisconnectDevice failed: unknown exception.",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d DisconnectDevice failed: unknown exception.",
                   __WFILE__, __LINE__);
     }
     return false;
@@ -710,38 +907,108 @@ bool DisconnectDevice(wchar_t* deviceId)
 
 
 
+// Rediscovers a device whose scan was answered from the GATT database and drops its stored layout if it changed.
+fire_and_forget RevalidateGattAsync(wstring deviceId, uint64_t address) {
+	try {
+		auto device = co_await retrieveDevice(deviceId.data());
+		if (device == nullptr)
+			co_return;
+		auto services = co_await device.GetGattServicesAsync(BluetoothCacheMode::Uncached);
+		if (services.Status() != GattCommunicationStatus::Success)
+			co_return;
+		vector<GattServiceLayout> live;
+		for (auto&& svc : services.Services())
+		{
+			if (ShouldQuit()) co_return;
+			GattServiceLayout layout;
+			layout.uuid = to_ble_guid(svc.Uuid());
+			auto characteristics = co_await svc.GetCharacteristicsAsync(BluetoothCacheMode::Uncached);
+			if (characteristics.Status() == GattCommunicationStatus::Success) {
+				layout.characteristicsKnown = true;
+				for (auto&& c : characteristics.Characteristics())
+				{
+					GattCharacteristicLayout characteristic;
+					characteristic.uuid = to_ble_guid(c.Uuid());
+					layout.characteristics.push_back(move(characteristic));
+				}
+			}
+			live.push_back(move(layout));
+		}
+		RevalidateGattLayout(address, live);
+	}
+	catch (hresult_error& ex)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d RevalidateGattAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
+	}
+}
+
 fire_and_forget ScanServicesAsync(wchar_t* deviceId) {
 	{
 		lock_guard queueGuard(serviceQueueLock);
 		serviceScanFinished = false;
+		serviceScanFinishPending = false;
 	}
+	// the caller's buffer may be gone once this suspends
+	wstring id = deviceId;
+	uint64_t address = 0;
+	bool addressKnown = ResolveDeviceAddress(id.c_str(), address);
+	bool fromCache = false;
+	vector<BleGuid> cachedServices;
 	try {
-		auto bluetoothLeDevice = co_await retrieveDevice(deviceId);
-		if (bluetoothLeDevice != nullptr) {
-			GattDeviceServicesResult result = co_await bluetoothLeDevice.GetGattServicesAsync(BluetoothCacheMode::Uncached);
-			if (result.Status() == GattCommunicationStatus::Success) {
-				for (auto&& svc : result.Services())
-				{
-					if (ShouldQuit()) break;
-					EnqueueService(MakeService(svc));
-				}
+		BluetoothLEDevice bluetoothLeDevice = nullptr;
+		if (!addressKnown) {
+			// the database is keyed by address; ids without one are resolved through the device, needed anyway on a miss
+			bluetoothLeDevice = co_await retrieveDevice(id.data());
+			addressKnown = bluetoothLeDevice != nullptr;
+			if (addressKnown)
+				address = bluetoothLeDevice.BluetoothAddress();
+		}
+		fromCache = addressKnown && LookupGattServices(address, cachedServices);
+		if (fromCache) {
+			for (auto const& uuid : cachedServices)
+			{
+				if (ShouldQuit()) break;
+				EnqueueService(MakeService(uuid));
 			}
-			else {
-				saveError(L"%s:%d Failed retrieving services.", __WFILE__, __LINE__);
+		}
+		else if (addressKnown) {
+			if (bluetoothLeDevice == nullptr)
+				bluetoothLeDevice = co_await retrieveDevice(id.data());
+			if (bluetoothLeDevice != nullptr) {
+				GattDeviceServicesResult result = co_await bluetoothLeDevice.GetGattServicesAsync(BluetoothCacheMode::Uncached);
+				if (result.Status() == GattCommunicationStatus::Success) {
+					vector<BleGuid> uuids;
+					for (auto&& svc : result.Services())
+					{
+						if (ShouldQuit()) break;
+						uuids.push_back(to_ble_guid(svc.Uuid()));
+						EnqueueService(MakeService(svc));
+					}
+					if (!ShouldQuit())
+						StoreGattServices(address, uuids);
+				}
+				else {
+					saveError(ErrorCode::COMMUNICATION, L"%ls:%d Failed retrieving services.", __WFILE__, __LINE__);
+				}
 			}
 		}
 	}
 	catch (hresult_error& ex)
 	{
-		saveError(L"%s:%d ScanServicesAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d ScanServicesAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
 	}
 	{
 		lock_guard queueGuard(serviceQueueLock);
 		serviceScanFinished = true;
+		serviceScanFinishPending = true;
 		serviceQueueSignal.notify_one();
 	}
+	SignalEvents(BLE_EVENT_SERVICE);
+	if (fromCache && ShouldRevalidateGatt(address))
+		RevalidateGattAsync(id, address);
 }
 void ScanServices(wchar_t* deviceId) {
+	OperationScope operation;
 	ScanServicesAsync(deviceId);
 }
 
@@ -754,48 +1021,114 @@ ScanStatus PollService(Service* service, bool block) {
 	if (!serviceQueue.empty()) {
 		*service = serviceQueue.front();
 		serviceQueue.pop();
+		serviceQueueCounter.Dequeued();
 		res = ScanStatus::AVAILABLE;
 	}
-	else if (serviceScanFinished)
+	else if (serviceScanFinished) {
+		serviceScanFinishPending = false;
 		res = ScanStatus::FINISHED;
+	}
 	else
 		res = ScanStatus::PROCESSING;
 	return res;
 }
 
 fire_and_forget ScanCharacteristicsAsync(wchar_t* deviceId, wchar_t* serviceId) {
+	auto options = CurrentDiscoveryOptions();
 	{
 		lock_guard lock(characteristicQueueLock);
 		characteristicScanFinished = false;
+		characteristicScanFinishPending = false;
 	}
+	// the caller's buffers may be gone once this suspends
+	wstring id = deviceId;
+	wstring serviceText = serviceId;
+	uint64_t address = 0;
+	bool addressKnown = ResolveDeviceAddress(id.c_str(), address);
+	auto serviceUuid = GuidCodec::Parse(serviceText.c_str());
+	vector<GattCharacteristicLayout> cachedCharacteristics;
 	try {
-		auto service = co_await retrieveService(deviceId, serviceId);
-		if (service != nullptr) {
-			GattCharacteristicsResult charScan = co_await service.GetCharacteristicsAsync(BluetoothCacheMode::Uncached);
-			if (charScan.Status() != GattCommunicationStatus::Success)
-				saveError(L"%s:%d Error scanning characteristics from service %s width status %d", __WFILE__, __LINE__, serviceId, (int)charScan.Status());
-			else {
-				for (auto&& c : charScan.Characteristics())
-				{
-					auto description = ReadCharacteristicDescription(c); // helper that wraps descriptor logic
-					if (ShouldQuit()) break;
-					EnqueueCharacteristic(MakeCharacteristic(c, description.c_str()));
+		if (!addressKnown) {
+			// as in ScanServicesAsync; retrieveService finds the device in the device cache afterwards
+			auto device = co_await retrieveDevice(id.data());
+			addressKnown = device != nullptr;
+			if (addressKnown)
+				address = device.BluetoothAddress();
+		}
+		bool fromCache = addressKnown
+			&& LookupGattCharacteristics(address, serviceUuid, options.readUserDescriptions, cachedCharacteristics);
+		if (fromCache) {
+			for (auto const& layout : cachedCharacteristics)
+			{
+				if (ShouldQuit()) break;
+				EnqueueCharacteristic(MakeCharacteristic(layout, options.readUserDescriptions));
+			}
+		}
+		else if (addressKnown) {
+			auto service = co_await retrieveService(id.data(), serviceText.data());
+			if (service != nullptr) {
+				GattCharacteristicsResult charScan = co_await service.GetCharacteristicsAsync(BluetoothCacheMode::Uncached);
+				if (charScan.Status() != GattCommunicationStatus::Success)
+					saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error scanning characteristics from service %ls width status %d", __WFILE__, __LINE__, serviceText.c_str(), (int)charScan.Status());
+				else {
+					auto work = make_shared<DescriptionWork>();
+					for (auto&& c : charScan.Characteristics())
+						work->characteristics.push_back(c);
+					work->readDescriptions = options.readUserDescriptions;
+					work->listDescriptors = GattCacheEnabled();
+					work->descriptions.resize(work->characteristics.size());
+					work->descriptors.resize(work->characteristics.size());
+					if (!options.readUserDescriptions) {
+						for (auto const& c : work->characteristics)
+						{
+							if (ShouldQuit()) break;
+							EnqueueCharacteristic(MakeCharacteristic(c, L""));
+						}
+					}
+					if (work->readDescriptions || work->listDescriptors) {
+						// every description costs a descriptor lookup and a read, and every descriptor list a lookup;
+						// keep a bounded number of them in flight
+						auto workerCount = min<size_t>(options.maxConcurrentReads, work->characteristics.size());
+						vector<IAsyncAction> workers;
+						for (size_t i = 0; i < workerCount; i++)
+							workers.push_back(DescribeCharacteristicsAsync(work));
+						for (auto& worker : workers)
+							co_await worker;
+					}
+
+					if (work->listDescriptors && !ShouldQuit()) {
+						vector<GattCharacteristicLayout> layouts;
+						for (size_t i = 0; i < work->characteristics.size(); i++)
+						{
+							auto const& c = work->characteristics[i];
+							GattCharacteristicLayout layout;
+							layout.uuid = to_ble_guid(c.Uuid());
+							layout.properties = static_cast<uint32_t>(c.CharacteristicProperties());
+							layout.userDescription = work->descriptions[i];
+							layout.descriptors = move(work->descriptors[i]);
+							layouts.push_back(move(layout));
+						}
+						StoreGattCharacteristics(address, serviceUuid, options.readUserDescriptions, layouts);
+					}
 				}
 			}
 		}
 	}
 	catch (hresult_error& ex)
 	{
-		saveError(L"%s:%d ScanCharacteristicsAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d ScanCharacteristicsAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
 	}
 	{
 		lock_guard lock(characteristicQueueLock);
 		characteristicScanFinished = true;
+		characteristicScanFinishPending = true;
 		characteristicQueueSignal.notify_one();
 	}
+	SignalEvents(BLE_EVENT_CHARACTERISTIC);
 }
 
 void ScanCharacteristics(wchar_t* deviceId, wchar_t* serviceId) {
+	OperationScope operation;
 	ScanCharacteristicsAsync(deviceId, serviceId);
 }
 
@@ -808,140 +1141,169 @@ ScanStatus PollCharacteristic(Characteristic* characteristic, bool block) {
 	if (!characteristicQueue.empty()) {
 		*characteristic = characteristicQueue.front();
 		characteristicQueue.pop();
+		characteristicQueueCounter.Dequeued();
 		res = ScanStatus::AVAILABLE;
 	}
-	else if (characteristicScanFinished)
+	else if (characteristicScanFinished) {
+		characteristicScanFinishPending = false;
 		res = ScanStatus::FINISHED;
+	}
 	else
 		res = ScanStatus::PROCESSING;
 	return res;
 }
 
+// registers the handle of a resolved characteristic with the engine and keeps the WinRT object behind it
+uint32_t RegisterCharacteristic(GattCharacteristic const& characteristic)
+{
+	auto service = characteristic.Service();
+	auto device = service.Device();
+	CharacteristicId id{ device.BluetoothAddress(), to_ble_guid(service.Uuid()), to_ble_guid(characteristic.Uuid()) };
+	auto handle = RegisterHandle(id, device.DeviceId().c_str());
+	if (handle == 0)
+		return 0;
+	lock_guard guard(resolvedLock);
+	auto& resolved = resolvedCharacteristics.Insert(handle);
+	resolved.characteristic = characteristic;
+	resolved.address = id.address;
+	return handle;
+}
 
+GattCharacteristic LookupCharacteristic(uint32_t handle)
+{
+	lock_guard guard(resolvedLock);
+	auto* resolved = resolvedCharacteristics.Find(handle);
+	return resolved != nullptr ? resolved->characteristic : nullptr;
+}
 
+void AddSubscription(GattCharacteristic const& characteristic, shared_ptr<NotificationSink> const& sink)
+{
+	auto subscription = make_unique<Subscription>();
+	subscription->characteristic = characteristic;
+	// the identity is read once here, lookups and teardown only compare it
+	auto service = characteristic.Service();
+	subscription->id = CharacteristicId{ service.Device().BluetoothAddress(), to_ble_guid(service.Uuid()), to_ble_guid(characteristic.Uuid()) };
+	subscription->handle = sink->Handle();
+	subscription->revoker = characteristic.ValueChanged(auto_revoke,
+		[sink](GattCharacteristic const&, GattValueChangedEventArgs const& args)
+		{
+			auto receivedNs = TimestampNs();
+			// IBuffer to array, copied from https://stackoverflow.com/a/55974934
+			auto value = args.CharacteristicValue();
+			sink->OnValue(receivedNs, value.data(), value.Length());
+		});
+
+	// a repeated subscribe replaces the previous handler instead of adding a second one
+	unique_ptr<Subscription> previous;
+	{
+		std::lock_guard guard(subscribeQueueLock);
+		previous = subscriptions.Add(move(subscription));
+	}
+}
 
-
-
-void Characteristic_ValueChanged(GattCharacteristic const& characteristic, GattValueChangedEventArgs args)
+uint32_t SubscribeCharacteristicImpl(wchar_t* deviceId,
+                                     wchar_t* serviceId,
+                                     wchar_t* characteristicId,
+                                     SubscriptionMode mode)
 {
-	BLEData data;
-	wcscpy_s(data.characteristicUuid, sizeof(data.characteristicUuid) / sizeof(wchar_t), to_hstring(characteristic.Uuid()).c_str());
-	wcscpy_s(data.serviceUuid, sizeof(data.serviceUuid) / sizeof(wchar_t), to_hstring(characteristic.Service().Uuid()).c_str());
-	wcscpy_s(data.deviceId, sizeof(data.deviceId) / sizeof(wchar_t), characteristic.Service().Device().DeviceId().c_str());
+    OperationScope operation;
+    auto handle = ResolveCharacteristic(deviceId, serviceId, characteristicId);
+    if (handle == 0 || !SubscribeByHandle(handle, mode))
+        return 0;
+    return handle;
+}
 
-	data.size = args.CharacteristicValue().Length();
-	// IBuffer to array, copied from https://stackoverflow.com/a/55974934
-	memcpy(data.buf, args.CharacteristicValue().data(), data.size);
+bool SubscribeCharacteristic(wchar_t* deviceId,
+                             wchar_t* serviceId,
+                             wchar_t* characteristicId,
+                             bool /*block*/)
+{
+    return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::QUEUED) != 0;
+}
 
-	{
-		lock_guard lock(quitLock);
-		if (quitFlag)
-			return;
-	}
-	{
-		lock_guard queueGuard(dataQueueLock);
-		dataQueue.push(data);
-		dataQueueSignal.notify_one();
-	}
+uint32_t SubscribeCharacteristicV2(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+    return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::QUEUED);
 }
 
-fire_and_forget SubscribeCharacteristicAsync(wchar_t* deviceId,
-                                             wchar_t* serviceId,
-                                             wchar_t* characteristicId,
-                                             bool* completionFlag)
+uint32_t SubscribeCharacteristicLatest(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
 {
-    bool succeeded = false;
+    return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::LATEST);
+}
 
+uint32_t ResolveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+    OperationScope operation;
     try
     {
-        auto characteristic = co_await retrieveCharacteristic(deviceId, serviceId, characteristicId);
-        if (characteristic != nullptr)
+        auto characteristic = retrieveCharacteristic(deviceId, serviceId, characteristicId).get();
+        if (characteristic == nullptr)
         {
-            auto status = co_await characteristic
-                .WriteClientCharacteristicConfigurationDescriptorAsync(
-                    GattClientCharacteristicConfigurationDescriptorValue::Notify);
-
-            if (status != GattCommunicationStatus::Success)
-            {
-                saveError(L"%s:%d Error subscribing to characteristic %s (status %d)",
-                          __WFILE__, __LINE__, characteristicId, status);
-            }
-            else
-            {
-                auto* subscription = new Subscription();
-                subscription->characteristic = characteristic;
-                subscription->revoker = characteristic.ValueChanged(auto_revoke, &Characteristic_ValueChanged);
-
-                {
-                    std::lock_guard guard(subscribeQueueLock);
-                    subscriptions.push_back(subscription);
-                }
-
-                succeeded = true;
-            }
+            saveError(ErrorCode::NOT_FOUND, L"%ls:%d Failed to resolve characteristic %ls",
+                      __WFILE__, __LINE__, characteristicId);
+            return 0;
         }
+        auto handle = RegisterCharacteristic(characteristic);
+        if (handle != 0)
+            clearError();
+        return handle;
     }
     catch (hresult_error const& ex)
     {
-        saveError(L"%s:%d SubscribeCharacteristicAsync catch: %s",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d ResolveCharacteristic catch: %ls",
                   __WFILE__, __LINE__, ex.message().c_str());
     }
+    catch (...)
+    {
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d ResolveCharacteristic catch: unknown exception.",
+                  __WFILE__, __LINE__);
+    }
+    return 0;
+}
 
-    if (completionFlag)
-        *completionFlag = succeeded;
-
-    subscribeQueueSignal.notify_one();
+// puts back a subscription whose CCCD write failed, unless it was subscribed again in the meantime
+void RestoreSubscription(unique_ptr<Subscription> target)
+{
+    std::lock_guard guard(subscribeQueueLock);
+    if (auto newer = subscriptions.Add(move(target)))
+        subscriptions.Add(move(newer));
 }
 
-bool SubscribeCharacteristic(wchar_t* deviceId,
-                             wchar_t* serviceId,
-                             wchar_t* characteristicId,
-                             bool /*block*/)
+// writes the CCCD back to None and releases a subscription that was already taken out of the registry; puts it back
+// if that fails
+bool RemoveSubscription(unique_ptr<Subscription> target)
 {
     try
     {
-        auto characteristic = retrieveCharacteristic(deviceId, serviceId, characteristicId).get();
-        if (characteristic == nullptr)
-        {
-            saveError(L"%s:%d Failed to resolve characteristic %s",
-                      __WFILE__, __LINE__, characteristicId);
-            return false;
-        }
-
-        auto status = characteristic
+        auto status = target->characteristic
             .WriteClientCharacteristicConfigurationDescriptorAsync(
-                GattClientCharacteristicConfigurationDescriptorValue::Notify)
+                GattClientCharacteristicConfigurationDescriptorValue::None)
             .get();
 
         if (status != GattCommunicationStatus::Success)
         {
-            saveError(L"%s:%d Error subscribing to characteristic %s (status %d)",
-                      __WFILE__, __LINE__, characteristicId, status);
+            saveError(ErrorCode::COMMUNICATION, L"%ls:%d UnsubscribeCharacteristic: CCCD write failed (status %d).",
+                      __WFILE__, __LINE__, static_cast<int>(status));
+            RestoreSubscription(move(target));
             return false;
         }
 
-        auto* subscription = new Subscription();
-        subscription->characteristic = characteristic;
-        subscription->revoker = characteristic.ValueChanged(auto_revoke, &Characteristic_ValueChanged);
-
-        {
-            std::lock_guard guard(subscribeQueueLock);
-            subscriptions.push_back(subscription);
-        }
-
+        target.reset();
         clearError();
         return true;
     }
-    catch (winrt::hresult_error const& ex)
+    catch (hresult_error const& ex)
     {
-        saveError(L"%s:%d SubscribeCharacteristic catch: %s",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d UnsubscribeCharacteristic catch: %ls",
                   __WFILE__, __LINE__, ex.message().c_str());
     }
     catch (...)
     {
-        saveError(L"%s:%d SubscribeCharacteristic catch: unknown exception.",
+        saveError(ErrorCode::EXCEPTION, L"%ls:%d UnsubscribeCharacteristic catch: unknown exception.",
                   __WFILE__, __LINE__);
     }
+
+    RestoreSubscription(move(target));
     return false;
 }
 
@@ -949,101 +1311,255 @@ bool UnsubscribeCharacteristic(wchar_t* deviceId,
                                wchar_t* serviceId,
                                wchar_t* characteristicId)
 {
-    Subscription* target = nullptr;
-    guid serviceGuid = make_guid(serviceId);
-    guid characteristicGuid = make_guid(characteristicId);
-
-    try
+    OperationScope operation;
+    CharacteristicId id{ 0, to_ble_guid(make_guid(serviceId)), to_ble_guid(make_guid(characteristicId)) };
+    unique_ptr<Subscription> target;
+    if (ResolveDeviceAddress(deviceId, id.address))
     {
-        {
-            std::lock_guard guard(subscribeQueueLock);
-
-            for (auto it = subscriptions.begin(); it != subscriptions.end(); ++it)
-            {
-                Subscription* sub = *it;
-                if (!sub || !sub->characteristic)
-                    continue;
-
-                auto svc = sub->characteristic.Service();
-                if (!svc)
-                    continue;
+        std::lock_guard guard(subscribeQueueLock);
+        target = subscriptions.Take(id);
+    }
+    if (!target)
+    {
+        saveError(ErrorCode::NOT_FOUND, L"%ls:%d UnsubscribeCharacteristic: subscription not found.",
+                  __WFILE__, __LINE__);
+        return false;
+    }
+    return RemoveSubscription(move(target));
+}
 
-                auto dev = svc.Device();
-                if (dev.DeviceId() != deviceId)
-                    continue;
+fire_and_forget ResolveWritePayloadAsync(uint64_t address, BluetoothDeviceId deviceId)
+{
+	try
+	{
+		auto session = co_await GattSession::FromDeviceIdAsync(deviceId);
+		if (session == nullptr || session.MaxPduSize() <= ATT_WRITE_HEADER)
+			co_return;
+		SetMaxWritePayload(address, session.MaxPduSize() - ATT_WRITE_HEADER);
+	}
+	catch (hresult_error const& ex)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d ResolveWritePayloadAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
+	}
+}
 
-                if (svc.Uuid() != serviceGuid)
-                    continue;
+// coroutines behind WinrtBackend::ResolveAsync and SubscribeAsync; they take their arguments by value as they
+// outlive the call
+fire_and_forget ResolveCharacteristicAsync(wstring deviceId, wstring serviceId, wstring characteristicId, ResolveDone done)
+{
+	uint32_t handle = 0;
+	try
+	{
+		auto characteristic = co_await retrieveCharacteristic(deviceId.data(), serviceId.data(), characteristicId.data());
+		if (characteristic == nullptr)
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d Failed to resolve characteristic %ls", __WFILE__, __LINE__, characteristicId.c_str());
+		else
+			handle = RegisterCharacteristic(characteristic);
+	}
+	catch (hresult_error const& ex)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d ResolveAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	catch (...)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d ResolveAsync catch: unknown exception.", __WFILE__, __LINE__);
+	}
+	done(handle);
+}
 
-                if (sub->characteristic.Uuid() != characteristicGuid)
-                    continue;
+fire_and_forget SubscribeCharacteristicAsync(GattCharacteristic characteristic, shared_ptr<NotificationSink> sink, SubscribeDone done)
+{
+	bool subscribed = false;
+	try
+	{
+		auto status = co_await characteristic.WriteClientCharacteristicConfigurationDescriptorAsync(
+			GattClientCharacteristicConfigurationDescriptorValue::Notify);
+		if (status != GattCommunicationStatus::Success)
+		{
+			wchar_t characteristicId[GuidCodec::FormattedCapacity];
+			format_guid(characteristic.Uuid(), characteristicId);
+			saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error subscribing to characteristic %ls (status %d)", __WFILE__, __LINE__, characteristicId, static_cast<int>(status));
+		}
+		else
+		{
+			AddSubscription(characteristic, sink);
+			subscribed = true;
+		}
+	}
+	catch (hresult_error const& ex)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d SubscribeAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	catch (...)
+	{
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d SubscribeAsync catch: unknown exception.", __WFILE__, __LINE__);
+	}
+	done(subscribed);
+}
 
-                target = sub;
-                subscriptions.erase(it);
-                break;
+// IBleBackend on top of the WinRT GATT client
+class WinrtBackend : public IBleBackend
+{
+public:
+    void Write(uint32_t handle, vector<uint8_t>&& data, WriteDone done) override
+    {
+        GattCharacteristic characteristic = nullptr;
+        uint64_t address = 0;
+        bool requestPayload = false;
+        {
+            lock_guard guard(resolvedLock);
+            if (auto* resolved = resolvedCharacteristics.Find(handle))
+            {
+                characteristic = resolved->characteristic;
+                address = resolved->address;
+                auto& requested = payloadRequested.Insert(address);
+                requestPayload = !requested;
+                requested = true;
             }
         }
-
-        if (!target)
+        if (characteristic == nullptr)
         {
-            saveError(L"%s:%d UnsubscribeCharacteristic: subscription not found.",
-                      __WFILE__, __LINE__);
-            return false;
+            done(WriteStatus::FAILED);
+            return;
         }
 
-        auto status = target->characteristic
-            .WriteClientCharacteristicConfigurationDescriptorAsync(
-                GattClientCharacteristicConfigurationDescriptorValue::None)
-            .get();
-
-        if (status != GattCommunicationStatus::Success)
+        try
         {
-            saveError(L"%s:%d UnsubscribeCharacteristic: CCCD write failed (status %d).",
-                      __WFILE__, __LINE__, static_cast<int>(status));
+            // the first write to a device asks for its MTU, so later coalesced writes can use all of it
+            if (requestPayload)
+                ResolveWritePayloadAsync(address, characteristic.Service().Device().BluetoothDeviceId());
+            DataWriter writer;
+            writer.WriteBytes(data);
+            auto operation = characteristic.WriteValueAsync(writer.DetachBuffer(), GattWriteOption::WriteWithoutResponse);
+            operation.Completed([handle, done](IAsyncOperation<GattCommunicationStatus> const& op, AsyncStatus status)
+            {
+                if (status != AsyncStatus::Completed)
+                {
+                    saveError(ErrorCode::COMMUNICATION, L"%ls:%d Write to handle %u did not complete (status %d).", __WFILE__, __LINE__, handle, static_cast<int>(status));
+                    done(WriteStatus::FAILED);
+                    return;
+                }
+                // WriteStatus mirrors GattCommunicationStatus
+                done(static_cast<WriteStatus>(op.GetResults()));
+            });
+        }
+        catch (hresult_error const& ex)
+        {
+            saveError(ErrorCode::EXCEPTION, L"%ls:%d Write catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
+            done(WriteStatus::FAILED);
+        }
+    }
 
-            std::lock_guard guard(subscribeQueueLock);
-            subscriptions.push_back(target);
+    bool Subscribe(uint32_t handle, shared_ptr<NotificationSink> const& sink) override
+    {
+        auto characteristic = LookupCharacteristic(handle);
+        if (characteristic == nullptr)
+        {
+            saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SubscribeByHandle: invalid handle %u.", __WFILE__, __LINE__, handle);
             return false;
         }
+        try
+        {
+            auto status = characteristic
+                .WriteClientCharacteristicConfigurationDescriptorAsync(
+                    GattClientCharacteristicConfigurationDescriptorValue::Notify)
+                .get();
 
-        target->revoker.revoke();
-        delete target;
+            if (status != GattCommunicationStatus::Success)
+            {
+                wchar_t characteristicId[GuidCodec::FormattedCapacity];
+                format_guid(characteristic.Uuid(), characteristicId);
+                saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error subscribing to characteristic %ls (status %d)",
+                          __WFILE__, __LINE__, characteristicId, static_cast<int>(status));
+                return false;
+            }
 
-        clearError();
-        return true;
+            AddSubscription(characteristic, sink);
+            clearError();
+            return true;
+        }
+        catch (hresult_error const& ex)
+        {
+            saveError(ErrorCode::EXCEPTION, L"%ls:%d SubscribeByHandle catch: %ls",
+                      __WFILE__, __LINE__, ex.message().c_str());
+        }
+        catch (...)
+        {
+            saveError(ErrorCode::EXCEPTION, L"%ls:%d SubscribeByHandle catch: unknown exception.",
+                      __WFILE__, __LINE__);
+        }
+        return false;
     }
-    catch (hresult_error const& ex)
+
+    void ResolveAsync(wstring deviceId, wstring serviceId, wstring characteristicId, ResolveDone done) override
     {
-        saveError(L"%s:%d UnsubscribeCharacteristic catch: %s",
-                  __WFILE__, __LINE__, ex.message().c_str());
+        ResolveCharacteristicAsync(move(deviceId), move(serviceId), move(characteristicId), move(done));
     }
-    catch (...)
+
+    void SubscribeAsync(uint32_t handle, shared_ptr<NotificationSink> const& sink, SubscribeDone done) override
     {
-        saveError(L"%s:%d UnsubscribeCharacteristic catch: unknown exception.",
-                  __WFILE__, __LINE__);
+        auto characteristic = LookupCharacteristic(handle);
+        if (characteristic == nullptr)
+        {
+            saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SubscribeByHandle: invalid handle %u.", __WFILE__, __LINE__, handle);
+            done(false);
+            return;
+        }
+        SubscribeCharacteristicAsync(characteristic, sink, move(done));
     }
 
-    if (target)
+    bool Unsubscribe(uint32_t handle) override
     {
-        std::lock_guard guard(subscribeQueueLock);
-        subscriptions.push_back(target);
+        unique_ptr<Subscription> target;
+        {
+            std::lock_guard guard(subscribeQueueLock);
+            target = subscriptions.TakeHandle(handle);
+        }
+
+        if (!target)
+        {
+            saveError(ErrorCode::NOT_FOUND, L"%ls:%d UnsubscribeByHandle: no subscription for handle %u.",
+                      __WFILE__, __LINE__, handle);
+            return false;
+        }
+        return RemoveSubscription(move(target));
     }
 
-    return false;
-}
+    bool HasSubscriptions() override
+    {
+        std::lock_guard guard(subscribeQueueLock);
+        return !subscriptions.Empty();
+    }
 
+    uint32_t ReadyEvents(uint32_t mask) override
+    {
+        uint32_t ready = 0;
+        if (mask & BLE_EVENT_DEVICE)
+        {
+            std::lock_guard guard(deviceQueueLock);
+            if (!deviceQueue.empty() || deviceScanFinishPending)
+                ready |= BLE_EVENT_DEVICE;
+        }
+        if (mask & BLE_EVENT_SERVICE)
+        {
+            std::lock_guard guard(serviceQueueLock);
+            if (!serviceQueue.empty() || serviceScanFinishPending)
+                ready |= BLE_EVENT_SERVICE;
+        }
+        if (mask & BLE_EVENT_CHARACTERISTIC)
+        {
+            std::lock_guard guard(characteristicQueueLock);
+            if (!characteristicQueue.empty() || characteristicScanFinishPending)
+                ready |= BLE_EVENT_CHARACTERISTIC;
+        }
+        return ready;
+    }
+};
 
-bool PollData(BLEData* data, bool block) {
-	unique_lock<mutex> lock(dataQueueLock);
-	if (block && dataQueue.empty())
-		if (QuittableWait(dataQueueSignal, lock))
-			return false;
-	if (!dataQueue.empty()) {
-		*data = dataQueue.front();
-		dataQueue.pop();
-		return true;
-	}
-	return false;
+IBleBackend& Backend()
+{
+    static WinrtBackend backend;
+    return backend;
 }
 
 fire_and_forget SendDataAsync(BLEData data, condition_variable* signal, bool* result) {
@@ -1054,21 +1570,26 @@ fire_and_forget SendDataAsync(BLEData data, condition_variable* signal, bool* re
 			DataWriter writer;
 			writer.WriteBytes(array_view<uint8_t const> (data.buf, data.buf + data.size));
 			IBuffer buffer = writer.DetachBuffer();
+			auto startNs = TimestampNs();
 			auto status = co_await characteristic.WriteValueAsync(buffer, GattWriteOption::WriteWithoutResponse);
+			uint64_t address;
+			auto counters = ResolveDeviceAddress(data.deviceId, address) ? CountersFor(address) : nullptr;
+			RecordWrite(counters.get(), 1, data.size, startNs, status == GattCommunicationStatus::Success);
 			if (status != GattCommunicationStatus::Success)
-				saveError(L"%s:%d Error writing value to characteristic with uuid %s", __WFILE__, __LINE__, data.characteristicUuid);
+				saveError(ErrorCode::COMMUNICATION, L"%ls:%d Error writing value to characteristic with uuid %ls", __WFILE__, __LINE__, data.characteristicUuid);
 			else if (result != 0)
 				*result = true;
 		}
 	}
 	catch (hresult_error& ex)
 	{
-		saveError(L"%s:%d SendDataAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+		saveError(ErrorCode::EXCEPTION, L"%ls:%d SendDataAsync catch: %ls", __WFILE__, __LINE__, ex.message().c_str());
 	}
 	if (signal != 0)
 		signal->notify_one();
 }
 bool SendData(BLEData* data, bool block) {
+	OperationScope operation;
 	mutex _mutex;
 	unique_lock<mutex> lock(_mutex);
 	condition_variable signal;
@@ -1083,61 +1604,64 @@ bool SendData(BLEData* data, bool block) {
 
 void Quit()
 {
-    {
-        lock_guard lock(quitLock);
-        quitFlag = true;
-    }
+    RequestQuit();
     StopDeviceScan();
+    StopAdvertisementScan();
     deviceQueueSignal.notify_one();
     {
         lock_guard lock(deviceQueueLock);
+        deviceQueueCounter.Dequeued(deviceQueue.size());
         deviceQueue = {};
     }
     serviceQueueSignal.notify_one();
     {
         lock_guard lock(serviceQueueLock);
+        serviceQueueCounter.Dequeued(serviceQueue.size());
         serviceQueue = {};
     }
     characteristicQueueSignal.notify_one();
     {
         lock_guard lock(characteristicQueueLock);
+        characteristicQueueCounter.Dequeued(characteristicQueue.size());
         characteristicQueue = {};
     }
     subscribeQueueSignal.notify_one();
+    // revoked after unlocking
+    vector<unique_ptr<Subscription>> taken;
     {
         lock_guard lock(subscribeQueueLock);
-        for (auto subscription : subscriptions)
-            subscription->revoker.revoke();
-        subscriptions = {};
+        taken = subscriptions.TakeAll();
     }
-    dataQueueSignal.notify_one();
+    taken.clear();
     {
-        lock_guard lock(dataQueueLock);
-        dataQueue = {};
+        lock_guard lock(resolvedLock);
+        resolvedCharacteristics.Clear();
+        payloadRequested.Clear();
     }
+    ShutdownCore();
+    vector<DeviceCacheEntry> devices;
+    vector<GattDeviceService> services;
     {
-        lock_guard lock(connectionQueueLock);
-        { queue<ConnectionUpdate> empty; std::swap(connectionQueue, empty); }
+        lock_guard lock(cacheLock);
+        deviceCache.ForEach([&devices](uint64_t, DeviceCacheEntry& device) { devices.push_back(move(device)); });
+        serviceCache.ForEach([&services](ServiceKey const&, ServiceCacheEntry& entry) { services.push_back(entry.service); });
+        characteristicCache.Clear();
+        serviceCache.Clear();
+        deviceCache.Clear();
+        deviceAddressAliases.clear();
     }
-    for (auto& device : cache)
+    for (auto& device : devices)
     {
-        if (device.second.statusSubscribed)
+        if (device.statusSubscribed)
         {
-            device.second.statusChangedRevoker.revoke();
-            device.second.statusSubscribed = false;
+            device.statusChangedRevoker.revoke();
+            device.servicesChangedRevoker.revoke();
+            device.statusSubscribed = false;
         }
-        EnqueueConnectionUpdate(device.second.device.DeviceId().c_str(),
+        EnqueueConnectionUpdate(device.device.DeviceId().c_str(),
                                 BluetoothConnectionStatus::Disconnected);
-        device.second.device.Close();
-        for (auto& service : device.second.services)
-        {
-            service.second.service.Close();
-        }
+        device.device.Close();
     }
-    cache.clear();
-}
-
-void GetError(ErrorMessage* buf) {
-	lock_guard error_lock(errorLock);
-	wcscpy_s(buf->msg, last_error);
+    for (auto& service : services)
+        service.Close();
 }
@@ -4,53 +4,192 @@
 
 extern "C" {
 	// Enumerate available radios. Pass nullptr/0 to query required count; returns total Bluetooth radio count.
-	__declspec(dllexport) uint32_t GetRadios(RadioInfo* radios, uint32_t capacity);
+	BLE_API uint32_t GetRadios(RadioInfo* radios, uint32_t capacity);
 
 	// Return true if at least one Bluetooth radio is present and currently on. Logs diagnostics either way.
-	__declspec(dllexport) bool IsBluetoothAvailable();
+	BLE_API bool IsBluetoothAvailable();
 
 	// Begin device discovery. seconds == 0 keeps scanning until StopDeviceScan or Quit is called.
-	__declspec(dllexport) void StartDeviceScan(uint32_t seconds);
+	BLE_API void StartDeviceScan(uint32_t seconds);
 
 	// Stop an active device scan and release watcher resources.
-	__declspec(dllexport) void StopDeviceScan();
+	BLE_API void StopDeviceScan();
 
-	__declspec(dllexport) ScanStatus PollDevice(DeviceUpdate* device, bool block);
+	BLE_API ScanStatus PollDevice(DeviceUpdate* device, bool block);
+
+	// Scan results merged per device address; PollDevice keeps reporting every raw update. Copies the records that
+	// changed after sinceGeneration (0 for all) in generation order, at most capacity of them, and returns how many
+	// were copied. Pass nullptr/0 to query the count. To page or poll for changes, continue with the generation of
+	// the last record returned.
+	BLE_API uint32_t GetDeviceSnapshot(DeviceRecord* buffer, uint32_t capacity, uint64_t sinceGeneration);
+
+	// Continuous advertisement scan, independent of StartDeviceScan. Every advertisement and scan response is parsed
+	// into an AdvertisementRecord; active scanning requests scan responses from the advertisers. Runs until
+	// StopAdvertisementScan or Quit.
+	BLE_API bool StartAdvertisementScan(bool active);
+
+	BLE_API void StopAdvertisementScan();
+
+	// Moves up to capacity received advertisements into buffer, oldest first, and returns how many were written.
+	// Waits up to timeoutMs for the first one, 0 returns immediately. When the queue is full the oldest
+	// advertisements are dropped, see BleStats::advertisementsDropped.
+	BLE_API uint32_t PollAdvertisements(AdvertisementRecord* buffer, uint32_t capacity, uint32_t timeoutMs);
+
+	// Replaces the scan filter, which decides natively what PollDevice and PollAdvertisements report. Each device update
+	// and advertisement takes the action of the first rule whose criteria all match, or unmatched if none does. The
+	// device watcher only reports address and name, so rules with service, manufacturer or RSSI criteria only match
+	// advertisements. Takes effect when the next scan starts; count 0 with ACCEPT removes the filter.
+	BLE_API bool SetScanFilter(ScanFilterRule* rules, uint32_t count, ScanFilterAction unmatched);
+
+	// Counters of the filter in effect, reset when a changed filter is compiled. Copies up to capacity per rule hit
+	// counts into ruleHits, which may be nullptr, and returns the number of rules.
+	BLE_API uint32_t GetScanFilterStats(ScanFilterStats* stats, uint64_t* ruleHits, uint32_t capacity);
 
     // Connect/disconnect against a WinRT device ID.
-    __declspec(dllexport) bool ConnectDevice(wchar_t* deviceId, bool block);
+    BLE_API bool ConnectDevice(wchar_t* deviceId, bool block);
+
+    BLE_API bool PollConnection(ConnectionUpdate* update, bool block);
+
+    BLE_API bool DisconnectDevice(wchar_t* deviceId);
+
+
+	BLE_API void ScanServices(wchar_t* deviceId);
+
+	BLE_API ScanStatus PollService(Service* service, bool block);
+
+	BLE_API void ScanCharacteristics(wchar_t* deviceId, wchar_t* serviceId);
+
+	BLE_API ScanStatus PollCharacteristic(Characteristic* characteristic, bool block);
+
+	// Whether ScanCharacteristics reads user descriptions and how many of those reads it runs at once. With more than
+	// one, characteristics are reported as their reads complete rather than in service order. Takes effect for the
+	// next scan.
+	BLE_API bool SetDiscoveryOptions(DiscoveryOptions* options);
+
+	// Persists discovered services, characteristics and descriptors per device address in the file at options->path
+	// and answers later ScanServices and ScanCharacteristics from it without going over the air; a device id that
+	// doesn't end in the address is resolved through the device first. Loads the file if it exists; an unreadable one
+	// is replaced. A services changed event of a connected device drops its layout. Changes
+	// are written in the background about once a second, and on Quit.
+	BLE_API bool SetGattCacheOptions(GattCacheOptions* options);
+
+	// Drops the stored layout of a device, or of all devices for nullptr.
+	BLE_API bool InvalidateGattCache(wchar_t* deviceId);
+
+	BLE_API void GetGattCacheStats(GattCacheStats* stats);
+
+
+
+
+
+
+	BLE_API bool SubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, bool block);
+
+    BLE_API bool UnsubscribeCharacteristic(wchar_t* deviceId,
+                                           wchar_t* serviceId,
+                                           wchar_t* characteristicId);
+
+	BLE_API bool PollData(BLEData* data, bool block);
+
+	// Handle based data path. Returns a subscription handle, 0 on failure. Subscribing the same characteristic again
+	// returns the same handle. Handles are invalidated by DisconnectDevice and Quit, see ResolveCharacteristic.
+	BLE_API uint32_t SubscribeCharacteristicV2(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
+
+	// Current time of the monotonic clock used for BLEDataV2 and LatestValue timestamps, in nanoseconds.
+	BLE_API uint64_t GetTimestampNs();
+
+	// Every queued subscription has its own queue. PollData, PollDataV2 and PollDataBatch take from all of them in
+	// turn, so notifications of one subscription arrive in order, but not necessarily interleaved by arrival time
+	// with other subscriptions; compare receivedNs for that.
+	BLE_API bool PollDataV2(BLEDataV2* data, bool block);
+
+	// Moves up to capacity queued notifications into buffer and returns how many were written. Waits up to timeoutMs
+	// for the first notification if the queues are empty, 0 returns immediately.
+	BLE_API uint32_t PollDataBatch(BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs);
+
+	// Like PollDataBatch, but only takes notifications of one queued subscription, or of all queued subscriptions of
+	// one device. Everything else stays queued for the other polls.
+	BLE_API uint32_t PollDataFor(uint32_t handle, BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs);
+
+	BLE_API uint32_t PollDataForDevice(wchar_t* deviceId, BLEDataV2* buffer, uint32_t capacity, uint32_t timeoutMs);
+
+	// Conflating subscription: notifications overwrite a per-characteristic slot instead of being queued. Returns the
+	// subscription handle, 0 on failure.
+	BLE_API uint32_t SubscribeCharacteristicLatest(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
+
+	// Copy the newest value of a conflating subscription. Returns false if the handle is unknown or nothing was received
+	// yet. Never blocks the notification callback. Safe to call from several threads for the same handle; an update
+	// that was overwritten unread is counted in value->dropped of one of them.
+	BLE_API bool ReadLatest(uint32_t handle, LatestValue* value);
+
+	// Configure capacity and overflow policy of the data queues; the capacity applies to each subscription's queue. A capacity change is only accepted while nothing is
+	// subscribed and no thread is polling data; the policy can be changed at any time.
+	BLE_API bool SetDataQueueOptions(DataQueueOptions* options);
+
+	BLE_API void GetDataQueueStats(DataQueueStats* stats);
 
-    __declspec(dllexport) bool PollConnection(ConnectionUpdate* update, bool block);
+	BLE_API bool GetSubscriptionInfo(uint32_t handle, SubscriptionInfo* info);
 
-    __declspec(dllexport) bool DisconnectDevice(wchar_t* deviceId);
+	// Snapshot of the runtime counters. Set stats->size to sizeof(BleStats) before calling; returns false if it is 0.
+	BLE_API bool GetStats(BleStats* stats);
 
+	// Pass nullptr/0 to query the required count; returns the number of devices that have counters.
+	BLE_API uint32_t GetDeviceStats(DeviceStats* devices, uint32_t capacity);
 
-	__declspec(dllexport) void ScanServices(wchar_t* deviceId);
+	BLE_API bool SendData(BLEData* data, bool block);
 
-	__declspec(dllexport) ScanStatus PollService(Service* service, bool block);
+	// Resolve a characteristic once and return a handle for SendDataByHandle, SubscribeByHandle and
+	// UnsubscribeByHandle, 0 on failure. The handle is the same one the data path reports for the characteristic.
+	// DisconnectDevice and Quit invalidate it; resolve again after reconnecting.
+	BLE_API uint32_t ResolveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
 
-	__declspec(dllexport) void ScanCharacteristics(wchar_t* deviceId, wchar_t* serviceId);
+	// Write without response. In non-blocking mode a failure is only reported through GetError.
+	BLE_API bool SendDataByHandle(uint32_t handle, uint8_t* data, uint16_t size, bool block);
 
-	__declspec(dllexport) ScanStatus PollCharacteristic(Characteristic* characteristic, bool block);
+	BLE_API bool SubscribeByHandle(uint32_t handle, SubscriptionMode mode);
 
+	BLE_API bool UnsubscribeByHandle(uint32_t handle);
 
+	// Resolves and subscribes all entries concurrently instead of one round trip after the other, and blocks until
+	// every entry finished. Writes one result per entry and the time until the last one was ready to readyNs; returns
+	// true if every entry was subscribed.
+	BLE_API bool ConnectWithPlan(wchar_t* deviceId, PlanEntry* entries, uint32_t count, PlanEntryResult* results, uint64_t* readyNs);
 
+	// Pipelined writes without response. Writes to one characteristic are sent in queue order with up to
+	// WriteOptions::maxInFlight outstanding. Returns a write id reported back by PollWriteCompletion, 0 if the handle
+	// is invalid or the characteristic's queue is full.
+	BLE_API uint32_t QueueWrite(uint32_t handle, uint8_t* data, uint16_t size);
 
+	// Completions are kept in order until polled, up to 4096 of them; beyond that the oldest are
+	// dropped, see BleStats::writeCompletionsDropped.
+	BLE_API bool PollWriteCompletion(WriteCompletion* completion, bool block);
 
+	// Takes effect for writes that have not been sent yet.
+	BLE_API bool SetWriteOptions(WriteOptions* options);
 
-	__declspec(dllexport) bool SubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, bool block);
+	// Sleeps until one of the sources in mask (BleEvent bits) has something to poll, or timeoutMs passed, and returns
+	// the ready sources; 0 on timeout or Quit. A finished scan counts as ready until its FINISHED was polled. With
+	// spinUs > 0 the call first spins that long before it parks, for consumers that can't afford a wakeup.
+	BLE_API uint32_t WaitEvents(uint32_t mask, uint32_t timeoutMs, uint32_t spinUs);
 
-    __declspec(dllexport) bool UnsubscribeCharacteristic(wchar_t* deviceId,
-                                                         wchar_t* serviceId,
-                                                         wchar_t* characteristicId);
+	BLE_API void Quit();
 
-	__declspec(dllexport) bool PollData(BLEData* data, bool block);
+	// The message of the newest error, "Ok" if a call succeeded since.
+	BLE_API void GetError(ErrorMessage* buf);
 
-	__declspec(dllexport) bool SendData(BLEData* data, bool block);
+	// Copies up to capacity of the most recent errors (at most ERROR_JOURNAL_SIZE), oldest first, and returns their
+	// number. Unlike GetError, errors raised at once don't hide each other.
+	BLE_API uint32_t GetErrors(ErrorEntry* buffer, uint32_t capacity);
 
-	__declspec(dllexport) void Quit();
+	// Errors and log records are written to the console, or passed to a sink if one is set, in batches from a
+	// background thread; the thread that logs doesn't wait for the output. A batch sink gets up to LOG_BATCH_SIZE
+	// records per call and takes precedence over the line sink. Records and pointers are only valid during the call.
+	BLE_API void SetLogSink(BleLogSinkFn sink);
+	BLE_API void SetLogBatchSink(BleLogBatchSinkFn sink);
 
-	__declspec(dllexport) void GetError(ErrorMessage* buf);
+	// Only records at level or above in one of categories (BleLogCategory bits) are formatted, LogLevel::OFF mutes
+	// everything. Defaults to LogLevel::INFO and BLE_LOG_ALL.
+	BLE_API bool SetLogFilter(LogLevel level, uint32_t categories);
 
-	__declspec(dllexport) void SetLogSink(BleLogSinkFn sink);
+	BLE_API void GetLogStats(LogStats* stats);
 }
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "BleTypes.h"
+
+// Fixed size history of the most recent errors. Every entry gets the next sequence number and goes to slot sequence %
+// capacity, overwriting the entry a full lap older. Slots are guarded like LatestSlot: the stamp is odd while a writer
+// fills the slot, and twice the entry's sequence once it is complete, so readers copy without blocking anybody and
+// retry or skip torn slots. A writer only waits for another writer on the same slot, which takes a full lap of errors
+// raised at once.
+class ErrorJournal
+{
+public:
+    // capacity is rounded up to the next power of two
+    explicit ErrorJournal(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        slots.reset(new Slot[size]);
+    }
+
+    ErrorJournal(ErrorJournal const&) = delete;
+    ErrorJournal& operator=(ErrorJournal const&) = delete;
+
+    size_t Capacity() const { return mask + 1; }
+
+    // assigns entry.sequence and stores it; returns the sequence
+    uint64_t Append(ErrorEntry& entry)
+    {
+        uint64_t sequence = next.fetch_add(1, std::memory_order_relaxed) + 1;
+        entry.sequence = sequence;
+        auto& slot = slots[sequence & mask];
+        uint64_t stamp = slot.stamp.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            // a newer entry already took the slot, this one counts as overwritten
+            if (!(stamp & 1) && stamp >= sequence * 2)
+                return sequence;
+            if ((stamp & 1) || !slot.stamp.compare_exchange_weak(stamp, sequence * 2 + 1, std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+                stamp = slot.stamp.load(std::memory_order_relaxed);
+                continue;
+            }
+            break;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.entry = entry;
+        slot.stamp.store(sequence * 2, std::memory_order_release);
+        return sequence;
+    }
+
+    // sequence of the newest entry, 0 if there was none
+    uint64_t Last() const { return next.load(std::memory_order_acquire); }
+
+    // copies the entry with sequence into out; false if it was overwritten or is still being written
+    bool Read(uint64_t sequence, ErrorEntry& out) const
+    {
+        auto const& slot = slots[sequence & mask];
+        if (slot.stamp.load(std::memory_order_acquire) != sequence * 2)
+            return false;
+        out = slot.entry;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.stamp.load(std::memory_order_relaxed) == sequence * 2;
+    }
+
+    // copies up to capacity of the newest entries, oldest first, and returns their number
+    uint32_t Recent(ErrorEntry* buffer, uint32_t capacity) const
+    {
+        uint64_t last = Last();
+        uint64_t span = capacity < Capacity() ? capacity : Capacity();
+        uint64_t first = last > span ? last - span + 1 : 1;
+        uint32_t count = 0;
+        for (uint64_t sequence = first; sequence <= last && count < capacity; sequence++)
+            if (Read(sequence, buffer[count]))
+                count++;
+        return count;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> stamp{ 0 };
+        ErrorEntry entry;
+    };
+
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> next{ 0 };
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Hash over the object representation of a plain key struct. Keys must not contain padding, otherwise equal keys may
+// hash differently.
+template <typename Key>
+struct FlatKeyHash
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "FlatKeyHash needs a trivially copyable key");
+
+    uint64_t operator()(Key const& key) const
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&key);
+        uint64_t hash = 0x9E3779B97F4A7C15ull ^ sizeof(Key);
+        size_t i = 0;
+        for (; i + 8 <= sizeof(Key); i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i, 8);
+            hash = Mix(hash ^ word);
+        }
+        if (i < sizeof(Key))
+        {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, sizeof(Key) - i);
+            hash = Mix(hash ^ word);
+        }
+        return hash;
+    }
+
+    // murmur3 finalizer
+    static uint64_t Mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+// Open addressing hash table with linear probing, used for the GATT object cache. Lookups compare the full key, so
+// different keys never alias each other. Not thread-safe, callers lock around it.
+// Value must be default constructible; erased slots are reset to a default value so that WinRT references are released.
+template <typename Key, typename Value, typename Hash = FlatKeyHash<Key>>
+class FlatTable
+{
+public:
+    explicit FlatTable(size_t initialCapacity = 16)
+    {
+        size_t capacity = 8;
+        while (capacity < initialCapacity)
+            capacity <<= 1;
+        slots.resize(capacity);
+    }
+
+    size_t Size() const { return count; }
+
+    Value* Find(Key const& key)
+    {
+        size_t index = Probe(key);
+        return slots[index].state == Full ? &slots[index].value : nullptr;
+    }
+
+    // returns the value for key, default constructing it if the key was missing
+    Value& Insert(Key const& key)
+    {
+        size_t index = Probe(key);
+        if (slots[index].state == Full)
+            return slots[index].value;
+
+        if ((count + tombstones + 1) * 10 > slots.size() * 7)
+        {
+            Rehash(count * 2 + 2 > slots.size() / 2 ? slots.size() * 2 : slots.size());
+            index = Probe(key);
+        }
+        // reuse the first tombstone on the probe sequence if there is one
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash()(key) & mask;; i = (i + 1) & mask)
+        {
+            if (slots[i].state == Tombstone)
+            {
+                tombstones--;
+                index = i;
+                break;
+            }
+            if (i == index)
+                break;
+        }
+        Slot& slot = slots[index];
+        slot.state = Full;
+        slot.key = key;
+        slot.value = Value{};
+        count++;
+        return slot.value;
+    }
+
+    bool Erase(Key const& key)
+    {
+        size_t index = Probe(key);
+        if (slots[index].state != Full)
+            return false;
+        Release(slots[index]);
+        return true;
+    }
+
+    // calls predicate(key, value) for every entry and erases the entries for which it returns true
+    template <typename Predicate>
+    void EraseIf(Predicate predicate)
+    {
+        for (auto& slot : slots)
+            if (slot.state == Full && predicate(const_cast<Key const&>(slot.key), slot.value))
+                Release(slot);
+    }
+
+    template <typename Function>
+    void ForEach(Function function)
+    {
+        for (auto& slot : slots)
+            if (slot.state == Full)
+                function(const_cast<Key const&>(slot.key), slot.value);
+    }
+
+    void Clear()
+    {
+        for (auto& slot : slots)
+        {
+            slot.state = Empty;
+            slot.value = Value{};
+        }
+        count = 0;
+        tombstones = 0;
+    }
+
+private:
+    enum State : uint8_t { Empty, Full, Tombstone };
+
+    struct Slot
+    {
+        State state = Empty;
+        Key key{};
+        Value value{};
+    };
+
+    // index of the slot holding key, or of the empty slot that terminates its probe sequence
+    size_t Probe(Key const& key) const
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash()(key) & mask;; i = (i + 1) & mask)
+        {
+            auto const& slot = slots[i];
+            if (slot.state == Empty || (slot.state == Full && slot.key == key))
+                return i;
+        }
+    }
+
+    void Release(Slot& slot)
+    {
+        slot.state = Tombstone;
+        slot.value = Value{};
+        count--;
+        tombstones++;
+    }
+
+    void Rehash(size_t capacity)
+    {
+        std::vector<Slot> old(capacity);
+        old.swap(slots);
+        count = 0;
+        tombstones = 0;
+        for (auto& slot : old)
+        {
+            if (slot.state != Full)
+                continue;
+            Slot& target = slots[Probe(slot.key)];
+            target.state = Full;
+            target.key = slot.key;
+            target.value = std::move(slot.value);
+            count++;
+        }
+    }
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+    size_t tombstones = 0;
+};
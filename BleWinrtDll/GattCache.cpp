@@ -0,0 +1,522 @@
+// GattCache.cpp : persistent GATT database, see SetGattCacheOptions.
+
+#include "BleCore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+
+#include "BackgroundWorker.h"
+#include "BleWinrtDll.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+using namespace std;
+
+#define __WFILE__ L"GattCache.cpp"
+
+// The file is a header followed by flat arrays of fixed size little endian records that refer to each other by index,
+// so it can be used in place, e.g. mapped: devices sorted by address, then services, characteristics, descriptor UUIDs
+// and the UTF-16 code units of the user descriptions. Every record is a multiple of 8 bytes. Any change to the records
+// bumps GATT_FILE_VERSION; files of other versions are ignored and rewritten.
+namespace
+{
+	constexpr char GATT_FILE_MAGIC[8] = { 'B', 'L', 'E', 'G', 'A', 'T', 'T', '\0' };
+	constexpr uint32_t GATT_FILE_VERSION = 1;
+
+	// FileService::flags
+	constexpr uint32_t CHARACTERISTICS_KNOWN = 1 << 0;
+	constexpr uint32_t DESCRIPTIONS_KNOWN = 1 << 1;
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t deviceCount;
+		uint32_t serviceCount;
+		uint32_t characteristicCount;
+		uint32_t descriptorCount;
+		uint32_t stringUnits;
+		uint32_t checksum;  // FNV-1a of everything after the header
+	};
+	struct FileDevice {
+		uint64_t address;
+		uint32_t firstService;
+		uint32_t serviceCount;
+	};
+	struct FileService {
+		BleGuid uuid;
+		uint32_t firstCharacteristic;
+		uint32_t characteristicCount;
+		uint32_t flags;
+		uint32_t reserved;
+	};
+	struct FileCharacteristic {
+		BleGuid uuid;
+		uint32_t properties;
+		uint32_t firstDescriptor;
+		uint32_t descriptorCount;
+		uint32_t descriptionOffset;
+		uint32_t descriptionLength;
+		uint32_t reserved;
+	};
+	static_assert(sizeof(FileHeader) % 8 == 0 && sizeof(FileDevice) % 8 == 0 && sizeof(FileService) % 8 == 0
+		&& sizeof(FileCharacteristic) % 8 == 0 && sizeof(BleGuid) % 8 == 0, "records must keep 8 byte alignment");
+
+	uint32_t Fnv1a(const uint8_t* data, size_t size)
+	{
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < size; i++)
+			hash = (hash ^ data[i]) * 16777619u;
+		return hash;
+	}
+
+	void AppendUtf16(vector<uint16_t>& out, wstring const& text)
+	{
+		for (wchar_t c : text) {
+			uint32_t code = static_cast<uint32_t>(c);
+			if (code >= 0x10000 && code <= 0x10FFFF) {
+				code -= 0x10000;
+				out.push_back(static_cast<uint16_t>(0xD800 + (code >> 10)));
+				out.push_back(static_cast<uint16_t>(0xDC00 + (code & 0x3FF)));
+			}
+			else
+				out.push_back(static_cast<uint16_t>(code));
+		}
+	}
+
+	wstring FromUtf16(const uint16_t* units, size_t count)
+	{
+		wstring out;
+		for (size_t i = 0; i < count; i++) {
+			uint32_t code = units[i];
+			if (sizeof(wchar_t) == 4 && code >= 0xD800 && code < 0xDC00 && i + 1 < count
+				&& units[i + 1] >= 0xDC00 && units[i + 1] < 0xE000) {
+				code = 0x10000 + ((code - 0xD800) << 10) + (units[i + 1] - 0xDC00u);
+				i++;
+			}
+			out += static_cast<wchar_t>(code);
+		}
+		return out;
+	}
+
+	template <typename T>
+	void Append(vector<uint8_t>& out, T const* records, size_t count)
+	{
+		auto bytes = reinterpret_cast<const uint8_t*>(records);
+		out.insert(out.end(), bytes, bytes + count * sizeof(T));
+	}
+
+	FILE* OpenGattFile(wstring const& path, bool write)
+	{
+#ifdef _WIN32
+		FILE* file = nullptr;
+		_wfopen_s(&file, path.c_str(), write ? L"wb" : L"rb");
+		return file;
+#else
+		// narrow with the current locale, file names outside of it are not supported here
+		string narrow(path.size() * MB_LEN_MAX + 1, '\0');
+		size_t length = wcstombs(&narrow[0], path.c_str(), narrow.size());
+		if (length == static_cast<size_t>(-1))
+			return nullptr;
+		narrow.resize(length);
+		return fopen(narrow.c_str(), write ? "wb" : "rb");
+#endif
+	}
+
+	bool MoveOverFile(wstring const& from, wstring const& to)
+	{
+#ifdef _WIN32
+		return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		string narrowFrom(from.size() * MB_LEN_MAX + 1, '\0');
+		string narrowTo(to.size() * MB_LEN_MAX + 1, '\0');
+		size_t fromLength = wcstombs(&narrowFrom[0], from.c_str(), narrowFrom.size());
+		size_t toLength = wcstombs(&narrowTo[0], to.c_str(), narrowTo.size());
+		if (fromLength == static_cast<size_t>(-1) || toLength == static_cast<size_t>(-1))
+			return false;
+		narrowFrom.resize(fromLength);
+		narrowTo.resize(toLength);
+		return rename(narrowFrom.c_str(), narrowTo.c_str()) == 0;
+#endif
+	}
+}
+
+// guarded by gattCacheLock
+using GattDeviceLayout = vector<GattServiceLayout>;
+map<uint64_t, GattDeviceLayout> gattLayouts;
+GattCacheOptions gattCacheOptions{};
+bool gattCacheEnabled = false;
+set<uint64_t> gattRevalidated;
+GattCacheStats gattCacheStats{};
+mutex gattCacheLock;
+// Stores only mark the database dirty; the flusher writes it at most once per GATT_FLUSH_PERIOD, so that a scan that
+// stores every service and characteristic costs one write, and lookups never wait for the disk.
+constexpr chrono::milliseconds GATT_FLUSH_PERIOD{ 1000 };
+atomic<bool> gattDirty{ false };
+// serializes the writes, taken before gattCacheLock
+mutex gattWriteLock;
+
+// expects gattCacheLock to be held
+bool LoadGattFile(wstring const& path)
+{
+	FILE* file = OpenGattFile(path, false);
+	if (file == nullptr)
+		return false;
+	vector<uint8_t> bytes;
+	uint8_t chunk[4096];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		bytes.insert(bytes.end(), chunk, chunk + read);
+	fclose(file);
+
+	FileHeader header;
+	if (bytes.size() < sizeof(header))
+		return false;
+	memcpy(&header, bytes.data(), sizeof(header));
+	if (memcmp(header.magic, GATT_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != GATT_FILE_VERSION
+		|| header.headerSize != sizeof(FileHeader))
+		return false;
+	uint64_t expected = sizeof(FileHeader) + uint64_t(header.deviceCount) * sizeof(FileDevice)
+		+ uint64_t(header.serviceCount) * sizeof(FileService)
+		+ uint64_t(header.characteristicCount) * sizeof(FileCharacteristic)
+		+ uint64_t(header.descriptorCount) * sizeof(BleGuid) + uint64_t(header.stringUnits) * sizeof(uint16_t);
+	if (bytes.size() != expected || Fnv1a(bytes.data() + sizeof(FileHeader), bytes.size() - sizeof(FileHeader)) != header.checksum)
+		return false;
+
+	// copy out of the buffer, as the sections after the first aren't guaranteed to be aligned in a vector
+	size_t offset = sizeof(FileHeader);
+	auto section = [&](auto& records, uint32_t count) {
+		records.resize(count);
+		memcpy(records.data(), bytes.data() + offset, count * sizeof(records[0]));
+		offset += count * sizeof(records[0]);
+	};
+	vector<FileDevice> devices;
+	vector<FileService> services;
+	vector<FileCharacteristic> characteristics;
+	vector<BleGuid> descriptors;
+	vector<uint16_t> strings;
+	section(devices, header.deviceCount);
+	section(services, header.serviceCount);
+	section(characteristics, header.characteristicCount);
+	section(descriptors, header.descriptorCount);
+	section(strings, header.stringUnits);
+
+	map<uint64_t, GattDeviceLayout> layouts;
+	for (auto const& device : devices) {
+		if (uint64_t(device.firstService) + device.serviceCount > services.size())
+			return false;
+		auto& layout = layouts[device.address];
+		for (uint32_t s = device.firstService; s < device.firstService + device.serviceCount; s++) {
+			auto const& service = services[s];
+			if (uint64_t(service.firstCharacteristic) + service.characteristicCount > characteristics.size())
+				return false;
+			GattServiceLayout serviceLayout;
+			serviceLayout.uuid = service.uuid;
+			serviceLayout.characteristicsKnown = (service.flags & CHARACTERISTICS_KNOWN) != 0;
+			serviceLayout.descriptionsKnown = (service.flags & DESCRIPTIONS_KNOWN) != 0;
+			for (uint32_t c = service.firstCharacteristic; c < service.firstCharacteristic + service.characteristicCount; c++) {
+				auto const& characteristic = characteristics[c];
+				if (uint64_t(characteristic.firstDescriptor) + characteristic.descriptorCount > descriptors.size()
+					|| uint64_t(characteristic.descriptionOffset) + characteristic.descriptionLength > strings.size())
+					return false;
+				GattCharacteristicLayout characteristicLayout;
+				characteristicLayout.uuid = characteristic.uuid;
+				characteristicLayout.properties = characteristic.properties;
+				characteristicLayout.userDescription = FromUtf16(strings.data() + characteristic.descriptionOffset,
+					characteristic.descriptionLength);
+				characteristicLayout.descriptors.assign(descriptors.begin() + characteristic.firstDescriptor,
+					descriptors.begin() + characteristic.firstDescriptor + characteristic.descriptorCount);
+				serviceLayout.characteristics.push_back(move(characteristicLayout));
+			}
+			layout.push_back(move(serviceLayout));
+		}
+	}
+	gattLayouts.swap(layouts);
+	return true;
+}
+
+// the whole database in the file format; expects gattCacheLock to be held
+vector<uint8_t> SerializeGattLayouts()
+{
+	vector<FileDevice> devices;
+	vector<FileService> services;
+	vector<FileCharacteristic> characteristics;
+	vector<BleGuid> descriptors;
+	vector<uint16_t> strings;
+	for (auto const& [address, layout] : gattLayouts) {
+		devices.push_back(FileDevice{ address, static_cast<uint32_t>(services.size()), static_cast<uint32_t>(layout.size()) });
+		for (auto const& service : layout) {
+			FileService record{};
+			record.uuid = service.uuid;
+			record.firstCharacteristic = static_cast<uint32_t>(characteristics.size());
+			record.characteristicCount = static_cast<uint32_t>(service.characteristics.size());
+			record.flags = (service.characteristicsKnown ? CHARACTERISTICS_KNOWN : 0)
+				| (service.descriptionsKnown ? DESCRIPTIONS_KNOWN : 0);
+			services.push_back(record);
+			for (auto const& characteristic : service.characteristics) {
+				FileCharacteristic entry{};
+				entry.uuid = characteristic.uuid;
+				entry.properties = characteristic.properties;
+				entry.firstDescriptor = static_cast<uint32_t>(descriptors.size());
+				entry.descriptorCount = static_cast<uint32_t>(characteristic.descriptors.size());
+				entry.descriptionOffset = static_cast<uint32_t>(strings.size());
+				AppendUtf16(strings, characteristic.userDescription);
+				entry.descriptionLength = static_cast<uint32_t>(strings.size()) - entry.descriptionOffset;
+				descriptors.insert(descriptors.end(), characteristic.descriptors.begin(), characteristic.descriptors.end());
+				characteristics.push_back(entry);
+			}
+		}
+	}
+
+	FileHeader header{};
+	memcpy(header.magic, GATT_FILE_MAGIC, sizeof(header.magic));
+	header.version = GATT_FILE_VERSION;
+	header.headerSize = sizeof(FileHeader);
+	header.deviceCount = static_cast<uint32_t>(devices.size());
+	header.serviceCount = static_cast<uint32_t>(services.size());
+	header.characteristicCount = static_cast<uint32_t>(characteristics.size());
+	header.descriptorCount = static_cast<uint32_t>(descriptors.size());
+	header.stringUnits = static_cast<uint32_t>(strings.size());
+	vector<uint8_t> bytes;
+	Append(bytes, &header, 1);
+	Append(bytes, devices.data(), devices.size());
+	Append(bytes, services.data(), services.size());
+	Append(bytes, characteristics.data(), characteristics.size());
+	Append(bytes, descriptors.data(), descriptors.size());
+	Append(bytes, strings.data(), strings.size());
+	header.checksum = Fnv1a(bytes.data() + sizeof(FileHeader), bytes.size() - sizeof(FileHeader));
+	memcpy(bytes.data(), &header, sizeof(header));
+	return bytes;
+}
+
+// Writes next to the file and moves it over, so that a crash leaves either version intact. Expects gattWriteLock to be
+// held, but not gattCacheLock.
+void WriteGattFile(wstring const& path, vector<uint8_t> const& bytes)
+{
+	wstring temporary = path + L".tmp";
+	FILE* file = OpenGattFile(temporary, true);
+	bool written = file != nullptr && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	if (file != nullptr)
+		written = fclose(file) == 0 && written;
+	if (!written || !MoveOverFile(temporary, path))
+		saveError(L"%ls:%d Writing the GATT cache %ls failed.", __WFILE__, __LINE__, path.c_str());
+}
+
+void FlushGattCache()
+{
+	lock_guard writeGuard(gattWriteLock);
+	vector<uint8_t> bytes;
+	wstring path;
+	{
+		lock_guard guard(gattCacheLock);
+		if (!gattDirty.exchange(false) || !gattCacheEnabled)
+			return;
+		bytes = SerializeGattLayouts();
+		path = gattCacheOptions.path;
+	}
+	WriteGattFile(path, bytes);
+}
+
+BackgroundWorker gattFlusher([] { return gattDirty.load(); }, FlushGattCache, GATT_FLUSH_PERIOD);
+
+// expects gattCacheLock to be held
+void MarkGattDirty()
+{
+	gattDirty.store(true);
+	gattFlusher.Start();
+}
+
+void StopGattFlusher()
+{
+	gattFlusher.Stop();
+}
+
+bool SetGattCacheOptions(GattCacheOptions* options)
+{
+	// what is pending belongs to the file of the old options
+	FlushGattCache();
+	lock_guard guard(gattCacheLock);
+	gattDirty.store(false);
+	gattCacheOptions = *options;
+	gattCacheOptions.path[sizeof(gattCacheOptions.path) / sizeof(gattCacheOptions.path[0]) - 1] = L'\0';
+	gattCacheEnabled = gattCacheOptions.path[0] != L'\0';
+	gattLayouts.clear();
+	gattRevalidated.clear();
+	// a missing, foreign or damaged file just starts an empty database
+	if (gattCacheEnabled && !LoadGattFile(gattCacheOptions.path))
+		gattLayouts.clear();
+	return true;
+}
+
+bool InvalidateGattCache(wchar_t* deviceId)
+{
+	uint64_t address = 0;
+	if (deviceId != nullptr && !ParseDeviceAddress(deviceId, address)) {
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d InvalidateGattCache: no address in device id %ls.", __WFILE__, __LINE__, deviceId);
+		return false;
+	}
+	InvalidateGattLayout(address);
+	return true;
+}
+
+void GetGattCacheStats(GattCacheStats* stats)
+{
+	lock_guard guard(gattCacheLock);
+	*stats = gattCacheStats;
+	stats->devices = static_cast<uint32_t>(gattLayouts.size());
+}
+
+bool GattCacheEnabled()
+{
+	lock_guard guard(gattCacheLock);
+	return gattCacheEnabled;
+}
+
+bool LookupGattServices(uint64_t address, vector<BleGuid>& services)
+{
+	lock_guard guard(gattCacheLock);
+	if (!gattCacheEnabled)
+		return false;
+	auto found = gattLayouts.find(address);
+	if (found == gattLayouts.end()) {
+		gattCacheStats.misses++;
+		return false;
+	}
+	services.clear();
+	for (auto const& service : found->second)
+		services.push_back(service.uuid);
+	gattCacheStats.hits++;
+	return true;
+}
+
+bool LookupGattCharacteristics(uint64_t address, BleGuid const& service, bool withDescriptions,
+	vector<GattCharacteristicLayout>& characteristics)
+{
+	lock_guard guard(gattCacheLock);
+	if (!gattCacheEnabled)
+		return false;
+	auto found = gattLayouts.find(address);
+	if (found != gattLayouts.end()) {
+		for (auto const& layout : found->second) {
+			if (layout.uuid == service && layout.characteristicsKnown && (layout.descriptionsKnown || !withDescriptions)) {
+				characteristics = layout.characteristics;
+				gattCacheStats.hits++;
+				return true;
+			}
+		}
+	}
+	gattCacheStats.misses++;
+	return false;
+}
+
+void StoreGattServices(uint64_t address, vector<BleGuid> const& services)
+{
+	lock_guard guard(gattCacheLock);
+	if (!gattCacheEnabled || address == 0)
+		return;
+	auto& layout = gattLayouts[address];
+	GattDeviceLayout updated;
+	for (auto const& uuid : services) {
+		// keep what is known about services that are still there
+		auto existing = find_if(layout.begin(), layout.end(), [&](GattServiceLayout const& s) { return s.uuid == uuid; });
+		if (existing != layout.end())
+			updated.push_back(move(*existing));
+		else {
+			GattServiceLayout service;
+			service.uuid = uuid;
+			updated.push_back(move(service));
+		}
+	}
+	layout.swap(updated);
+	MarkGattDirty();
+}
+
+void StoreGattCharacteristics(uint64_t address, BleGuid const& service, bool withDescriptions,
+	vector<GattCharacteristicLayout> const& characteristics)
+{
+	lock_guard guard(gattCacheLock);
+	if (!gattCacheEnabled || address == 0)
+		return;
+	// only devices whose service list is stored, so that a stored device always answers ScanServices completely
+	auto found = gattLayouts.find(address);
+	if (found == gattLayouts.end())
+		return;
+	auto& layout = found->second;
+	auto existing = find_if(layout.begin(), layout.end(), [&](GattServiceLayout const& s) { return s.uuid == service; });
+	if (existing == layout.end())
+		return;
+	existing->characteristics = characteristics;
+	existing->characteristicsKnown = true;
+	existing->descriptionsKnown = withDescriptions;
+	MarkGattDirty();
+}
+
+void InvalidateGattLayout(uint64_t address)
+{
+	lock_guard guard(gattCacheLock);
+	if (!gattCacheEnabled)
+		return;
+	size_t erased;
+	if (address == 0) {
+		erased = gattLayouts.size();
+		gattLayouts.clear();
+	}
+	else
+		erased = gattLayouts.erase(address);
+	if (erased == 0)
+		return;
+	gattCacheStats.invalidations += erased;
+	MarkGattDirty();
+}
+
+bool ShouldRevalidateGatt(uint64_t address)
+{
+	lock_guard guard(gattCacheLock);
+	return gattCacheEnabled && gattCacheOptions.revalidate && gattRevalidated.insert(address).second;
+}
+
+bool RevalidateGattLayout(uint64_t address, vector<GattServiceLayout> const& live)
+{
+	bool matches = true;
+	{
+		lock_guard guard(gattCacheLock);
+		auto found = gattLayouts.find(address);
+		if (!gattCacheEnabled || found == gattLayouts.end())
+			return true;
+		gattCacheStats.revalidations++;
+		auto const& stored = found->second;
+		auto uuids = [](auto const& list) {
+			vector<BleGuid> out;
+			for (auto const& entry : list)
+				out.push_back(entry.uuid);
+			sort(out.begin(), out.end(), [](BleGuid const& a, BleGuid const& b) { return memcmp(&a, &b, sizeof(BleGuid)) < 0; });
+			return out;
+		};
+		matches = uuids(stored) == uuids(live);
+		// only compare the characteristics both sides know about
+		for (size_t i = 0; matches && i < stored.size(); i++) {
+			auto other = find_if(live.begin(), live.end(), [&](GattServiceLayout const& s) { return s.uuid == stored[i].uuid; });
+			// equal UUID lists guarantee a match today, but don't rely on it for the dereference
+			if (other == live.end())
+				matches = false;
+			else if (stored[i].characteristicsKnown && other->characteristicsKnown)
+				matches = uuids(stored[i].characteristics) == uuids(other->characteristics);
+		}
+	}
+	if (!matches)
+		InvalidateGattLayout(address);
+	return matches;
+}
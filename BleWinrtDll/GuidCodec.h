@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <stdexcept>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BLE_GUID_SSE2 1
+#endif
+
+// Layout compatible with GUID and winrt::guid, but without depending on either so that it can be used in constexpr
+// contexts and in code that doesn't see the Windows headers.
+struct BleGuid
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+
+    constexpr bool operator==(BleGuid const& other) const
+    {
+        if (Data1 != other.Data1 || Data2 != other.Data2 || Data3 != other.Data3)
+            return false;
+        for (int i = 0; i < 8; i++)
+            if (Data4[i] != other.Data4[i])
+                return false;
+        return true;
+    }
+    constexpr bool operator!=(BleGuid const& other) const { return !(*this == other); }
+};
+
+// Parsing and formatting of GUIDs in the textual form used throughout the API, e.g.
+// "{f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4}". None of the functions allocate.
+namespace GuidCodec
+{
+    constexpr size_t CanonicalLength = 36;
+    // "{...}" plus terminating nul
+    constexpr size_t FormattedCapacity = CanonicalLength + 3;
+
+    // positions of the hex digits inside the 36 character form, two per byte in memory order of the text
+    constexpr uint8_t DigitPositions[32] = {
+        0, 1, 2, 3, 4, 5, 6, 7,
+        9, 10, 11, 12,
+        14, 15, 16, 17,
+        19, 20, 21, 22,
+        24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35
+    };
+
+    constexpr int HexValue(uint32_t c)
+    {
+        return c >= '0' && c <= '9' ? int(c - '0')
+            : c >= 'a' && c <= 'f' ? int(c - 'a' + 10)
+            : c >= 'A' && c <= 'F' ? int(c - 'A' + 10)
+            : -1;
+    }
+
+    // bytes are in text order, i.e. Data1 and friends big endian
+    constexpr BleGuid FromTextBytes(const uint8_t (&b)[16])
+    {
+        BleGuid g{};
+        g.Data1 = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+        g.Data2 = uint16_t((b[4] << 8) | b[5]);
+        g.Data3 = uint16_t((b[6] << 8) | b[7]);
+        for (int i = 0; i < 8; i++)
+            g.Data4[i] = b[8 + i];
+        return g;
+    }
+
+    // scalar parser of the 36 character form, also used for constant evaluation
+    template <typename Char>
+    constexpr bool ParseCanonicalScalar(const Char* text, BleGuid& out)
+    {
+        if (uint32_t(text[8]) != '-' || uint32_t(text[13]) != '-' || uint32_t(text[18]) != '-' || uint32_t(text[23]) != '-')
+            return false;
+        uint8_t bytes[16] = {};
+        for (int i = 0; i < 16; i++)
+        {
+            int high = HexValue(uint32_t(text[DigitPositions[2 * i]]));
+            int low = HexValue(uint32_t(text[DigitPositions[2 * i + 1]]));
+            if (high < 0 || low < 0)
+                return false;
+            bytes[i] = uint8_t((high << 4) | low);
+        }
+        out = FromTextBytes(bytes);
+        return true;
+    }
+
+#ifdef BLE_GUID_SSE2
+    // Classifies eight UTF-16 code units per instruction: computes their nibble value and checks that every lane holds
+    // a hex digit, or a hyphen where one is expected. Only the final byte assembly is scalar.
+    inline bool ParseCanonicalSse2(const uint16_t* text, BleGuid& out)
+    {
+        // lane offsets of the five loads; the last one overlaps the fourth to stay inside the 36 characters
+        static const int offsets[5] = { 0, 8, 16, 24, 28 };
+        // lanes that must hold a hyphen, per load
+        alignas(16) static const int16_t hyphenLanes[5][8] = {
+            { 0, 0, 0, 0, 0, 0, 0, 0 },
+            { -1, 0, 0, 0, 0, -1, 0, 0 },
+            { 0, 0, -1, 0, 0, 0, 0, -1 },
+            { 0, 0, 0, 0, 0, 0, 0, 0 },
+            { 0, 0, 0, 0, 0, 0, 0, 0 },
+        };
+        alignas(16) uint16_t nibbles[40];
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ten = _mm_set1_epi16(10);
+        const __m128i six = _mm_set1_epi16(6);
+        const __m128i minusOne = _mm_set1_epi16(-1);
+        const __m128i charZero = _mm_set1_epi16('0');
+        const __m128i charA = _mm_set1_epi16('a');
+        const __m128i lowerBit = _mm_set1_epi16(0x20);
+        const __m128i hyphen = _mm_set1_epi16('-');
+
+        __m128i allValid = minusOne;
+        for (int k = 0; k < 5; k++)
+        {
+            int offset = offsets[k];
+            __m128i hyphenMask = _mm_load_si128(reinterpret_cast<const __m128i*>(hyphenLanes[k]));
+
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + offset));
+            __m128i digit = _mm_sub_epi16(c, charZero);
+            __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi16(digit, minusOne), _mm_cmplt_epi16(digit, ten));
+            __m128i alpha = _mm_sub_epi16(_mm_or_si128(c, lowerBit), charA);
+            __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi16(alpha, minusOne), _mm_cmplt_epi16(alpha, six));
+            __m128i value = _mm_or_si128(_mm_and_si128(isDigit, digit),
+                                         _mm_and_si128(isAlpha, _mm_add_epi16(alpha, ten)));
+            __m128i isHex = _mm_or_si128(isDigit, isAlpha);
+            __m128i isHyphen = _mm_cmpeq_epi16(c, hyphen);
+            // hex digit where a digit is expected, hyphen where a hyphen is expected
+            __m128i valid = _mm_or_si128(_mm_andnot_si128(hyphenMask, isHex), _mm_and_si128(hyphenMask, isHyphen));
+            allValid = _mm_and_si128(allValid, valid);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(nibbles + offset), value);
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(allValid, zero)) != 0)
+            return false;
+
+        uint8_t bytes[16];
+        for (int i = 0; i < 16; i++)
+            bytes[i] = uint8_t((nibbles[DigitPositions[2 * i]] << 4) | nibbles[DigitPositions[2 * i + 1]]);
+        out = FromTextBytes(bytes);
+        return true;
+    }
+#endif
+
+    // Strict parser. Accepts exactly "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx", optionally enclosed in braces.
+    template <typename Char>
+    inline bool TryParse(const Char* text, size_t length, BleGuid& out)
+    {
+        if (length == CanonicalLength + 2)
+        {
+            if (uint32_t(text[0]) != '{' || uint32_t(text[length - 1]) != '}')
+                return false;
+            text++;
+            length -= 2;
+        }
+        if (length != CanonicalLength)
+            return false;
+#ifdef BLE_GUID_SSE2
+        if (sizeof(Char) == 2)
+            return ParseCanonicalSse2(reinterpret_cast<const uint16_t*>(text), out);
+#endif
+        return ParseCanonicalScalar(text, out);
+    }
+
+    inline bool TryParse(const wchar_t* text, BleGuid& out)
+    {
+        return TryParse(text, wcslen(text), out);
+    }
+
+    // Lenient single pass parser: collects the first 32 hex digits and skips everything else. Missing digits are
+    // zero. This is what make_guid historically accepted, so it stays the fallback for ids that aren't canonical.
+    inline BleGuid ParseLenient(const wchar_t* text)
+    {
+        uint8_t bytes[16] = {};
+        int count = 0;
+        for (; *text && count < 32; text++)
+        {
+            int value = HexValue(uint32_t(*text));
+            if (value < 0)
+                continue;
+            bytes[count / 2] |= uint8_t(count % 2 == 0 ? value << 4 : value);
+            count++;
+        }
+        return FromTextBytes(bytes);
+    }
+
+    inline BleGuid Parse(const wchar_t* text)
+    {
+        BleGuid g;
+        if (TryParse(text, g))
+            return g;
+        return ParseLenient(text);
+    }
+
+    // Writes the lowercase form, in braces like winrt::to_hstring does by default. Returns the number of characters
+    // written without the terminating nul, or 0 if capacity is too small.
+    inline size_t Format(BleGuid const& g, wchar_t* out, size_t capacity, bool braces = true)
+    {
+        static const char digits[] = "0123456789abcdef";
+        size_t length = CanonicalLength + (braces ? 2 : 0);
+        if (capacity < length + 1)
+            return 0;
+
+        uint8_t bytes[16] = {
+            uint8_t(g.Data1 >> 24), uint8_t(g.Data1 >> 16), uint8_t(g.Data1 >> 8), uint8_t(g.Data1),
+            uint8_t(g.Data2 >> 8), uint8_t(g.Data2), uint8_t(g.Data3 >> 8), uint8_t(g.Data3),
+            g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]
+        };
+        wchar_t* p = out;
+        if (braces)
+            *p++ = L'{';
+        for (int i = 0; i < 16; i++)
+        {
+            if (i == 4 || i == 6 || i == 8 || i == 10)
+                *p++ = L'-';
+            *p++ = wchar_t(digits[bytes[i] >> 4]);
+            *p++ = wchar_t(digits[bytes[i] & 0xF]);
+        }
+        if (braces)
+            *p++ = L'}';
+        *p = L'\0';
+        return length;
+    }
+
+    // GUID from a string literal, evaluated at compile time. Invalid literals fail to compile when used in a constant
+    // expression.
+    template <size_t N>
+    constexpr BleGuid Literal(const char (&text)[N])
+    {
+        static_assert(N == CanonicalLength + 1 || N == CanonicalLength + 3, "GUID literal must have 36 or 38 characters");
+        const char* canonical = N == CanonicalLength + 3 ? text + 1 : text;
+        BleGuid g{};
+        if (!ParseCanonicalScalar(canonical, g))
+            throw std::invalid_argument("malformed GUID literal");
+        return g;
+    }
+
+    // 16/32-bit UUIDs assigned by the Bluetooth SIG are offsets into the Bluetooth base UUID
+    // 00000000-0000-1000-8000-00805f9b34fb
+    constexpr BleGuid FromShortUuid(uint32_t shortUuid)
+    {
+        return BleGuid{ shortUuid, 0x0000, 0x1000, { 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb } };
+    }
+}
+
+namespace WellKnownUuids
+{
+    // Characteristic User Description descriptor
+    constexpr BleGuid UserDescription = GuidCodec::Literal("00002901-0000-1000-8000-00805f9b34fb");
+    // Client Characteristic Configuration descriptor
+    constexpr BleGuid ClientCharacteristicConfiguration = GuidCodec::FromShortUuid(0x2902);
+    // Service Changed characteristic of the Generic Attribute service
+    constexpr BleGuid ServiceChanged = GuidCodec::FromShortUuid(0x2A05);
+}
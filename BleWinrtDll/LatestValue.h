@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+// Conflating single-value store for subscriptions that only care about the newest sample.
+// Writers publish with a seqlock: the sequence is odd while a write is in progress, readers copy the value and retry if
+// the sequence moved in between. Readers never block the writer (the BLE callback thread), the writer never waits for a
+// reader. Writers are serialized among themselves by a spin flag, which is uncontended as WinRT raises ValueChanged for
+// one characteristic from one thread at a time.
+class LatestSlot
+{
+public:
+    static constexpr size_t MaxSize = 512;
+
+    void Write(const uint8_t* data, uint16_t size, uint64_t timestamp)
+    {
+        if (size > MaxSize)
+            size = MaxSize;
+        while (writing.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+
+        uint64_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        length.store(size, std::memory_order_relaxed);
+        time.store(timestamp, std::memory_order_relaxed);
+        memcpy(buf, data, size);
+        sequence.store(seq + 2, std::memory_order_release);
+
+        writing.clear(std::memory_order_release);
+    }
+
+    // Copies the newest value into out (at least MaxSize bytes) and its timestamp into timestamp. Returns the number of
+    // updates written so far, 0 if there was none yet. dropped receives how many updates were overwritten since the
+    // newest value any Read returned; with several readers each overwritten update is reported to one of them only.
+    uint64_t Read(uint8_t* out, uint16_t& size, uint64_t& timestamp, uint64_t& dropped)
+    {
+        uint64_t before, after;
+        for (;;)
+        {
+            before = sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            size = length.load(std::memory_order_relaxed);
+            timestamp = time.load(std::memory_order_relaxed);
+            memcpy(out, buf, size);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence.load(std::memory_order_relaxed);
+            if (before == after)
+                break;
+        }
+
+        uint64_t updates = before / 2;
+        uint64_t previous = lastReadUpdates.load(std::memory_order_relaxed);
+        while (previous < updates && !lastReadUpdates.compare_exchange_weak(previous, updates, std::memory_order_relaxed))
+        {
+        }
+        // a concurrent reader that got a newer value already accounted for the gap
+        dropped = previous < updates && updates > previous + 1 ? updates - previous - 1 : 0;
+        return updates;
+    }
+
+private:
+    std::atomic<uint64_t> sequence{ 0 };
+    std::atomic_flag writing = ATOMIC_FLAG_INIT;
+    std::atomic<uint16_t> length{ 0 };
+    std::atomic<uint64_t> time{ 0 };
+    uint8_t buf[MaxSize];
+    // newest update returned by a Read, shared by all readers
+    std::atomic<uint64_t> lastReadUpdates{ 0 };
+};
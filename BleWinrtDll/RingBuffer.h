@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free queue for the notification path.
+// Based on Dmitry Vyukov's bounded MPMC queue, see
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// Every cell carries a sequence number that tells producers and consumers whether the cell is free or filled for the
+// current lap, so pushing and popping is one CAS on the shared index plus a copy into preallocated storage. We only
+// ever have one consumer (the thread calling PollData), but popping is safe from any thread, which Quit relies on.
+template <typename T>
+class BoundedRing
+{
+public:
+    // capacity is rounded up to the next power of two
+    explicit BoundedRing(size_t capacity)
+    {
+        size_t size = RoundedCapacity(capacity);
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        enqueuePos.store(0, std::memory_order_relaxed);
+        dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    static size_t RoundedCapacity(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        return size;
+    }
+
+    BoundedRing(BoundedRing const&) = delete;
+    BoundedRing& operator=(BoundedRing const&) = delete;
+
+    size_t Capacity() const { return mask + 1; }
+
+    // returns false if the ring is full
+    bool TryPush(T const& value)
+    {
+        return TryPushWith([&value](T& cell) { cell = value; });
+    }
+
+    // like TryPush, but fill(T&) writes the value in place, before consumers can see it
+    template <typename Fill>
+    bool TryPushWith(Fill&& fill)
+    {
+        Cell* cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        fill(cell->value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // returns false if the ring is empty
+    bool TryPop(T& value)
+    {
+        Cell* cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+        value = cell->value;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pops up to maxCount values with a single CAS on the consumer index, returns the number of values popped
+    size_t TryPopBulk(T* values, size_t maxCount)
+    {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        size_t count;
+        for (;;)
+        {
+            count = 0;
+            while (count < maxCount && count <= mask)
+            {
+                size_t seq = cells[(pos + count) & mask].sequence.load(std::memory_order_acquire);
+                if ((intptr_t)seq - (intptr_t)(pos + count + 1) != 0)
+                    break;
+                count++;
+            }
+            if (count == 0)
+            {
+                // either empty or another consumer moved on, in which case the index has changed
+                size_t current = dequeuePos.load(std::memory_order_relaxed);
+                if (current == pos)
+                    return 0;
+                pos = current;
+                continue;
+            }
+            if (dequeuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                break;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Cell& cell = cells[(pos + i) & mask];
+            values[i] = cell.value;
+            cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // snapshot only, may be stale by the time the caller looks at it
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    size_t Size() const
+    {
+        size_t head = dequeuePos.load(std::memory_order_acquire);
+        size_t tail = enqueuePos.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    // returns the number of values discarded
+    size_t Clear()
+    {
+        T discard;
+        size_t count = 0;
+        while (TryPop(discard))
+            count++;
+        return count;
+    }
+
+private:
+    // keep producer and consumer indices on separate cache lines
+    static constexpr size_t CacheLine = 64;
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(CacheLine) std::atomic<size_t> enqueuePos;
+    alignas(CacheLine) std::atomic<size_t> dequeuePos;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AdParser.h"
+#include "BleTypes.h"
+#include "FlatTable.h"
+#include "GuidCodec.h"
+
+// What a scan reports about a device. The device watcher only knows address and name, advertisements also carry RSSI
+// and AD structures; a criterion whose data is missing doesn't match.
+struct ScanSubject {
+    uint64_t address = 0;
+    const wchar_t* name = nullptr;      // from the device watcher
+    const uint8_t* nameUtf8 = nullptr;  // from an advertisement
+    size_t nameUtf8Size = 0;
+    bool hasRssi = false;
+    int16_t rssi = 0;
+    const uint8_t* payload = nullptr;   // the advertisement parsed into advertisement
+    AdParser::Advertisement const* advertisement = nullptr;
+};
+
+// ScanFilterRules compiled for evaluation on the scan callbacks: names are converted once to the encoding they are
+// compared in, UUIDs to the byte order they are advertised in, and rules that only list an address go into a hash table
+// so that long allow and deny lists cost one lookup. Not thread-safe apart from the counters; replace it as a whole.
+class ScanMatcher
+{
+public:
+    // expects rules validated by SetScanFilter
+    ScanMatcher(ScanFilterRule const* rules, uint32_t count, ScanFilterAction unmatched)
+        : unmatched(unmatched), hits(new std::atomic<uint64_t>[count])
+    {
+        compiled.reserve(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            hits[i].store(0, std::memory_order_relaxed);
+            compiled.push_back(Compile(rules[i]));
+            if (rules[i].criteria == SCAN_FILTER_ADDRESS)
+            {
+                // an earlier rule for the same address shadows this one
+                if (addressRules.Find(rules[i].address) == nullptr)
+                    addressRules.Insert(rules[i].address) = i;
+            }
+            else
+                otherRules.push_back(i);
+        }
+    }
+
+    ScanMatcher(ScanMatcher const&) = delete;
+    ScanMatcher& operator=(ScanMatcher const&) = delete;
+
+    bool Accepts(ScanSubject const& subject)
+    {
+        // rules are ordered, so only the ones before the address rule can override it
+        uint32_t decided = NO_RULE;
+        if (auto* index = addressRules.Find(subject.address))
+            decided = *index;
+        for (uint32_t index : otherRules)
+        {
+            if (index > decided)
+                break;
+            if (Matches(compiled[index], subject))
+            {
+                decided = index;
+                break;
+            }
+        }
+
+        ScanFilterAction action = unmatched;
+        if (decided != NO_RULE)
+        {
+            hits[decided].fetch_add(1, std::memory_order_relaxed);
+            action = compiled[decided].action;
+        }
+        else
+            unmatchedCount.fetch_add(1, std::memory_order_relaxed);
+        (action == ScanFilterAction::ACCEPT ? accepted : rejected).fetch_add(1, std::memory_order_relaxed);
+        return action == ScanFilterAction::ACCEPT;
+    }
+
+    // copies up to capacity per rule hit counters and returns the number of rules
+    uint32_t Snapshot(ScanFilterStats& stats, uint64_t* ruleHits, uint32_t capacity) const
+    {
+        stats.accepted = accepted.load(std::memory_order_relaxed);
+        stats.rejected = rejected.load(std::memory_order_relaxed);
+        stats.evaluated = stats.accepted + stats.rejected;
+        stats.unmatched = unmatchedCount.load(std::memory_order_relaxed);
+        stats.rules = static_cast<uint32_t>(compiled.size());
+        for (uint32_t i = 0; ruleHits != nullptr && i < capacity && i < compiled.size(); i++)
+            ruleHits[i] = hits[i].load(std::memory_order_relaxed);
+        return stats.rules;
+    }
+
+    // UTF-16 on Windows, UTF-32 elsewhere
+    static std::string ToUtf8(const wchar_t* text)
+    {
+        std::string out;
+        for (; *text; text++)
+        {
+            uint32_t c = static_cast<uint32_t>(*text);
+            if (sizeof(wchar_t) == 2 && c >= 0xD800 && c < 0xDC00 && text[1] >= 0xDC00 && text[1] < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<uint32_t>(text[1]) - 0xDC00);
+                text++;
+            }
+            if (c < 0x80)
+                out += static_cast<char>(c);
+            else if (c < 0x800)
+            {
+                out += static_cast<char>(0xC0 | (c >> 6));
+                out += static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else if (c < 0x10000)
+            {
+                out += static_cast<char>(0xE0 | (c >> 12));
+                out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else
+            {
+                out += static_cast<char>(0xF0 | (c >> 18));
+                out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
+        return out;
+    }
+
+private:
+    static constexpr uint32_t NO_RULE = UINT32_MAX;
+
+    struct CompiledRule
+    {
+        ScanFilterAction action;
+        uint32_t criteria;
+        std::wstring name;
+        std::string nameUtf8;
+        bool namePrefix;
+        // the service UUID as advertised: little endian, shortened for UUIDs of the Bluetooth base
+        bool shortService;
+        uint8_t service16[2];
+        uint8_t service32[4];
+        uint8_t service128[16];
+        uint16_t companyId;
+        uint8_t dataSize;
+        uint8_t dataMask[SCAN_FILTER_DATA_SIZE];
+        uint8_t dataValue[SCAN_FILTER_DATA_SIZE];
+        int16_t minRssi;
+        uint64_t address;
+    };
+
+    static CompiledRule Compile(ScanFilterRule const& rule)
+    {
+        CompiledRule out{};
+        out.action = rule.action;
+        out.criteria = rule.criteria;
+        out.name.assign(rule.name, wcsnlen(rule.name, sizeof(rule.name) / sizeof(rule.name[0])));
+        out.nameUtf8 = ToUtf8(out.name.c_str());
+        out.namePrefix = rule.namePrefix;
+
+        auto service = GuidCodec::Parse(rule.serviceUuid);
+        auto base = GuidCodec::FromShortUuid(service.Data1);
+        out.shortService = service == base;
+        for (int i = 0; i < 4; i++)
+            out.service32[i] = static_cast<uint8_t>(service.Data1 >> (8 * i));
+        memcpy(out.service16, out.service32, 2);
+        for (int i = 0; i < 8; i++)
+            out.service128[i] = service.Data4[7 - i];
+        out.service128[8] = static_cast<uint8_t>(service.Data3);
+        out.service128[9] = static_cast<uint8_t>(service.Data3 >> 8);
+        out.service128[10] = static_cast<uint8_t>(service.Data2);
+        out.service128[11] = static_cast<uint8_t>(service.Data2 >> 8);
+        memcpy(out.service128 + 12, out.service32, 4);
+
+        out.companyId = rule.companyId;
+        out.dataSize = rule.dataSize;
+        memcpy(out.dataMask, rule.dataMask, sizeof(out.dataMask));
+        memcpy(out.dataValue, rule.dataValue, sizeof(out.dataValue));
+        out.minRssi = rule.minRssi;
+        out.address = rule.address;
+        return out;
+    }
+
+    // whether the list of UUIDs in field contains uuid
+    static bool ListContains(const uint8_t* payload, AdParser::Field const& field, const uint8_t* uuid, size_t size)
+    {
+        for (size_t offset = 0; offset + size <= field.size; offset += size)
+            if (memcmp(payload + field.offset + offset, uuid, size) == 0)
+                return true;
+        return false;
+    }
+
+    static bool MatchesName(CompiledRule const& rule, ScanSubject const& subject)
+    {
+        if (subject.name != nullptr)
+        {
+            if (rule.namePrefix)
+                return wcsncmp(subject.name, rule.name.c_str(), rule.name.size()) == 0;
+            return rule.name == subject.name;
+        }
+        if (subject.nameUtf8 == nullptr)
+            return false;
+        auto size = rule.nameUtf8.size();
+        if (rule.namePrefix ? subject.nameUtf8Size < size : subject.nameUtf8Size != size)
+            return false;
+        return memcmp(subject.nameUtf8, rule.nameUtf8.data(), size) == 0;
+    }
+
+    static bool MatchesService(CompiledRule const& rule, ScanSubject const& subject)
+    {
+        auto const* ad = subject.advertisement;
+        if (ad == nullptr)
+            return false;
+        const uint8_t* payload = subject.payload;
+        if (rule.shortService && rule.service32[2] == 0 && rule.service32[3] == 0
+            && ListContains(payload, ad->uuid16, rule.service16, 2))
+            return true;
+        if (rule.shortService && ListContains(payload, ad->uuid32, rule.service32, 4))
+            return true;
+        if (ListContains(payload, ad->uuid128, rule.service128, 16))
+            return true;
+        auto const& data = ad->serviceData;
+        if (!data.Present())
+            return false;
+        auto const* uuid = payload + data.offset;
+        switch (ad->serviceDataUuidSize)
+        {
+        case 2:
+            return rule.shortService && rule.service32[2] == 0 && rule.service32[3] == 0 && memcmp(uuid, rule.service16, 2) == 0;
+        case 4:
+            return rule.shortService && memcmp(uuid, rule.service32, 4) == 0;
+        default:
+            return memcmp(uuid, rule.service128, 16) == 0;
+        }
+    }
+
+    static bool MatchesManufacturer(CompiledRule const& rule, ScanSubject const& subject)
+    {
+        auto const* ad = subject.advertisement;
+        if (ad == nullptr || !ad->manufacturerData.Present())
+            return false;
+        auto const* data = subject.payload + ad->manufacturerData.offset;
+        if (AdParser::ReadUint16(data) != rule.companyId || ad->manufacturerData.size - 2u < rule.dataSize)
+            return false;
+        for (uint8_t i = 0; i < rule.dataSize; i++)
+            if ((data[2 + i] & rule.dataMask[i]) != (rule.dataValue[i] & rule.dataMask[i]))
+                return false;
+        return true;
+    }
+
+    static bool Matches(CompiledRule const& rule, ScanSubject const& subject)
+    {
+        // cheapest criteria first
+        if ((rule.criteria & SCAN_FILTER_ADDRESS) && subject.address != rule.address)
+            return false;
+        if ((rule.criteria & SCAN_FILTER_MIN_RSSI) && (!subject.hasRssi || subject.rssi < rule.minRssi))
+            return false;
+        if ((rule.criteria & SCAN_FILTER_MANUFACTURER) && !MatchesManufacturer(rule, subject))
+            return false;
+        if ((rule.criteria & SCAN_FILTER_NAME) && !MatchesName(rule, subject))
+            return false;
+        if ((rule.criteria & SCAN_FILTER_SERVICE) && !MatchesService(rule, subject))
+            return false;
+        return true;
+    }
+
+    ScanFilterAction unmatched;
+    std::vector<CompiledRule> compiled;
+    // rules with SCAN_FILTER_ADDRESS as their only criterion, by address
+    FlatTable<uint64_t, uint32_t> addressRules;
+    // all other rules in order
+    std::vector<uint32_t> otherRules;
+    std::unique_ptr<std::atomic<uint64_t>[]> hits;
+    std::atomic<uint64_t> accepted{ 0 };
+    std::atomic<uint64_t> rejected{ 0 };
+    std::atomic<uint64_t> unmatchedCount{ 0 };
+};
@@ -0,0 +1,843 @@
+// SimulatedBackend.cpp : simulated peripherals behind the exported API, see SimulatedBackend.h.
+
+#include "SimulatedBackend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "BleCore.h"
+#include "BleWinrtDll.h"
+#include "FlatTable.h"
+
+using namespace std;
+
+#define __WFILE__ L"SimulatedBackend.cpp"
+
+constexpr BleGuid SIM_SERVICE = GuidCodec::FromShortUuid(0xFFF0);
+constexpr uint32_t SIM_FIRST_CHARACTERISTIC = 0xFFF1;
+// most notifications a generator sends per characteristic and tick, see RunGenerator
+constexpr uint64_t SIM_MAX_BURST = 256;
+// locally administered addresses 02:00:00:00:00:01, 02:00:00:00:00:02, ...
+constexpr uint64_t SIM_ADDRESS_BASE = 0x020000000000ull;
+// values of BluetoothConnectionStatus
+constexpr int32_t SIM_DISCONNECTED = 0;
+constexpr int32_t SIM_CONNECTED = 1;
+// values of BluetoothLEAdvertisementType
+constexpr uint8_t SIM_CONNECTABLE_UNDIRECTED = 0;
+constexpr uint8_t SIM_SCAN_RESPONSE = 4;
+constexpr int8_t SIM_TX_POWER = -8;
+// GattCharacteristicProperties WriteWithoutResponse | Notify
+constexpr uint32_t SIM_PROPERTIES = 0x04 | 0x10;
+
+struct SimCharacteristic {
+	// set while subscribed
+	shared_ptr<NotificationSink> sink;
+};
+struct SimDevice {
+	wchar_t id[100];
+	uint64_t address = 0;
+	// guards the fields below, the generator thread takes it once per tick
+	mutex lock;
+	vector<SimCharacteristic> characteristics;
+	bool connected = false;
+	// unreachable until this time of TimestampNs, 0 while in range
+	uint64_t downUntilNs = 0;
+	uint64_t nextDropNs = 0;
+	thread generator;
+};
+// identity of a handle inside the simulation
+struct SimTarget {
+	uint32_t device = 0;
+	uint32_t characteristic = 0;
+};
+struct SimPendingWrite {
+	uint64_t dueNs;
+	WriteDone done;
+};
+
+mutex simLock;
+SimConfig simConfig{};
+vector<unique_ptr<SimDevice>> simDevices;
+FlatTable<uint32_t, SimTarget> simHandles;
+atomic<uint32_t> simSubscriptions{ 0 };
+atomic<bool> simRunning{ false };
+// set by StartAdvertisementScan, see RunGenerator
+atomic<bool> simAdvertising{ false };
+atomic<bool> simActiveScan{ false };
+
+// writes with latency complete in FIFO order, which is deadline order as the latency is the same for all
+deque<SimPendingWrite> simWrites;
+mutex simWriteLock;
+condition_variable simWriteSignal;
+thread simWriteThread;
+
+// scans finish immediately, so the poll functions never have to wait
+template <typename T>
+struct ScanQueue {
+	queue<T> items;
+	mutex lock;
+	QueueCounter& counter;
+	BleEvent event;
+	// the scan finished, but nobody polled FINISHED yet, see WaitEvents
+	bool finishPending = false;
+
+	ScanQueue(QueueCounter& counter, BleEvent event) : counter(counter), event(event) {}
+
+	void Fill(vector<T> const& results)
+	{
+		{
+			lock_guard guard(lock);
+			for (auto const& item : results)
+			{
+				items.push(item);
+				counter.Enqueued(items.size());
+			}
+			finishPending = true;
+		}
+		SignalEvents(event);
+	}
+
+	bool Ready()
+	{
+		lock_guard guard(lock);
+		return !items.empty() || finishPending;
+	}
+
+	ScanStatus Poll(T* out)
+	{
+		lock_guard guard(lock);
+		if (items.empty())
+		{
+			finishPending = false;
+			return ScanStatus::FINISHED;
+		}
+		*out = items.front();
+		items.pop();
+		counter.Dequeued();
+		return ScanStatus::AVAILABLE;
+	}
+
+	void Clear()
+	{
+		lock_guard guard(lock);
+		counter.Dequeued(items.size());
+		items = {};
+		finishPending = false;
+	}
+};
+ScanQueue<DeviceUpdate> simDeviceScan(deviceQueueCounter, BLE_EVENT_DEVICE);
+ScanQueue<Service> simServiceScan(serviceQueueCounter, BLE_EVENT_SERVICE);
+ScanQueue<Characteristic> simCharacteristicScan(characteristicQueueCounter, BLE_EVENT_CHARACTERISTIC);
+
+// expects simLock to be held
+SimDevice* FindDevice(const wchar_t* deviceId)
+{
+	uint64_t address;
+	if (deviceId == nullptr || !ParseDeviceAddress(deviceId, address) || (address & ~0xFFFFFFFFull) != SIM_ADDRESS_BASE)
+		return nullptr;
+	uint64_t index = (address & 0xFFFFFFFFull) - 1;
+	return index < simDevices.size() ? simDevices[index].get() : nullptr;
+}
+
+// expects simLock to be held
+SimCharacteristic* FindTarget(uint32_t handle, SimDevice** device = nullptr)
+{
+	auto* target = simHandles.Find(handle);
+	if (target == nullptr || target->device >= simDevices.size())
+		return nullptr;
+	auto& owner = *simDevices[target->device];
+	if (target->characteristic >= owner.characteristics.size())
+		return nullptr;
+	if (device != nullptr)
+		*device = &owner;
+	return &owner.characteristics[target->characteristic];
+}
+
+// expects device.lock to be held; returns the connection update to report, if any
+bool UpdateLink(SimDevice& device, uint64_t now, int32_t& status)
+{
+	if (device.downUntilNs != 0 && now >= device.downUntilNs)
+	{
+		device.downUntilNs = 0;
+		status = SIM_CONNECTED;
+		return true;
+	}
+	if (simConfig.dropIntervalMs > 0 && now >= device.nextDropNs)
+	{
+		device.nextDropNs = now + uint64_t(simConfig.dropIntervalMs) * 1000000;
+		if (device.downUntilNs == 0)
+		{
+			device.downUntilNs = now + max<uint64_t>(uint64_t(simConfig.reconnectDelayMs) * 1000000, 1);
+			status = SIM_DISCONNECTED;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Advertisement and scan response of the device with index, as AD structures
+void BuildAdvertisements(uint32_t index, vector<uint8_t>& advertisement, vector<uint8_t>& scanResponse)
+{
+	uint32_t number = index + 1;
+	advertisement = {
+		2, 0x01, 0x06,                      // flags: LE general discoverable, BR/EDR not supported
+		3, 0x03, 0xF0, 0xFF,                // complete list of 16 bit service UUIDs: SIM_SERVICE
+		2, 0x0A, static_cast<uint8_t>(SIM_TX_POWER),
+		5, 0xFF, 0xFF, 0xFF,                // manufacturer data of company 0xFFFF, reserved for tests
+		static_cast<uint8_t>(number & 0xFF), static_cast<uint8_t>(number >> 8),
+	};
+	char name[20];
+	int length = snprintf(name, sizeof(name), "Simulated %u", static_cast<unsigned>(number));
+	scanResponse = { static_cast<uint8_t>(length + 1), 0x09 };
+	scanResponse.insert(scanResponse.end(), name, name + length);
+}
+
+// Paces the notifications of one device: every tick delivers the notifications that became due since the start, so
+// the rate holds on average even though the sleep is coarse. Notifications that fall due while the device is out of
+// range, or beyond SIM_MAX_BURST in one tick, are lost like on a saturated link. The thread only sleeps when nothing
+// was due, so a rate beyond what the engine can take turns the device into an unthrottled producer. Advertisements
+// go out at advertiseHz while an advertisement scan runs and the device is in range and not connected.
+void RunGenerator(SimDevice* device, uint32_t index)
+{
+	const uint64_t hz = simConfig.notifyHz;
+	vector<uint8_t> payload(simConfig.payloadSize);
+	for (size_t i = 0; i < payload.size(); i++)
+		payload[i] = static_cast<uint8_t>(i);
+	vector<shared_ptr<NotificationSink>> sinks;
+	const uint64_t startNs = TimestampNs();
+	uint64_t sent = 0;
+
+	const uint64_t advertisePeriodNs = simConfig.advertiseHz > 0 ? 1000000000 / simConfig.advertiseHz : 0;
+	vector<uint8_t> advertisement;
+	vector<uint8_t> scanResponse;
+	BuildAdvertisements(index, advertisement, scanResponse);
+	uint64_t nextAdvertisementNs = startNs;
+	uint32_t advertised = 0;
+
+	while (simRunning.load(memory_order_acquire))
+	{
+		auto now = TimestampNs();
+		int32_t status = 0;
+		bool linkChanged;
+		bool down;
+		bool connected;
+		{
+			lock_guard guard(device->lock);
+			linkChanged = UpdateLink(*device, now, status);
+			down = device->downUntilNs != 0;
+			connected = device->connected;
+			sinks.clear();
+			if (!down)
+				for (auto const& characteristic : device->characteristics)
+					if (characteristic.sink)
+						sinks.push_back(characteristic.sink);
+		}
+		if (linkChanged)
+			EnqueueConnectionUpdate(device->id, status);
+
+		bool advertise = advertisePeriodNs > 0 && now >= nextAdvertisementNs;
+		if (advertise)
+		{
+			// advertising events missed while not scanning are not made up for
+			nextAdvertisementNs = max(nextAdvertisementNs + advertisePeriodNs, now);
+			if (simAdvertising.load(memory_order_relaxed) && !down && !connected)
+			{
+				// wanders between -40 and -89 dBm
+				auto rssi = static_cast<int16_t>(-40 - static_cast<int>((advertised++ * 7 + index * 13) % 50));
+				PublishAdvertisement(device->address, rssi, SIM_CONNECTABLE_UNDIRECTED, advertisement.data(),
+					advertisement.size(), TimestampNs());
+				if (simActiveScan.load(memory_order_relaxed))
+					PublishAdvertisement(device->address, rssi, SIM_SCAN_RESPONSE, scanResponse.data(),
+						scanResponse.size(), TimestampNs());
+			}
+		}
+
+		uint64_t due = hz > 0 ? (now - startNs) * hz / 1000000000 - sent : 0;
+		uint64_t burst = sinks.empty() ? 0 : min(due, SIM_MAX_BURST);
+		// a stop doesn't wait out a burst of producers blocked on a full queue
+		for (uint64_t i = 0; i < burst && simRunning.load(memory_order_relaxed); i++)
+		{
+			if (!payload.empty())
+				payload[0] = static_cast<uint8_t>(sent + i);
+			for (auto const& sink : sinks)
+				sink->OnValue(TimestampNs(), payload.data(), payload.size());
+		}
+		sent += due;
+		if (due == 0 && !advertise)
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
+}
+
+void RunWriteCompletions()
+{
+	unique_lock lock(simWriteLock);
+	while (simRunning.load(memory_order_acquire))
+	{
+		if (simWrites.empty())
+		{
+			simWriteSignal.wait(lock);
+			continue;
+		}
+		auto now = TimestampNs();
+		if (simWrites.front().dueNs > now)
+		{
+			simWriteSignal.wait_for(lock, chrono::nanoseconds(simWrites.front().dueNs - now));
+			continue;
+		}
+		auto write = move(simWrites.front());
+		simWrites.pop_front();
+		// done pumps the write engine, which may queue the next write right away
+		lock.unlock();
+		write.done(WriteStatus::SUCCESS);
+		lock.lock();
+	}
+}
+
+class SimulatedBackend : public IBleBackend
+{
+public:
+	void Write(uint32_t handle, vector<uint8_t>&& /*data*/, WriteDone done) override
+	{
+		auto status = WriteStatus::SUCCESS;
+		{
+			lock_guard guard(simLock);
+			SimDevice* device = nullptr;
+			if (FindTarget(handle, &device) == nullptr)
+				status = WriteStatus::FAILED;
+			else
+			{
+				lock_guard deviceGuard(device->lock);
+				if (device->downUntilNs != 0)
+					status = WriteStatus::UNREACHABLE;
+			}
+		}
+		if (status != WriteStatus::SUCCESS || simConfig.writeLatencyUs == 0 || !simRunning.load(memory_order_acquire))
+		{
+			done(status);
+			return;
+		}
+		{
+			lock_guard guard(simWriteLock);
+			simWrites.push_back(SimPendingWrite{ TimestampNs() + uint64_t(simConfig.writeLatencyUs) * 1000, move(done) });
+		}
+		simWriteSignal.notify_one();
+	}
+
+	bool Subscribe(uint32_t handle, shared_ptr<NotificationSink> const& sink) override
+	{
+		lock_guard guard(simLock);
+		SimDevice* device = nullptr;
+		auto* characteristic = FindTarget(handle, &device);
+		if (characteristic == nullptr)
+		{
+			saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SubscribeByHandle: invalid handle %u.", __WFILE__, __LINE__, handle);
+			return false;
+		}
+		lock_guard deviceGuard(device->lock);
+		if (!characteristic->sink)
+			simSubscriptions.fetch_add(1, memory_order_relaxed);
+		characteristic->sink = sink;
+		clearError();
+		return true;
+	}
+
+	// the simulated GATT server answers without a round trip, so both complete right away
+	void ResolveAsync(wstring deviceId, wstring serviceId, wstring characteristicId, ResolveDone done) override
+	{
+		done(ResolveCharacteristic(deviceId.data(), serviceId.data(), characteristicId.data()));
+	}
+
+	void SubscribeAsync(uint32_t handle, shared_ptr<NotificationSink> const& sink, SubscribeDone done) override
+	{
+		done(Subscribe(handle, sink));
+	}
+
+	bool Unsubscribe(uint32_t handle) override
+	{
+		lock_guard guard(simLock);
+		SimDevice* device = nullptr;
+		auto* characteristic = FindTarget(handle, &device);
+		if (characteristic == nullptr || !characteristic->sink)
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d UnsubscribeByHandle: no subscription for handle %u.", __WFILE__, __LINE__, handle);
+			return false;
+		}
+		lock_guard deviceGuard(device->lock);
+		characteristic->sink = nullptr;
+		simSubscriptions.fetch_sub(1, memory_order_relaxed);
+		clearError();
+		return true;
+	}
+
+	bool HasSubscriptions() override
+	{
+		return simSubscriptions.load(memory_order_relaxed) > 0;
+	}
+
+	uint32_t ReadyEvents(uint32_t mask) override
+	{
+		uint32_t ready = 0;
+		if ((mask & BLE_EVENT_DEVICE) && simDeviceScan.Ready())
+			ready |= BLE_EVENT_DEVICE;
+		if ((mask & BLE_EVENT_SERVICE) && simServiceScan.Ready())
+			ready |= BLE_EVENT_SERVICE;
+		if ((mask & BLE_EVENT_CHARACTERISTIC) && simCharacteristicScan.Ready())
+			ready |= BLE_EVENT_CHARACTERISTIC;
+		return ready;
+	}
+};
+
+IBleBackend& Backend()
+{
+	static SimulatedBackend backend;
+	return backend;
+}
+
+// expects simLock to be held
+void DropSubscriptions(SimDevice& device)
+{
+	lock_guard guard(device.lock);
+	for (auto& characteristic : device.characteristics)
+	{
+		if (characteristic.sink)
+			simSubscriptions.fetch_sub(1, memory_order_relaxed);
+		characteristic.sink = nullptr;
+	}
+}
+
+bool SimStart(SimConfig* config)
+{
+	if (config->devices == 0 || config->devices > 0xFFFF || config->characteristicsPerDevice == 0
+		|| config->characteristicsPerDevice > 0xFFFF - SIM_FIRST_CHARACTERISTIC || config->payloadSize > 512)
+	{
+		saveError(ErrorCode::INVALID_ARGUMENT, L"%ls:%d SimStart: invalid configuration.", __WFILE__, __LINE__);
+		return false;
+	}
+	SimStop();
+	Quit();
+	ResetQuit();
+
+	lock_guard guard(simLock);
+	simConfig = *config;
+	if (simConfig.mtu <= ATT_WRITE_HEADER)
+		simConfig.mtu = ATT_DEFAULT_MTU;
+	auto now = TimestampNs();
+	for (uint32_t i = 0; i < simConfig.devices; i++)
+	{
+		auto device = make_unique<SimDevice>();
+		device->address = SIM_ADDRESS_BASE | (i + 1);
+		swprintf(device->id, sizeof(device->id) / sizeof(device->id[0]),
+			L"SimulatedLE#SimulatedLE00:00:00:00:00:00-02:00:00:00:%02x:%02x", ((i + 1) >> 8) & 0xFF, (i + 1) & 0xFF);
+		device->characteristics.resize(simConfig.characteristicsPerDevice);
+		// spread the drops so that the devices don't all disconnect at once
+		device->nextDropNs = now + (uint64_t(simConfig.dropIntervalMs) * 1000000 * (i + 1)) / simConfig.devices;
+		simDevices.push_back(move(device));
+	}
+	simRunning.store(true, memory_order_release);
+	for (uint32_t i = 0; i < simDevices.size(); i++)
+		simDevices[i]->generator = thread(RunGenerator, simDevices[i].get(), i);
+	simWriteThread = thread(RunWriteCompletions);
+	clearError();
+	return true;
+}
+
+void SimStop()
+{
+	vector<unique_ptr<SimDevice>> devices;
+	{
+		lock_guard guard(simLock);
+		simRunning.store(false, memory_order_release);
+		for (auto& device : simDevices)
+			DropSubscriptions(*device);
+		devices.swap(simDevices);
+		simHandles.Clear();
+	}
+	{
+		lock_guard guard(simWriteLock);
+		simWriteSignal.notify_all();
+	}
+	for (auto& device : devices)
+		if (device->generator.joinable())
+			device->generator.join();
+	if (simWriteThread.joinable())
+		simWriteThread.join();
+
+	deque<SimPendingWrite> cancelled;
+	{
+		lock_guard guard(simWriteLock);
+		cancelled.swap(simWrites);
+	}
+	for (auto& write : cancelled)
+		write.done(WriteStatus::CANCELLED);
+}
+
+bool SimDropConnection(wchar_t* deviceId, uint32_t downMs)
+{
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr)
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d SimDropConnection: unknown device %ls.", __WFILE__, __LINE__, deviceId);
+			return false;
+		}
+		lock_guard deviceGuard(device->lock);
+		device->downUntilNs = TimestampNs() + max<uint64_t>(uint64_t(downMs) * 1000000, 1);
+	}
+	EnqueueConnectionUpdate(deviceId, SIM_DISCONNECTED);
+	return true;
+}
+
+// ---- the export surface of the DLL ----
+
+uint32_t GetRadios(RadioInfo* radios, uint32_t capacity)
+{
+	if (radios != nullptr && capacity > 0)
+	{
+		CopyString(radios[0].name, L"Simulated radio");
+		// RadioKind::Bluetooth, RadioState::On, RadioAccessStatus::Allowed
+		radios[0].kind = 3;
+		radios[0].state = 1;
+		radios[0].accessStatus = 1;
+	}
+	clearError();
+	return 1;
+}
+
+bool IsBluetoothAvailable()
+{
+	BLE_LOG(LogLevel::VERBOSE, BLE_LOG_RADIO, L"[BleWinrtDll]  - Name=\"Simulated radio\", Kind=3, State=1");
+	return true;
+}
+
+void StartDeviceScan(uint32_t /*seconds*/)
+{
+	OperationScope operation;
+	// as this is the first function that must be called, if Quit() was called before, assume here that the client wants to restart
+	ResetQuit();
+	clearError();
+	CompileScanFilter();
+
+	vector<DeviceUpdate> updates;
+	{
+		lock_guard guard(simLock);
+		for (size_t i = 0; i < simDevices.size(); i++)
+		{
+			auto& device = *simDevices[i];
+			DeviceObservation observation{};
+			auto& update = observation.update;
+			CopyString(update.id, device.id);
+			swprintf(update.name, sizeof(update.name) / sizeof(update.name[0]), L"Simulated %u", static_cast<unsigned>(i + 1));
+			update.nameUpdated = true;
+			update.isConnectable = true;
+			update.isConnectableUpdated = true;
+			observation.address = device.address;
+			{
+				lock_guard deviceGuard(device.lock);
+				observation.isConnected = device.connected;
+			}
+			observation.isConnectedUpdated = true;
+			MergeDevice(observation);
+			if (ScanFilterAccepts(observation))
+				updates.push_back(update);
+		}
+	}
+	simDeviceScan.Fill(updates);
+}
+
+void StopDeviceScan()
+{
+}
+
+bool StartAdvertisementScan(bool active)
+{
+	// can be the first call after Quit just like StartDeviceScan
+	ResetQuit();
+	clearError();
+	CompileScanFilter();
+	simActiveScan.store(active, memory_order_relaxed);
+	simAdvertising.store(true, memory_order_relaxed);
+	return true;
+}
+
+void StopAdvertisementScan()
+{
+	simAdvertising.store(false, memory_order_relaxed);
+}
+
+ScanStatus PollDevice(DeviceUpdate* device, bool /*block*/)
+{
+	return simDeviceScan.Poll(device);
+}
+
+// what the IsConnected updates of a device watcher do to the device table
+void MergeConnected(const wchar_t* deviceId, bool connected)
+{
+	DeviceObservation observation{};
+	CopyString(observation.update.id, deviceId);
+	observation.isConnected = connected;
+	observation.isConnectedUpdated = true;
+	MergeDevice(observation);
+}
+
+bool ConnectDevice(wchar_t* deviceId, bool /*block*/)
+{
+	OperationScope operation;
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr)
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d ConnectDeviceAsync: device not cached/available.", __WFILE__, __LINE__);
+			return false;
+		}
+		lock_guard deviceGuard(device->lock);
+		if (device->downUntilNs != 0)
+		{
+			saveError(ErrorCode::COMMUNICATION, L"%ls:%d ConnectDeviceAsync: probe failed with status %d.", __WFILE__, __LINE__, static_cast<int>(WriteStatus::UNREACHABLE));
+			return false;
+		}
+		if (device->connected)
+		{
+			clearError();
+			return true;
+		}
+		device->connected = true;
+	}
+	MergeConnected(deviceId, true);
+	EnqueueConnectionUpdate(deviceId, SIM_CONNECTED);
+	clearError();
+	return true;
+}
+
+bool DisconnectDevice(wchar_t* deviceId)
+{
+	OperationScope operation;
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr)
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d DisconnectDevice: device %ls not cached.", __WFILE__, __LINE__, deviceId);
+			return false;
+		}
+		DropSubscriptions(*device);
+		uint32_t index = static_cast<uint32_t>((device->address & 0xFFFFFFFFull) - 1);
+		simHandles.EraseIf([index](uint32_t, SimTarget& target) { return target.device == index; });
+		lock_guard deviceGuard(device->lock);
+		device->connected = false;
+	}
+	uint64_t address;
+	ParseDeviceAddress(deviceId, address);
+	ReleaseDevice(address);
+	MergeConnected(deviceId, false);
+	EnqueueConnectionUpdate(deviceId, SIM_DISCONNECTED);
+	clearError();
+	return true;
+}
+
+// what discovery finds on a simulated device, also to check a stored layout against
+GattServiceLayout SimLayout(size_t characteristicCount, bool describe)
+{
+	GattServiceLayout service;
+	service.uuid = SIM_SERVICE;
+	service.characteristicsKnown = true;
+	service.descriptionsKnown = describe;
+	for (size_t i = 0; i < characteristicCount; i++)
+	{
+		GattCharacteristicLayout characteristic;
+		characteristic.uuid = GuidCodec::FromShortUuid(SIM_FIRST_CHARACTERISTIC + static_cast<uint32_t>(i));
+		characteristic.properties = SIM_PROPERTIES;
+		if (describe)
+			characteristic.userDescription = L"Simulated characteristic " + to_wstring(i + 1);
+		characteristic.descriptors = { WellKnownUuids::ClientCharacteristicConfiguration };
+		service.characteristics.push_back(move(characteristic));
+	}
+	return service;
+}
+
+void ScanServices(wchar_t* deviceId)
+{
+	OperationScope operation;
+	uint64_t address;
+	size_t characteristicCount;
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr)
+		{
+			saveError(ErrorCode::COMMUNICATION, L"%ls:%d Failed to connect to device.", __WFILE__, __LINE__);
+			return;
+		}
+		address = device->address;
+		characteristicCount = device->characteristics.size();
+	}
+	vector<BleGuid> uuids;
+	if (LookupGattServices(address, uuids))
+	{
+		// a SimStart with another characteristicsPerDevice changes the layout behind the database's back
+		if (ShouldRevalidateGatt(address))
+			RevalidateGattLayout(address, { SimLayout(characteristicCount, false) });
+	}
+	else
+	{
+		uuids = { SIM_SERVICE };
+		StoreGattServices(address, uuids);
+	}
+	vector<Service> services(uuids.size());
+	for (size_t i = 0; i < uuids.size(); i++)
+		GuidCodec::Format(uuids[i], services[i].uuid, sizeof(services[i].uuid) / sizeof(services[i].uuid[0]));
+	simServiceScan.Fill(services);
+}
+
+ScanStatus PollService(Service* service, bool /*block*/)
+{
+	return simServiceScan.Poll(service);
+}
+
+void ScanCharacteristics(wchar_t* deviceId, wchar_t* serviceId)
+{
+	OperationScope operation;
+	// the descriptions are made up, so there is nothing to read concurrently
+	bool describe = CurrentDiscoveryOptions().readUserDescriptions;
+	uint64_t address;
+	size_t characteristicCount;
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr || GuidCodec::Parse(serviceId) != SIM_SERVICE)
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d No service found with uuid %ls", __WFILE__, __LINE__, serviceId);
+			return;
+		}
+		address = device->address;
+		characteristicCount = device->characteristics.size();
+	}
+	vector<GattCharacteristicLayout> layouts;
+	if (!LookupGattCharacteristics(address, SIM_SERVICE, describe, layouts))
+	{
+		layouts = SimLayout(characteristicCount, describe).characteristics;
+		StoreGattCharacteristics(address, SIM_SERVICE, describe, layouts);
+	}
+	vector<Characteristic> characteristics(layouts.size());
+	for (size_t i = 0; i < layouts.size(); i++)
+	{
+		auto& characteristic = characteristics[i];
+		GuidCodec::Format(layouts[i].uuid, characteristic.uuid, sizeof(characteristic.uuid) / sizeof(characteristic.uuid[0]));
+		if (describe)
+			CopyString(characteristic.userDescription, layouts[i].userDescription.c_str());
+	}
+	simCharacteristicScan.Fill(characteristics);
+}
+
+ScanStatus PollCharacteristic(Characteristic* characteristic, bool /*block*/)
+{
+	return simCharacteristicScan.Poll(characteristic);
+}
+
+uint32_t ResolveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+	OperationScope operation;
+	CharacteristicId id{ 0, GuidCodec::Parse(serviceId), GuidCodec::Parse(characteristicId) };
+	SimTarget target{};
+	{
+		lock_guard guard(simLock);
+		auto* device = FindDevice(deviceId);
+		if (device == nullptr)
+		{
+			saveError(ErrorCode::COMMUNICATION, L"%ls:%d Failed to connect to device.", __WFILE__, __LINE__);
+			return 0;
+		}
+		auto offset = GuidCodec::FromShortUuid(id.characteristic.Data1);
+		if (id.service != SIM_SERVICE || offset != id.characteristic || id.characteristic.Data1 < SIM_FIRST_CHARACTERISTIC
+			|| id.characteristic.Data1 - SIM_FIRST_CHARACTERISTIC >= device->characteristics.size())
+		{
+			saveError(ErrorCode::NOT_FOUND, L"%ls:%d No characteristic found with uuid %ls", __WFILE__, __LINE__, characteristicId);
+			return 0;
+		}
+		id.address = device->address;
+		target.device = static_cast<uint32_t>((device->address & 0xFFFFFFFFull) - 1);
+		target.characteristic = id.characteristic.Data1 - SIM_FIRST_CHARACTERISTIC;
+	}
+
+	auto handle = RegisterHandle(id, deviceId);
+	if (handle == 0)
+		return 0;
+	{
+		lock_guard guard(simLock);
+		simHandles.Insert(handle) = target;
+	}
+	SetMaxWritePayload(id.address, simConfig.mtu - ATT_WRITE_HEADER);
+	clearError();
+	return handle;
+}
+
+uint32_t SubscribeCharacteristicImpl(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, SubscriptionMode mode)
+{
+	OperationScope operation;
+	auto handle = ResolveCharacteristic(deviceId, serviceId, characteristicId);
+	if (handle == 0 || !SubscribeByHandle(handle, mode))
+		return 0;
+	return handle;
+}
+
+bool SubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, bool /*block*/)
+{
+	return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::QUEUED) != 0;
+}
+
+uint32_t SubscribeCharacteristicV2(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+	return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::QUEUED);
+}
+
+uint32_t SubscribeCharacteristicLatest(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+	return SubscribeCharacteristicImpl(deviceId, serviceId, characteristicId, SubscriptionMode::LATEST);
+}
+
+bool UnsubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId)
+{
+	OperationScope operation;
+	auto handle = ResolveCharacteristic(deviceId, serviceId, characteristicId);
+	return handle != 0 && UnsubscribeByHandle(handle);
+}
+
+bool SendData(BLEData* data, bool block)
+{
+	OperationScope operation;
+	auto handle = ResolveCharacteristic(data->deviceId, data->serviceUuid, data->characteristicUuid);
+	if (handle == 0)
+		return false;
+	// like the DLL, only a blocking call reports the outcome
+	return SendDataByHandle(handle, data->buf, data->size, block) && block;
+}
+
+void Quit()
+{
+	RequestQuit();
+	StopAdvertisementScan();
+	simDeviceScan.Clear();
+	simServiceScan.Clear();
+	simCharacteristicScan.Clear();
+	{
+		lock_guard guard(simLock);
+		for (auto& device : simDevices)
+		{
+			DropSubscriptions(*device);
+			lock_guard deviceGuard(device->lock);
+			device->connected = false;
+		}
+		simHandles.Clear();
+	}
+	ShutdownCore();
+}
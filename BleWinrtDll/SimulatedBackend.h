@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+#include "BleTypes.h"
+
+// In-process stand-in for real peripherals, linked instead of the WinRT adapter (see BleCore.h) so that the exported
+// API can be driven and load tested without a radio. Every simulated device exposes the service
+// 0000fff0-0000-1000-8000-00805f9b34fb with characteristicsPerDevice characteristics fff1, fff2, ... that notify at
+// notifyHz while subscribed and accept writes without response. Device ids have the shape of the WinRT ones and end in
+// the device address, e.g. SimulatedLE#SimulatedLE00:00:00:00:00:00-02:00:00:00:00:01 for the first device. While an
+// advertisement scan runs, devices that are in range and not connected advertise the service and manufacturer data
+// 0xFFFF followed by their index; active scans also get a scan response with the name.
+struct SimConfig {
+    uint32_t devices;
+    uint32_t characteristicsPerDevice;
+    // notifications per second and characteristic, 0 for none
+    uint32_t notifyHz;
+    // 0 completes writes before the backend returns
+    uint32_t writeLatencyUs;
+    // every device loses its connection this often, 0 for never
+    uint32_t dropIntervalMs;
+    // how long a device stays unreachable after a scheduled drop
+    uint32_t reconnectDelayMs;
+    uint16_t payloadSize;
+    uint16_t mtu;
+    // advertisements per second and device during an advertisement scan, 0 for none
+    uint32_t advertiseHz;
+};
+
+extern "C" {
+	// Creates the simulated devices and starts their notification threads, replacing a running simulation. Not to be
+	// called concurrently with the rest of the API.
+	BLE_API bool SimStart(SimConfig* config);
+
+	// Stops the simulation threads and fails writes that are still pending with WriteStatus::CANCELLED.
+	BLE_API void SimStop();
+
+	// Takes a device out of range for downMs, reported through PollConnection like a real link loss.
+	BLE_API bool SimDropConnection(wchar_t* deviceId, uint32_t downMs);
+}
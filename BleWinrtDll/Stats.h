@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Instrumentation primitives behind GetStats. Everything is a relaxed atomic: the values are statistics, so a snapshot
+// may mix counts from slightly different moments, and the instrumented paths pay one uncontended RMW per counter and
+// never take a lock.
+
+template <typename T>
+inline void AtomicMax(std::atomic<T>& target, T value)
+{
+    T current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+struct QueueCounter
+{
+    std::atomic<uint64_t> enqueued{ 0 };
+    std::atomic<uint64_t> dequeued{ 0 };
+    std::atomic<uint32_t> highWaterMark{ 0 };
+
+    // depth is the size of the queue after the push
+    void Enqueued(size_t depth)
+    {
+        enqueued.fetch_add(1, std::memory_order_relaxed);
+        AtomicMax(highWaterMark, static_cast<uint32_t>(depth));
+    }
+
+    // also for entries discarded without being polled, so that enqueued - dequeued stays the queue size
+    void Dequeued(size_t count = 1)
+    {
+        dequeued.fetch_add(count, std::memory_order_relaxed);
+    }
+};
+
+// Histogram with power of two buckets: bucket 0 counts values below 2, bucket i values in [2^i, 2^(i+1)) and the last
+// bucket everything beyond.
+template <size_t Buckets>
+class Log2Histogram
+{
+public:
+    static size_t BucketOf(uint64_t value)
+    {
+        size_t bucket = 0;
+        while (value > 1 && bucket + 1 < Buckets)
+        {
+            value >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    void Record(uint64_t value)
+    {
+        buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        AtomicMax(max, value);
+    }
+
+    void Snapshot(uint64_t (&outBuckets)[Buckets], uint64_t& outCount, uint64_t& outSum, uint64_t& outMax) const
+    {
+        for (size_t i = 0; i < Buckets; i++)
+            outBuckets[i] = buckets[i].load(std::memory_order_relaxed);
+        outCount = count.load(std::memory_order_relaxed);
+        outSum = sum.load(std::memory_order_relaxed);
+        outMax = max.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> buckets[Buckets] = {};
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> sum{ 0 };
+    std::atomic<uint64_t> max{ 0 };
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "BleCore.h"
+#include "FlatTable.h"
+
+// Owns the subscriptions of a backend and indexes them by characteristic, by handle and by device, so that
+// unsubscribing costs a lookup and tearing down a device only touches that device's subscriptions. Subscription must
+// have the members id (CharacteristicId) and handle (uint32_t), set before Add. Not thread-safe, callers lock around it.
+template <typename Subscription>
+class SubscriptionRegistry
+{
+public:
+    using Owned = std::unique_ptr<Subscription>;
+
+    // returns the subscription that was registered for the same characteristic before, if any
+    Owned Add(Owned subscription)
+    {
+        auto id = subscription->id;
+        auto handle = subscription->handle;
+        auto previous = Take(id);
+        byCharacteristic.Insert(id) = std::move(subscription);
+        byHandle.Insert(handle) = id;
+        byDevice.Insert(id.address).push_back(id);
+        return previous;
+    }
+
+    Owned Take(CharacteristicId const& id)
+    {
+        auto* entry = byCharacteristic.Find(id);
+        if (entry == nullptr)
+            return nullptr;
+        auto subscription = std::move(*entry);
+        byCharacteristic.Erase(id);
+        byHandle.Erase(subscription->handle);
+        if (auto* ids = byDevice.Find(id.address))
+        {
+            for (auto& other : *ids)
+            {
+                if (other == id)
+                {
+                    other = ids->back();
+                    ids->pop_back();
+                    break;
+                }
+            }
+            if (ids->empty())
+                byDevice.Erase(id.address);
+        }
+        return subscription;
+    }
+
+    Owned TakeHandle(uint32_t handle)
+    {
+        auto* id = byHandle.Find(handle);
+        if (id == nullptr)
+            return nullptr;
+        return Take(CharacteristicId(*id));
+    }
+
+    std::vector<Owned> TakeDevice(uint64_t address)
+    {
+        std::vector<Owned> taken;
+        auto* ids = byDevice.Find(address);
+        if (ids == nullptr)
+            return taken;
+        for (auto const& id : *ids)
+        {
+            auto* entry = byCharacteristic.Find(id);
+            byHandle.Erase((*entry)->handle);
+            taken.push_back(std::move(*entry));
+            byCharacteristic.Erase(id);
+        }
+        byDevice.Erase(address);
+        return taken;
+    }
+
+    std::vector<Owned> TakeAll()
+    {
+        std::vector<Owned> taken;
+        byCharacteristic.ForEach([&taken](CharacteristicId const&, Owned& subscription)
+        {
+            taken.push_back(std::move(subscription));
+        });
+        byCharacteristic.Clear();
+        byHandle.Clear();
+        byDevice.Clear();
+        return taken;
+    }
+
+    bool Empty() const { return byCharacteristic.Size() == 0; }
+
+private:
+    FlatTable<CharacteristicId, Owned> byCharacteristic;
+    FlatTable<uint32_t, CharacteristicId> byHandle;
+    // characteristics subscribed per device address
+    FlatTable<uint64_t, std::vector<CharacteristicId>> byDevice;
+};
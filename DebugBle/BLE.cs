@@ -67,6 +67,32 @@ public class BLE
         [DllImport("BleWinrtDll.dll", EntryPoint = "SubscribeCharacteristic", CharSet = CharSet.Unicode)]
         public static extern bool SubscribeCharacteristic(string deviceId, string serviceId, string characteristicId, bool block);
 
+        public enum SubscriptionMode { QUEUED, LATEST };
+
+        [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+        public struct PlanEntry
+        {
+            [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+            public string serviceUuid;
+            [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 100)]
+            public string characteristicUuid;
+            public SubscriptionMode mode;
+        };
+
+        public enum PlanStatus { SUBSCRIBED, RESOLVE_FAILED, SUBSCRIBE_FAILED, CANCELLED };
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct PlanEntryResult
+        {
+            public PlanStatus status;
+            public uint handle;
+            public ulong resolvedNs;
+            public ulong readyNs;
+        };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "ConnectWithPlan", CharSet = CharSet.Unicode)]
+        public static extern bool ConnectWithPlan(string deviceId, [In] PlanEntry[] entries, uint count, [Out] PlanEntryResult[] results, out ulong readyNs);
+
         [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
         public struct BLEData
         {
@@ -178,15 +204,24 @@ public class BLE
             Debug.Log("characteristic found: " + c.uuid + ", user description: " + c.userDescription);
     }
 
+    // subscribes all characteristics at once, see ConnectWithPlan
     public static bool Subscribe(string deviceId, string serviceUuid, string[] characteristicUuids)
     {
-        foreach (string characteristicUuid in characteristicUuids)
+        var entries = new Impl.PlanEntry[characteristicUuids.Length];
+        for (int i = 0; i < entries.Length; i++)
         {
-            bool res = Impl.SubscribeCharacteristic(deviceId, serviceUuid, characteristicUuid, true);
-            if (!res)
-                return false;
+            entries[i].serviceUuid = serviceUuid;
+            entries[i].characteristicUuid = characteristicUuids[i];
+            entries[i].mode = Impl.SubscriptionMode.QUEUED;
         }
-        return true;
+        var results = new Impl.PlanEntryResult[entries.Length];
+        ulong readyNs;
+        bool res = Impl.ConnectWithPlan(deviceId, entries, (uint)entries.Length, results, out readyNs);
+        for (int i = 0; i < results.Length; i++)
+            if (results[i].status != Impl.PlanStatus.SUBSCRIBED)
+                Debug.Log("subscribing " + characteristicUuids[i] + " failed: " + results[i].status);
+        Debug.Log("subscribed in " + readyNs / 1000000.0 + " ms");
+        return res;
     }
 
     public bool Connect(string deviceId, string serviceUuid, string[] characteristicUuids)
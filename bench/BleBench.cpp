@@ -0,0 +1,749 @@
+// BleBench.cpp : benchmarks of the exported hot paths on top of the simulated backend, results as JSON.
+//
+// BleBench [--quick] [--filter <name>] [--out <file>]
+//
+// Every result is one object with the benchmark name, its parameters and the measured values, so that runs of
+// different releases can be compared field by field. Baselines of replaced implementations (see LegacyBaselines.h)
+// are reported as separate benchmarks next to the current ones.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AdParser.h"
+#include "BleCore.h"
+#include "BleWinrtDll.h"
+#include "FlatTable.h"
+#include "LegacyBaselines.h"
+#include "SimulatedBackend.h"
+
+using namespace std;
+
+// rate that no generator reaches, see RunGenerator in SimulatedBackend.cpp
+constexpr uint32_t UNTHROTTLED_HZ = 4000000000u;
+constexpr uint16_t PAYLOAD_SIZE = 20;
+constexpr uint32_t PRODUCER_COUNTS[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+wchar_t serviceUuid[] = L"{0000fff0-0000-1000-8000-00805f9b34fb}";
+
+struct BenchOptions {
+	bool quick = false;
+	string filter;
+	uint32_t durationMs = 1000;
+	// scales the iteration counts of the micro benchmarks
+	uint32_t iterations = 1000000;
+} options;
+
+vector<string> results;
+// keeps the micro benchmarks from being optimized away
+volatile uint64_t sink;
+
+// ---- output ----
+
+class JsonRecord
+{
+public:
+	explicit JsonRecord(const char* benchmark)
+	{
+		text = "{\"benchmark\": \"";
+		text += benchmark;
+		text += "\"";
+	}
+
+	JsonRecord& Int(const char* name, uint64_t value)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%" PRIu64, value);
+		return Raw(name, buffer);
+	}
+
+	JsonRecord& Num(const char* name, double value)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.3f", value);
+		return Raw(name, buffer);
+	}
+
+	JsonRecord& Str(const char* name, const char* value)
+	{
+		return Raw(name, (string("\"") + value + "\"").c_str());
+	}
+
+	JsonRecord& Bool(const char* name, bool value)
+	{
+		return Raw(name, value ? "true" : "false");
+	}
+
+	JsonRecord& Raw(const char* name, const char* value)
+	{
+		text += ", \"";
+		text += name;
+		text += "\": ";
+		text += value;
+		return *this;
+	}
+
+	void Commit()
+	{
+		text += "}";
+		fprintf(stderr, "%s\n", text.c_str());
+		results.push_back(text);
+	}
+
+private:
+	string text;
+};
+
+// Reservoir of latency samples; keeps memory bounded however many notifications a run moves.
+class LatencySampler
+{
+public:
+	static constexpr size_t Capacity = 1 << 20;
+
+	void Add(uint64_t value)
+	{
+		seen++;
+		if (samples.size() < Capacity)
+			samples.push_back(value);
+		else if (auto slot = random() % seen; slot < Capacity)
+			samples[slot] = value;
+	}
+
+	// {"p50": .., "p90": .., "p99": .., "p999": .., "max": ..} in nanoseconds
+	string Percentiles()
+	{
+		if (samples.empty())
+			return "null";
+		sort(samples.begin(), samples.end());
+		auto at = [&](double q) { return samples[min(samples.size() - 1, static_cast<size_t>(q * samples.size()))]; };
+		char buffer[200];
+		snprintf(buffer, sizeof(buffer), "{\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+			at(0.5), at(0.9), at(0.99), at(0.999), samples.back());
+		return buffer;
+	}
+
+private:
+	vector<uint64_t> samples;
+	uint64_t seen = 0;
+	mt19937_64 random{ 42 };
+};
+
+bool Selected(const char* benchmark)
+{
+	return options.filter.empty() || strstr(benchmark, options.filter.c_str()) != nullptr;
+}
+
+double ElapsedNs(uint64_t startNs)
+{
+	return static_cast<double>(TimestampNs() - startNs);
+}
+
+template <typename Function>
+void Micro(const char* benchmark, const char* variant, uint32_t iterations, Function function)
+{
+	uint64_t checksum = 0;
+	auto startNs = TimestampNs();
+	for (uint32_t i = 0; i < iterations; i++)
+		checksum += function(i);
+	auto elapsedNs = ElapsedNs(startNs);
+	sink = checksum;
+	JsonRecord(benchmark).Str("variant", variant).Int("iterations", iterations).Num("nsPerOp", elapsedNs / iterations).Commit();
+}
+
+// ---- simulation helpers ----
+
+SimConfig MakeConfig(uint32_t devices, uint32_t characteristics, uint32_t notifyHz)
+{
+	SimConfig config{};
+	config.devices = devices;
+	config.characteristicsPerDevice = characteristics;
+	config.notifyHz = notifyHz;
+	config.payloadSize = PAYLOAD_SIZE;
+	config.mtu = 247;
+	return config;
+}
+
+void DeviceId(uint32_t index, wchar_t (&out)[100])
+{
+	swprintf(out, 100, L"SimulatedLE#SimulatedLE00:00:00:00:00:00-02:00:00:00:%02x:%02x", ((index + 1) >> 8) & 0xFF, (index + 1) & 0xFF);
+}
+
+void CharacteristicUuid(uint32_t index, wchar_t (&out)[GuidCodec::FormattedCapacity])
+{
+	GuidCodec::Format(GuidCodec::FromShortUuid(0xFFF1 + index), out, GuidCodec::FormattedCapacity);
+}
+
+bool StartSimulation(SimConfig config, DataQueueOptions queueOptions)
+{
+	if (!SimStart(&config) || !SetDataQueueOptions(&queueOptions)) {
+		ErrorMessage error;
+		GetError(&error);
+		fprintf(stderr, "simulation failed to start: %ls\n", error.msg);
+		return false;
+	}
+	return true;
+}
+
+// subscribes every characteristic of the simulation, returns the number of subscriptions
+uint32_t SubscribeAll(SimConfig const& config, SubscriptionMode mode = SubscriptionMode::QUEUED)
+{
+	uint32_t count = 0;
+	for (uint32_t d = 0; d < config.devices; d++) {
+		wchar_t deviceId[100];
+		DeviceId(d, deviceId);
+		for (uint32_t c = 0; c < config.characteristicsPerDevice; c++) {
+			wchar_t characteristicUuid[GuidCodec::FormattedCapacity];
+			CharacteristicUuid(c, characteristicUuid);
+			auto handle = mode == SubscriptionMode::LATEST
+				? SubscribeCharacteristicLatest(deviceId, serviceUuid, characteristicUuid)
+				: SubscribeCharacteristicV2(deviceId, serviceUuid, characteristicUuid);
+			count += handle != 0;
+		}
+	}
+	return count;
+}
+
+DataQueueOptions DefaultQueueOptions()
+{
+	return DataQueueOptions{ 4096, OverflowPolicy::DROP_NEWEST, 10 };
+}
+
+// ---- notification path ----
+
+// Producers are simulated devices with one characteristic each, the consumer drains with PollDataBatch like a frame
+// loop would. Unthrottled producers run into the BLOCK policy, so the throughput is what the consumer can take.
+void NotifyThroughput(const char* benchmark, uint32_t producers, uint32_t notifyHz, OverflowPolicy policy)
+{
+	auto config = MakeConfig(producers, 1, notifyHz);
+	DataQueueOptions queueOptions{ 4096, policy, 100 };
+	if (!StartSimulation(config, queueOptions))
+		return;
+	DataQueueStats before;
+	GetDataQueueStats(&before);
+	SubscribeAll(config);
+
+	static BLEDataV2 buffer[256];
+	LatencySampler latency;
+	uint64_t delivered = 0;
+	auto startNs = TimestampNs();
+	auto endNs = startNs + uint64_t(options.durationMs) * 1000000;
+	while (TimestampNs() < endNs) {
+		auto count = PollDataBatch(buffer, 256, 10);
+		for (uint32_t i = 0; i < count; i++)
+			latency.Add(buffer[i].dequeuedNs - buffer[i].receivedNs);
+		delivered += count;
+	}
+	auto elapsedNs = ElapsedNs(startNs);
+	SimStop();
+
+	DataQueueStats after;
+	GetDataQueueStats(&after);
+	JsonRecord(benchmark)
+		.Int("producers", producers)
+		.Int("notifyHz", notifyHz == UNTHROTTLED_HZ ? 0 : notifyHz)
+		.Int("durationMs", static_cast<uint64_t>(elapsedNs / 1e6))
+		.Int("delivered", delivered)
+		.Num("notificationsPerSec", delivered * 1e9 / elapsedNs)
+		.Int("dropped", (after.droppedNewest - before.droppedNewest) + (after.droppedOldest - before.droppedOldest))
+		.Int("blockedProducers", after.blockedProducers - before.blockedProducers)
+		.Raw("latencyNs", latency.Percentiles().c_str())
+		.Commit();
+}
+
+// The queue before BoundedRing (LegacyBaselines.h), driven like NotifyThroughput: producers build a full BLEData with
+// the three identity strings and push it under the mutex, the consumer pops one per lock. The legacy queue was
+// unbounded; producers here wait at 4096 entries so that the run doesn't measure the allocator.
+void LegacyNotifyThroughput(uint32_t producers)
+{
+	Legacy::DataQueue queue;
+	atomic<size_t> pending{ 0 };
+	atomic<bool> running{ true };
+	wchar_t deviceId[100];
+	DeviceId(0, deviceId);
+	wchar_t characteristicUuid[GuidCodec::FormattedCapacity];
+	CharacteristicUuid(0, characteristicUuid);
+
+	vector<thread> threads;
+	for (uint32_t p = 0; p < producers; p++) {
+		threads.emplace_back([&] {
+			uint8_t payload[PAYLOAD_SIZE] = {};
+			while (running.load(memory_order_relaxed)) {
+				if (pending.load(memory_order_relaxed) >= 4096) {
+					this_thread::yield();
+					continue;
+				}
+				BLEData data;
+				uint64_t receivedNs = TimestampNs();
+				data.size = PAYLOAD_SIZE;
+				memcpy(data.buf, payload, PAYLOAD_SIZE);
+				memcpy(data.buf, &receivedNs, sizeof(receivedNs));
+				wcscpy(data.deviceId, deviceId);
+				wcscpy(data.serviceUuid, serviceUuid);
+				wcscpy(data.characteristicUuid, characteristicUuid);
+				pending.fetch_add(1, memory_order_relaxed);
+				queue.Push(data);
+			}
+		});
+	}
+
+	static BLEData data;
+	LatencySampler latency;
+	uint64_t delivered = 0;
+	auto startNs = TimestampNs();
+	auto endNs = startNs + uint64_t(options.durationMs) * 1000000;
+	while (TimestampNs() < endNs) {
+		if (!queue.Poll(&data, false)) {
+			this_thread::yield();
+			continue;
+		}
+		pending.fetch_sub(1, memory_order_relaxed);
+		uint64_t receivedNs;
+		memcpy(&receivedNs, data.buf, sizeof(receivedNs));
+		latency.Add(TimestampNs() - receivedNs);
+		delivered++;
+	}
+	auto elapsedNs = ElapsedNs(startNs);
+	running = false;
+	for (auto& t : threads)
+		t.join();
+
+	JsonRecord("notify_throughput_legacy_queue")
+		.Int("producers", producers)
+		.Int("durationMs", static_cast<uint64_t>(elapsedNs / 1e6))
+		.Int("delivered", delivered)
+		.Num("notificationsPerSec", delivered * 1e9 / elapsedNs)
+		.Raw("latencyNs", latency.Percentiles().c_str())
+		.Commit();
+}
+
+enum class DrainMode { POLL_DATA, POLL_DATA_V2, BATCH };
+
+// Fills the queues of four subscriptions with 16384 entries each, stops the producers and measures the per
+// notification cost of draining them with the given call.
+void DrainCost(const char* variant, DrainMode mode, uint32_t batchSize)
+{
+	constexpr uint32_t capacity = 16384;
+	constexpr uint32_t subscriptions = 4;
+	auto config = MakeConfig(subscriptions, 1, UNTHROTTLED_HZ);
+	if (!StartSimulation(config, DataQueueOptions{ capacity, OverflowPolicy::DROP_NEWEST, 10 }))
+		return;
+	SubscribeAll(config);
+	auto deadline = TimestampNs() + 10000000000ull;
+	DataQueueStats stats;
+	do {
+		this_thread::sleep_for(chrono::milliseconds(1));
+		GetDataQueueStats(&stats);
+	} while (stats.size < capacity * subscriptions && TimestampNs() < deadline);
+	SimStop();
+
+	static BLEDataV2 buffer[256];
+	static BLEData legacy;
+	uint64_t drained = 0;
+	auto startNs = TimestampNs();
+	for (;;) {
+		uint32_t count;
+		if (mode == DrainMode::POLL_DATA)
+			count = PollData(&legacy, false) ? 1 : 0;
+		else if (mode == DrainMode::POLL_DATA_V2)
+			count = PollDataV2(buffer, false) ? 1 : 0;
+		else
+			count = PollDataBatch(buffer, batchSize, 0);
+		if (count == 0)
+			break;
+		drained += count;
+	}
+	auto elapsedNs = ElapsedNs(startNs);
+	auto defaults = DefaultQueueOptions();
+	SetDataQueueOptions(&defaults);
+
+	JsonRecord("poll_drain")
+		.Str("call", variant)
+		.Int("batchSize", batchSize)
+		.Int("drained", drained)
+		.Num("nsPerNotification", drained > 0 ? elapsedNs / drained : 0)
+		.Commit();
+}
+
+// Cost of one notification callback on the thread that raises it, without a consumer. The current callback hands
+// the payload to the sink bound at subscribe time; the legacy one (LegacyBaselines.h) formatted the characteristic's
+// identity on every call and pushed a full BLEData. The queued sink drops the oldest entry once its queue is full.
+void CallbackCost()
+{
+	auto config = MakeConfig(1, 1, 0);
+	if (!StartSimulation(config, DataQueueOptions{ 4096, OverflowPolicy::DROP_OLDEST, 10 }))
+		return;
+	wchar_t deviceId[100];
+	DeviceId(0, deviceId);
+	wchar_t characteristicUuid[GuidCodec::FormattedCapacity];
+	CharacteristicUuid(0, characteristicUuid);
+	auto handle = ResolveCharacteristic(deviceId, serviceUuid, characteristicUuid);
+	uint8_t payload[PAYLOAD_SIZE] = {};
+	auto n = options.iterations;
+
+	for (auto mode : { SubscriptionMode::QUEUED, SubscriptionMode::LATEST }) {
+		auto sink = MakeSink(handle, mode);
+		if (!sink)
+			continue;
+		Micro("notify_callback", mode == SubscriptionMode::QUEUED ? "NotificationSink queued" : "NotificationSink latest", n,
+			[&](uint32_t i) {
+				payload[0] = static_cast<uint8_t>(i);
+				sink->OnValue(TimestampNs(), payload, PAYLOAD_SIZE);
+				return 1;
+			});
+	}
+	SimStop();
+	Quit();
+
+	// the legacy queue was unbounded; it is emptied every 4096 notifications, which is part of the measurement
+	Legacy::DataQueue queue;
+	wstring legacyDeviceId = deviceId;
+	auto service = GuidCodec::Parse(serviceUuid);
+	auto characteristic = GuidCodec::Parse(characteristicUuid);
+	Micro("notify_callback", "legacy ValueChanged", n, [&](uint32_t i) {
+		payload[0] = static_cast<uint8_t>(i);
+		uint64_t receivedNs = TimestampNs();
+		Legacy::ValueChanged(queue, legacyDeviceId, service, characteristic, payload, PAYLOAD_SIZE);
+		if (i % 4096 == 4095)
+			queue.queue = {};
+		return receivedNs & 1;
+	});
+}
+
+// ---- write path ----
+
+void SendDataCost()
+{
+	auto config = MakeConfig(1, 1, 0);
+	if (!StartSimulation(config, DefaultQueueOptions()))
+		return;
+	uint32_t iterations = options.iterations / 10;
+
+	static BLEData data;
+	DeviceId(0, reinterpret_cast<wchar_t (&)[100]>(data.deviceId));
+	wcscpy(data.serviceUuid, serviceUuid);
+	wchar_t characteristicUuid[GuidCodec::FormattedCapacity];
+	CharacteristicUuid(0, characteristicUuid);
+	wcscpy(data.characteristicUuid, characteristicUuid);
+	data.size = PAYLOAD_SIZE;
+
+	auto startNs = TimestampNs();
+	for (uint32_t i = 0; i < iterations; i++)
+		SendData(&data, true);
+	JsonRecord("send_round_trip").Str("call", "SendData").Int("iterations", iterations)
+		.Num("nsPerCall", ElapsedNs(startNs) / iterations).Commit();
+
+	auto handle = ResolveCharacteristic(data.deviceId, data.serviceUuid, data.characteristicUuid);
+	startNs = TimestampNs();
+	for (uint32_t i = 0; i < iterations; i++)
+		SendDataByHandle(handle, data.buf, PAYLOAD_SIZE, true);
+	JsonRecord("send_round_trip").Str("call", "SendDataByHandle").Int("iterations", iterations)
+		.Num("nsPerCall", ElapsedNs(startNs) / iterations).Commit();
+
+	WriteOptions writeOptions{ 1, 256, false };
+	SetWriteOptions(&writeOptions);
+	WriteCompletion completion;
+	startNs = TimestampNs();
+	for (uint32_t i = 0; i < iterations; i++) {
+		QueueWrite(handle, data.buf, PAYLOAD_SIZE);
+		PollWriteCompletion(&completion, true);
+	}
+	JsonRecord("send_round_trip").Str("call", "QueueWrite+PollWriteCompletion").Int("iterations", iterations)
+		.Num("nsPerCall", ElapsedNs(startNs) / iterations).Commit();
+	SimStop();
+}
+
+// Writes of 8 bytes against a peripheral that takes writeLatencyUs per write: one blocking write at a time versus the
+// write engine with an in-flight window and optional coalescing.
+void WriteThroughput(uint32_t writeLatencyUs)
+{
+	constexpr uint16_t writeSize = 8;
+	auto config = MakeConfig(1, 1, 0);
+	config.writeLatencyUs = writeLatencyUs;
+	if (!StartSimulation(config, DefaultQueueOptions()))
+		return;
+	wchar_t deviceId[100];
+	DeviceId(0, deviceId);
+	wchar_t characteristicUuid[GuidCodec::FormattedCapacity];
+	CharacteristicUuid(0, characteristicUuid);
+	auto handle = ResolveCharacteristic(deviceId, serviceUuid, characteristicUuid);
+	uint8_t payload[writeSize] = {};
+
+	uint32_t sequential = max<uint32_t>(options.iterations / 1000, 100);
+	auto startNs = TimestampNs();
+	for (uint32_t i = 0; i < sequential; i++)
+		SendDataByHandle(handle, payload, writeSize, true);
+	auto elapsedNs = ElapsedNs(startNs);
+	JsonRecord("write_throughput").Str("call", "SendDataByHandle").Int("writeLatencyUs", writeLatencyUs)
+		.Int("writes", sequential).Num("writesPerSec", sequential * 1e9 / elapsedNs).Commit();
+
+	uint32_t queued = options.iterations / 50;
+	for (uint32_t window : { 1u, 4u, 16u }) {
+		for (bool coalesce : { false, true }) {
+			WriteOptions writeOptions{ window, 256, coalesce };
+			SetWriteOptions(&writeOptions);
+			BleStats before{};
+			before.size = sizeof(before);
+			GetStats(&before);
+
+			WriteCompletion completion;
+			uint32_t issued = 0;
+			uint32_t completed = 0;
+			startNs = TimestampNs();
+			while (completed < queued) {
+				// stays within maxQueued so that QueueWrite never reports a full queue
+				while (issued < queued && issued - completed < writeOptions.maxQueued && QueueWrite(handle, payload, writeSize) != 0)
+					issued++;
+				if (PollWriteCompletion(&completion, true))
+					completed++;
+			}
+			elapsedNs = ElapsedNs(startNs);
+
+			BleStats after{};
+			after.size = sizeof(after);
+			GetStats(&after);
+			JsonRecord("write_throughput").Str("call", "QueueWrite").Int("writeLatencyUs", writeLatencyUs)
+				.Int("maxInFlight", window).Bool("coalesce", coalesce).Int("writes", queued)
+				.Int("stackWrites", after.writeLatency.count - before.writeLatency.count)
+				.Num("writesPerSec", queued * 1e9 / elapsedNs).Commit();
+		}
+	}
+	WriteOptions defaults{ 4, 256, false };
+	SetWriteOptions(&defaults);
+	SimStop();
+}
+
+// ---- GUIDs and the characteristic cache ----
+
+void GuidCodecCost()
+{
+	constexpr uint32_t inputs = 64;
+	vector<wstring> braced;
+	mt19937_64 random(7);
+	for (uint32_t i = 0; i < inputs; i++) {
+		BleGuid g{ uint32_t(random()), uint16_t(random()), uint16_t(random()), {} };
+		for (auto& b : g.Data4)
+			b = uint8_t(random());
+		wchar_t text[GuidCodec::FormattedCapacity];
+		GuidCodec::Format(g, text, GuidCodec::FormattedCapacity);
+		braced.push_back(text);
+	}
+	auto n = options.iterations;
+	const auto mask = inputs - 1;
+
+	Micro("guid_parse", "GuidCodec::Parse", n, [&](uint32_t i) { return GuidCodec::Parse(braced[i & mask].c_str()).Data1; });
+	Micro("guid_parse", "GuidCodec::ParseCanonicalScalar", n, [&](uint32_t i) {
+		BleGuid g{};
+		GuidCodec::ParseCanonicalScalar(braced[i & mask].c_str() + 1, g);
+		return g.Data1;
+	});
+	Micro("guid_parse", "GuidCodec::ParseLenient", n, [&](uint32_t i) { return GuidCodec::ParseLenient(braced[i & mask].c_str()).Data1; });
+	Micro("guid_parse", "legacy make_guid", n, [&](uint32_t i) { return Legacy::make_guid(braced[i & mask].c_str()).buf[0]; });
+
+	vector<BleGuid> guids;
+	for (auto const& text : braced)
+		guids.push_back(GuidCodec::Parse(text.c_str()));
+	Micro("guid_format", "GuidCodec::Format", n, [&](uint32_t i) {
+		wchar_t text[GuidCodec::FormattedCapacity];
+		GuidCodec::Format(guids[i & mask], text, GuidCodec::FormattedCapacity);
+		return Legacy::hsh(text);
+	});
+	Micro("guid_format", "swprintf", n, [&](uint32_t i) {
+		auto const& g = guids[i & mask];
+		wchar_t text[GuidCodec::FormattedCapacity];
+		swprintf(text, GuidCodec::FormattedCapacity, L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+			g.Data1, g.Data2, g.Data3, g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+		return Legacy::hsh(text);
+	});
+}
+
+// 16 devices with 4 services of 8 characteristics; every lookup starts from the three strings of the API
+void CacheLookupCost()
+{
+	struct Key {
+		wchar_t deviceId[100];
+		wchar_t serviceId[GuidCodec::FormattedCapacity];
+		wchar_t characteristicId[GuidCodec::FormattedCapacity];
+	};
+	vector<Key> keys;
+	Legacy::Cache legacyCache;
+	FlatTable<CharacteristicId, int> cache;
+	for (uint32_t d = 0; d < 16; d++)
+		for (uint32_t s = 0; s < 4; s++)
+			for (uint32_t c = 0; c < 8; c++) {
+				Key key;
+				DeviceId(d, key.deviceId);
+				GuidCodec::Format(GuidCodec::FromShortUuid(0x1800 + s), key.serviceId, GuidCodec::FormattedCapacity);
+				GuidCodec::Format(GuidCodec::FromShortUuid(0x2A00 + c), key.characteristicId, GuidCodec::FormattedCapacity);
+				int value = static_cast<int>(keys.size()) + 1;
+				legacyCache[Legacy::hsh(key.deviceId)].services[Legacy::hsh(key.serviceId)]
+					.characteristics[Legacy::hsh(key.characteristicId)].characteristic = value;
+				CharacteristicId id{ 0, GuidCodec::Parse(key.serviceId), GuidCodec::Parse(key.characteristicId) };
+				ParseDeviceAddress(key.deviceId, id.address);
+				cache.Insert(id) = value;
+				keys.push_back(key);
+			}
+	auto n = options.iterations;
+	auto count = static_cast<uint32_t>(keys.size());
+
+	Micro("device_key", "legacy hsh", n, [&](uint32_t i) { return uint64_t(Legacy::hsh(keys[i % count].deviceId)); });
+	Micro("device_key", "ParseDeviceAddress", n, [&](uint32_t i) {
+		uint64_t address = 0;
+		ParseDeviceAddress(keys[i % count].deviceId, address);
+		return address;
+	});
+	Micro("cache_lookup", "legacy nested map", n, [&](uint32_t i) {
+		auto const& key = keys[i % count];
+		return uint64_t(Legacy::LookupCharacteristic(legacyCache, key.deviceId, key.serviceId, key.characteristicId));
+	});
+	Micro("cache_lookup", "FlatTable", n, [&](uint32_t i) {
+		auto const& key = keys[i % count];
+		CharacteristicId id{ 0, GuidCodec::Parse(key.serviceId), GuidCodec::Parse(key.characteristicId) };
+		ParseDeviceAddress(key.deviceId, id.address);
+		auto* value = cache.Find(id);
+		return uint64_t(value != nullptr ? *value : 0);
+	});
+}
+
+// ---- advertisements ----
+
+// recorded payloads: an iBeacon, an Eddystone-URL frame and the advertisement and scan response of a simulated device
+const vector<vector<uint8_t>> RECORDED_ADVERTISEMENTS = {
+	{ 0x02, 0x01, 0x06, 0x1A, 0xFF, 0x4C, 0x00, 0x02, 0x15, 0xE2, 0xC5, 0x6D, 0xB5, 0xDF, 0xFB, 0x48, 0xD2, 0xB0, 0x60,
+		0xD0, 0xF5, 0xA7, 0x10, 0x96, 0xE0, 0x00, 0x01, 0x00, 0x02, 0xC5 },
+	{ 0x02, 0x01, 0x06, 0x03, 0x03, 0xAA, 0xFE, 0x10, 0x16, 0xAA, 0xFE, 0x10, 0xEB, 0x03, 'e', 'x', 'a', 'm', 'p', 'l',
+		'e', 0x07, 0x00, 0x00 },
+	{ 0x02, 0x01, 0x06, 0x03, 0x03, 0xF0, 0xFF, 0x02, 0x0A, 0xF8, 0x05, 0xFF, 0xFF, 0xFF, 0x01, 0x00 },
+	{ 0x0C, 0x09, 'S', 'i', 'm', 'u', 'l', 'a', 't', 'e', 'd', ' ', '1' },
+};
+
+void AdvertisementCost()
+{
+	auto const& recorded = RECORDED_ADVERTISEMENTS;
+	auto n = options.iterations;
+	Micro("ad_parse", "AdParser::ParseAdvertisement", n, [&](uint32_t i) {
+		auto const& payload = recorded[i % recorded.size()];
+		AdParser::Advertisement parsed;
+		AdParser::ParseAdvertisement(payload.data(), payload.size(), parsed);
+		return parsed.name.size + parsed.manufacturerData.offset + parsed.flags;
+	});
+
+	// parse, copy into the queue and take it out again in batches, as a consumer of a busy scan would
+	ResetQuit();
+	constexpr uint32_t BATCH = 64;
+	vector<AdvertisementRecord> batch(BATCH);
+	Micro("ad_parse", "PublishAdvertisement+PollAdvertisements", n, [&](uint32_t i) {
+		auto const& payload = recorded[i % recorded.size()];
+		PublishAdvertisement(0x020000000000ull + i % 256, -60, 0, payload.data(), payload.size(), TimestampNs());
+		return (i % BATCH == BATCH - 1) ? PollAdvertisements(batch.data(), BATCH, 0) : 0u;
+	});
+	while (PollAdvertisements(batch.data(), BATCH, 0) > 0) {
+	}
+}
+
+// ---- teardown ----
+
+void QuitTeardown(uint32_t subscriptions)
+{
+	constexpr uint32_t perDevice = 8;
+	auto config = MakeConfig(subscriptions / perDevice, perDevice, 0);
+	if (!StartSimulation(config, DefaultQueueOptions()))
+		return;
+	auto startNs = TimestampNs();
+	auto subscribed = SubscribeAll(config);
+	auto subscribeNs = ElapsedNs(startNs);
+
+	startNs = TimestampNs();
+	Quit();
+	auto quitNs = ElapsedNs(startNs);
+	SimStop();
+
+	JsonRecord("quit_teardown")
+		.Int("subscriptions", subscribed)
+		.Num("subscribeNsPerCall", subscribeNs / max<uint32_t>(subscribed, 1))
+		.Num("quitUs", quitNs / 1e3)
+		.Commit();
+}
+
+int main(int argc, char** argv)
+{
+	const char* outPath = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0)
+			options.quick = true;
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else {
+			fprintf(stderr, "usage: BleBench [--quick] [--filter <name>] [--out <file>]\n");
+			return 2;
+		}
+	}
+	if (options.quick) {
+		options.durationMs = 200;
+		options.iterations = 200000;
+	}
+
+	if (Selected("notify_throughput")) {
+		for (auto producers : PRODUCER_COUNTS)
+			NotifyThroughput("notify_throughput", producers, UNTHROTTLED_HZ, OverflowPolicy::BLOCK);
+		for (auto producers : PRODUCER_COUNTS)
+			LegacyNotifyThroughput(producers);
+	}
+	if (Selected("notify_latency"))
+		for (auto producers : PRODUCER_COUNTS)
+			NotifyThroughput("notify_latency", producers, 1000, OverflowPolicy::DROP_NEWEST);
+	if (Selected("poll_drain")) {
+		DrainCost("PollData", DrainMode::POLL_DATA, 1);
+		DrainCost("PollDataV2", DrainMode::POLL_DATA_V2, 1);
+		for (uint32_t batchSize : { 1u, 16u, 256u })
+			DrainCost("PollDataBatch", DrainMode::BATCH, batchSize);
+	}
+	if (Selected("notify_callback"))
+		CallbackCost();
+	if (Selected("send_round_trip"))
+		SendDataCost();
+	if (Selected("write_throughput"))
+		WriteThroughput(200);
+	if (Selected("guid"))
+		GuidCodecCost();
+	if (Selected("cache_lookup") || Selected("device_key"))
+		CacheLookupCost();
+	if (Selected("ad_parse"))
+		AdvertisementCost();
+	if (Selected("quit_teardown")) {
+		// every 8 subscriptions add a simulated device with its own generator thread, which makes the larger cases
+		// take minutes on small runners
+		vector<uint32_t> subscriptionCounts = { 64, 256 };
+		if (!options.quick)
+			subscriptionCounts.insert(subscriptionCounts.end(), { 1024, 4096 });
+		for (auto subscriptions : subscriptionCounts)
+			QuitTeardown(subscriptions);
+	}
+
+	FILE* out = outPath != nullptr ? fopen(outPath, "w") : stdout;
+	if (out == nullptr) {
+		fprintf(stderr, "can't write %s\n", outPath);
+		return 1;
+	}
+#ifdef BLE_GUID_SSE2
+	const bool simd = true;
+#else
+	const bool simd = false;
+#endif
+	fprintf(out, "{\n  \"suite\": \"BleBench\",\n  \"version\": 1,\n  \"quick\": %s,\n  \"hardwareThreads\": %u,\n  \"sse2\": %s,\n  \"results\": [\n",
+		options.quick ? "true" : "false", thread::hardware_concurrency(), simd ? "true" : "false");
+	for (size_t i = 0; i < results.size(); i++)
+		fprintf(out, "    %s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+
+#include "BleTypes.h"
+#include "GuidCodec.h"
+
+// The implementations the current code replaced, kept verbatim where possible so that BleBench can report the
+// improvement next to every measurement. WinRT types are swapped for plain values, everything else is as it was.
+namespace Legacy
+{
+    // make_guid before GuidCodec: one pass over the string, digits placed through a byte order table
+    struct Guid { uint8_t buf[16]; };
+
+    // BYTE_ORDER in the original, renamed because glibc defines a macro of that name
+    const uint8_t GUID_BYTE_ORDER[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+    inline Guid make_guid(const wchar_t* value)
+    {
+        Guid to_guid;
+        memset(&to_guid, 0, sizeof(to_guid));
+        int offset = 0;
+        for (size_t i = 0; i < wcslen(value); i++) {
+            if (value[i] >= '0' && value[i] <= '9')
+            {
+                uint8_t digit = value[i] - '0';
+                to_guid.buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+                offset++;
+            }
+            else if (value[i] >= 'A' && value[i] <= 'F')
+            {
+                uint8_t digit = 10 + value[i] - 'A';
+                to_guid.buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+                offset++;
+            }
+            else if (value[i] >= 'a' && value[i] <= 'f')
+            {
+                uint8_t digit = 10 + value[i] - 'a';
+                to_guid.buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+                offset++;
+            }
+        }
+        return to_guid;
+    }
+
+    // using hashes of uuids to omit storing the c-strings in reliable storage
+    inline long hsh(const wchar_t* wstr)
+    {
+        long hash = 5381;
+        int c;
+        while ((c = *wstr++))
+            hash = ((hash << 5) + hash) + c;
+        return hash;
+    }
+
+    // the three level cache keyed by hsh, with the lookup sequence of retrieveCharacteristic (count, then index)
+    struct CharacteristicCacheEntry { int characteristic = 0; };
+    struct ServiceCacheEntry { std::map<long, CharacteristicCacheEntry> characteristics; };
+    struct DeviceCacheEntry { std::map<long, ServiceCacheEntry> services; };
+    using Cache = std::map<long, DeviceCacheEntry>;
+
+    inline int LookupCharacteristic(Cache& cache, const wchar_t* deviceId, const wchar_t* serviceId, const wchar_t* characteristicId)
+    {
+        if (cache[hsh(deviceId)].services[hsh(serviceId)].characteristics.count(hsh(characteristicId)))
+            return cache[hsh(deviceId)].services[hsh(serviceId)].characteristics[hsh(characteristicId)].characteristic;
+        return 0;
+    }
+
+    // the notification queue before BoundedRing: every push and pop takes the mutex, and every push signals
+    struct DataQueue {
+        std::queue<BLEData> queue;
+        std::mutex lock;
+        std::condition_variable signal;
+
+        void Push(BLEData const& data)
+        {
+            std::lock_guard queueGuard(lock);
+            queue.push(data);
+            signal.notify_one();
+        }
+
+        bool Poll(BLEData* data, bool block)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (block && queue.empty())
+                signal.wait(guard);
+            if (queue.empty())
+                return false;
+            *data = queue.front();
+            queue.pop();
+            return true;
+        }
+
+        size_t Size()
+        {
+            std::lock_guard queueGuard(lock);
+            return queue.size();
+        }
+    };
+
+    // Characteristic_ValueChanged before the subscriptions bound their sink: the identity of the characteristic was
+    // queried and formatted again for every notification. The results of the three WinRT calls (Uuid, Service().Uuid,
+    // Service().Device().DeviceId) are passed in, to_hstring is stood in for by swprintf.
+    inline void ValueChanged(DataQueue& queue, std::wstring const& deviceId, BleGuid const& service,
+        BleGuid const& characteristic, const uint8_t* payload, uint16_t size)
+    {
+        auto format = [](BleGuid const& g, wchar_t* out, size_t capacity)
+        {
+            swprintf(out, capacity, L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}", g.Data1, g.Data2, g.Data3,
+                g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+        };
+        BLEData data;
+        data.size = size;
+        memcpy(data.buf, payload, size);
+        wchar_t serviceUuid[100];
+        wchar_t characteristicUuid[100];
+        format(service, serviceUuid, 100);
+        format(characteristic, characteristicUuid, 100);
+        std::wstring deviceIdCopy = deviceId;
+        wcscpy(data.characteristicUuid, characteristicUuid);
+        wcscpy(data.serviceUuid, serviceUuid);
+        wcscpy(data.deviceId, deviceIdCopy.c_str());
+        queue.Push(data);
+    }
+}
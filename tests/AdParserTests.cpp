@@ -0,0 +1,269 @@
+// AdParserTests.cpp : the AD structure parser on recorded advertising and scan response payloads, see AdParser.h.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "AdParser.h"
+#include "Check.h"
+
+using namespace std;
+
+namespace
+{
+    template <size_t N>
+    AdParser::Advertisement Parse(const uint8_t (&payload)[N], bool expectValid = true)
+    {
+        AdParser::Advertisement ad;
+        CHECK(AdParser::ParseAdvertisement(payload, N, ad) == expectValid);
+        CHECK(ad.malformed == !expectValid);
+        return ad;
+    }
+
+    string Text(const uint8_t* payload, AdParser::Field const& field)
+    {
+        return string(reinterpret_cast<const char*>(payload) + field.offset, field.size);
+    }
+
+    bool Bytes(const uint8_t* payload, AdParser::Field const& field, initializer_list<uint8_t> expected)
+    {
+        return field.size == expected.size() && memcmp(payload + field.offset, expected.begin(), expected.size()) == 0;
+    }
+
+    // heart rate sensor: flags, complete 16-bit service list, TX power, complete name
+    void HeartRateSensor()
+    {
+        const uint8_t payload[] = {
+            0x02, 0x01, 0x06,
+            0x05, 0x03, 0x0D, 0x18, 0x0A, 0x18,
+            0x02, 0x0A, 0xF4,
+            0x08, 0x09, 'H', 'R', 'M', ' ', 'P', 'r', 'o',
+        };
+        auto ad = Parse(payload);
+        CHECK(ad.hasFlags && ad.flags == 0x06);
+        CHECK(ad.hasTxPower && ad.txPower == -12);
+        CHECK(ad.completeName && Text(payload, ad.name) == "HRM Pro");
+        CHECK(Bytes(payload, ad.uuid16, { 0x0D, 0x18, 0x0A, 0x18 }));
+        CHECK(!ad.uuid32.Present() && !ad.uuid128.Present());
+        CHECK(!ad.serviceData.Present() && !ad.manufacturerData.Present());
+    }
+
+    // Apple iBeacon: flags and manufacturer data with company 0x004C
+    void IBeacon()
+    {
+        const uint8_t payload[] = {
+            0x02, 0x01, 0x1A,
+            0x1A, 0xFF, 0x4C, 0x00, 0x02, 0x15,
+            0xF7, 0x82, 0x6D, 0xA6, 0x4F, 0xA2, 0x4E, 0x98, 0x80, 0x24, 0xBC, 0x5B, 0x71, 0xE0, 0x89, 0x3E,
+            0x00, 0x01, 0x00, 0x02, 0xC5,
+        };
+        auto ad = Parse(payload);
+        CHECK(ad.flags == 0x1A);
+        CHECK(ad.manufacturerData.size == 25);
+        CHECK(AdParser::ReadUint16(payload + ad.manufacturerData.offset) == 0x004C);
+        CHECK(payload[ad.manufacturerData.offset + 2] == 0x02);
+        CHECK(!ad.name.Present() && !ad.hasTxPower);
+    }
+
+    // Eddystone-UID: incomplete 16-bit list, service data of 0xFEAA, and the scan response of the same beacon with
+    // 32- and 128-bit lists
+    void EddystoneWithScanResponse()
+    {
+        const uint8_t payload[] = {
+            0x02, 0x01, 0x06,
+            0x03, 0x02, 0xAA, 0xFE,
+            0x17, 0x16, 0xAA, 0xFE, 0x00, 0xEE,
+            0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+            0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x00, 0x00,
+        };
+        auto ad = Parse(payload);
+        CHECK(Bytes(payload, ad.uuid16, { 0xAA, 0xFE }));
+        CHECK(ad.serviceDataUuidSize == 2);
+        CHECK(ad.serviceData.size == 22);
+        CHECK(AdParser::ReadUint16(payload + ad.serviceData.offset) == 0xFEAA);
+
+        const uint8_t scanResponse[] = {
+            0x09, 0x04, 0x78, 0x56, 0x34, 0x12, 0x21, 0x43, 0x65, 0x87,
+            0x11, 0x07, 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0xF0, 0xFF, 0x00, 0x00,
+            0x05, 0x08, 'B', 'e', 'a', 'c',
+        };
+        auto response = Parse(scanResponse);
+        CHECK(Bytes(scanResponse, response.uuid32, { 0x78, 0x56, 0x34, 0x12, 0x21, 0x43, 0x65, 0x87 }));
+        CHECK(response.uuid128.size == 16 && scanResponse[response.uuid128.offset + 12] == 0xF0);
+        CHECK(!response.completeName && Text(scanResponse, response.name) == "Beac");
+    }
+
+    // the remaining list types, and only the first structure of a repeated type counts
+    void CompleteListsAndRepeats()
+    {
+        const uint8_t payload[] = {
+            0x02, 0x01, 0x05,
+            0x02, 0x01, 0x06,
+            0x03, 0x03, 0x0F, 0x18,
+            0x03, 0x02, 0x10, 0x18,
+            0x05, 0x05, 0x01, 0x02, 0x03, 0x04,
+            0x11, 0x06, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+            0x02, 0x0A, 0x04,
+            0x02, 0x0A, 0x08,
+            0x03, 0xFF, 0x59, 0x00,
+            0x04, 0xFF, 0x4C, 0x00, 0x01,
+            0x03, 0x19, 0x40, 0x03,     // appearance, not handled
+        };
+        auto ad = Parse(payload);
+        CHECK(ad.flags == 0x05);
+        CHECK(ad.txPower == 4);
+        CHECK(Bytes(payload, ad.uuid16, { 0x0F, 0x18 }));
+        CHECK(Bytes(payload, ad.uuid32, { 0x01, 0x02, 0x03, 0x04 }));
+        CHECK(ad.uuid128.size == 16 && payload[ad.uuid128.offset] == 0x00);
+        CHECK(Bytes(payload, ad.manufacturerData, { 0x59, 0x00 }));
+    }
+
+    // the complete name wins over a shortened one, in either order
+    void CompleteNameOverridesShortened()
+    {
+        const uint8_t shortenedFirst[] = {
+            0x04, 0x08, 'T', 'h', 'e',
+            0x0A, 0x09, 'T', 'h', 'e', 'r', 'm', 'o', ' ', '4', '2',
+            0x04, 0x08, 'X', 'y', 'z',
+        };
+        auto ad = Parse(shortenedFirst);
+        CHECK(ad.completeName && Text(shortenedFirst, ad.name) == "Thermo 42");
+
+        const uint8_t completeFirst[] = {
+            0x05, 0x09, 'L', 'a', 'm', 'p',
+            0x03, 0x08, 'L', 'a',
+            0x05, 0x09, 'O', 't', 'h', 'r',
+        };
+        ad = Parse(completeFirst);
+        CHECK(ad.completeName && Text(completeFirst, ad.name) == "Lamp");
+    }
+
+    // legacy advertisements are padded to 31 bytes with zeros; parsing stops at the first zero length
+    void ZeroLengthPadding()
+    {
+        uint8_t payload[31] = {
+            0x02, 0x01, 0x06,
+            0x04, 0x09, 'P', 'a', 'd',
+        };
+        // garbage after the padding must not be read
+        payload[20] = 0x05;
+        payload[21] = 0xFF;
+        auto ad = Parse(payload);
+        CHECK(ad.flags == 0x06);
+        CHECK(Text(payload, ad.name) == "Pad");
+        CHECK(!ad.manufacturerData.Present());
+
+        const uint8_t onlyPadding[31] = {};
+        ad = Parse(onlyPadding);
+        CHECK(!ad.hasFlags && !ad.name.Present());
+
+        AdParser::Advertisement empty;
+        CHECK(AdParser::ParseAdvertisement(payload, 0, empty) && !empty.malformed);
+    }
+
+    // a structure that claims more bytes than are left: malformed, but what came before is kept
+    void TruncatedStructure()
+    {
+        const uint8_t payload[] = {
+            0x02, 0x01, 0x06,
+            0x03, 0x03, 0x0D, 0x18,
+            0x05, 0x09, 'C', 'u', 't',
+        };
+        auto ad = Parse(payload, false);
+        CHECK(ad.hasFlags && ad.flags == 0x06);
+        CHECK(Bytes(payload, ad.uuid16, { 0x0D, 0x18 }));
+        CHECK(!ad.name.Present());
+
+        // the length byte is the last byte of the payload
+        const uint8_t lengthOnly[] = { 0x02, 0x0A, 0x07, 0x03 };
+        ad = Parse(lengthOnly, false);
+        CHECK(ad.hasTxPower && ad.txPower == 7);
+
+        AdParser::Reader reader(payload, sizeof(payload));
+        AdParser::Structure structure;
+        int count = 0;
+        while (reader.Next(structure))
+            count++;
+        CHECK(count == 2 && reader.Malformed());
+        CHECK(!reader.Next(structure));
+    }
+
+    // service data of every UUID size, and service data too short to hold its UUID, which is ignored
+    void ServiceData()
+    {
+        const uint8_t data16[] = { 0x05, 0x16, 0x0F, 0x18, 0x64, 0x01 };
+        auto ad = Parse(data16);
+        CHECK(ad.serviceDataUuidSize == 2 && Bytes(data16, ad.serviceData, { 0x0F, 0x18, 0x64, 0x01 }));
+
+        const uint8_t data32[] = { 0x06, 0x20, 0x78, 0x56, 0x34, 0x12, 0x2A };
+        ad = Parse(data32);
+        CHECK(ad.serviceDataUuidSize == 4 && Bytes(data32, ad.serviceData, { 0x78, 0x56, 0x34, 0x12, 0x2A }));
+
+        const uint8_t data128[] = {
+            0x12, 0x21, 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0xF0, 0xFF, 0x00, 0x00, 0x99,
+        };
+        ad = Parse(data128);
+        CHECK(ad.serviceDataUuidSize == 16 && ad.serviceData.size == 17);
+        CHECK(data128[ad.serviceData.offset + 16] == 0x99);
+
+        // a UUID without data is still service data
+        const uint8_t uuidOnly[] = { 0x03, 0x16, 0xAA, 0xFE };
+        ad = Parse(uuidOnly);
+        CHECK(ad.serviceDataUuidSize == 2 && ad.serviceData.size == 2);
+
+        // too short for their UUID: skipped, and a later valid structure is taken instead
+        const uint8_t shortData[] = {
+            0x02, 0x16, 0x0F,
+            0x04, 0x20, 0x78, 0x56, 0x34,
+            0x0A, 0x21, 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00,
+            0x04, 0x16, 0x0A, 0x18, 0x01,
+        };
+        ad = Parse(shortData);
+        CHECK(ad.serviceDataUuidSize == 2 && Bytes(shortData, ad.serviceData, { 0x0A, 0x18, 0x01 }));
+
+        const uint8_t onlyShort[] = { 0x02, 0x16, 0x0F, 0x01, 0x20 };
+        ad = Parse(onlyShort);
+        CHECK(!ad.serviceData.Present() && ad.serviceDataUuidSize == 0);
+    }
+
+    // manufacturer data needs at least the company identifier
+    void ShortManufacturerData()
+    {
+        const uint8_t payload[] = {
+            0x02, 0xFF, 0x4C,
+            0x01, 0xFF,
+            0x05, 0xFF, 0x59, 0x00, 0xBE, 0xEF,
+        };
+        auto ad = Parse(payload);
+        CHECK(Bytes(payload, ad.manufacturerData, { 0x59, 0x00, 0xBE, 0xEF }));
+
+        const uint8_t onlyShort[] = { 0x02, 0xFF, 0x4C, 0x01, 0xFF };
+        ad = Parse(onlyShort);
+        CHECK(!ad.manufacturerData.Present());
+    }
+
+    // flags and TX power without data are ignored rather than read past their structure
+    void EmptyStructures()
+    {
+        const uint8_t payload[] = { 0x01, 0x01, 0x01, 0x0A, 0x01, 0x09, 0x02, 0x01, 0x04 };
+        auto ad = Parse(payload);
+        CHECK(ad.hasFlags && ad.flags == 0x04);
+        CHECK(!ad.hasTxPower);
+        CHECK(ad.completeName && ad.name.size == 0);
+    }
+}
+
+int main()
+{
+    HeartRateSensor();
+    IBeacon();
+    EddystoneWithScanResponse();
+    CompleteListsAndRepeats();
+    CompleteNameOverridesShortened();
+    ZeroLengthPadding();
+    TruncatedStructure();
+    ServiceData();
+    ShortManufacturerData();
+    EmptyStructures();
+    return CheckResult("AdParserTests");
+}
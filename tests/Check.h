@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal assertions for the test executables: a failed check is reported with its location and makes the test exit
+// with a non-zero status, but the remaining checks still run.
+inline int& CheckFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            CheckFailures()++; \
+        } \
+    } while (0)
+
+inline int CheckResult(const char* name)
+{
+    if (CheckFailures() == 0)
+        std::printf("%s: all checks passed\n", name);
+    else
+        std::printf("%s: %d checks failed\n", name, CheckFailures());
+    return CheckFailures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+// GattCacheTests.cpp : the file of the persistent GATT database, written, reloaded and damaged, see GattCache.cpp.
+
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "BleCore.h"
+#include "BleWinrtDll.h"
+#include "Check.h"
+#include "GuidCodec.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    // the file format of GattCache.cpp
+    constexpr size_t HEADER_SIZE = 40;
+    constexpr size_t VERSION_OFFSET = 8;
+    constexpr size_t SERVICE_COUNT_OFFSET = 20;
+    constexpr size_t CHECKSUM_OFFSET = 36;
+    constexpr size_t FIRST_DEVICE_SERVICE_OFFSET = HEADER_SIZE + 8;
+
+    constexpr uint64_t Sensor = 0xC0FFEE000001ull;
+    constexpr uint64_t Other = 0xC0FFEE000002ull;
+    const BleGuid HeartRate = GuidCodec::FromShortUuid(0x180D);
+    const BleGuid Battery = GuidCodec::FromShortUuid(0x180F);
+    const BleGuid Measurement = GuidCodec::FromShortUuid(0x2A37);
+    const BleGuid Location = GuidCodec::FromShortUuid(0x2A38);
+    const BleGuid Custom = GuidCodec::Literal("{f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4}");
+
+    fs::path Directory()
+    {
+        static fs::path directory = fs::temp_directory_path() / ("GattCacheTests-" + to_string(fs::file_time_type::clock::now().time_since_epoch().count()));
+        return directory;
+    }
+
+    fs::path CachePath() { return Directory() / "gatt.bin"; }
+
+    void Open(fs::path const& path)
+    {
+        GattCacheOptions options{};
+        wcsncpy(options.path, path.wstring().c_str(), sizeof(options.path) / sizeof(options.path[0]) - 1);
+        CHECK(SetGattCacheOptions(&options));
+    }
+
+    // writes what is pending, like Quit
+    void Flush() { StopGattFlusher(); }
+
+    vector<uint8_t> ReadBytes(fs::path const& path)
+    {
+        ifstream in(path, ios::binary);
+        return vector<uint8_t>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+
+    void WriteBytes(fs::path const& path, vector<uint8_t> const& bytes)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<streamsize>(bytes.size()));
+    }
+
+    uint32_t ReadUint32(vector<uint8_t> const& bytes, size_t offset)
+    {
+        uint32_t value;
+        memcpy(&value, bytes.data() + offset, sizeof(value));
+        return value;
+    }
+
+    void WriteUint32(vector<uint8_t>& bytes, size_t offset, uint32_t value)
+    {
+        memcpy(bytes.data() + offset, &value, sizeof(value));
+    }
+
+    // recomputes the checksum, so that a damaged record gets past it
+    void Reseal(vector<uint8_t>& bytes)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = HEADER_SIZE; i < bytes.size(); i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+        WriteUint32(bytes, CHECKSUM_OFFSET, hash);
+    }
+
+    GattCharacteristicLayout Characteristic(BleGuid uuid, uint32_t properties, wstring description, vector<BleGuid> descriptors)
+    {
+        GattCharacteristicLayout layout;
+        layout.uuid = uuid;
+        layout.properties = properties;
+        layout.userDescription = move(description);
+        layout.descriptors = move(descriptors);
+        return layout;
+    }
+
+    void StoreSensor()
+    {
+        StoreGattServices(Sensor, { HeartRate, Battery, Custom });
+        StoreGattCharacteristics(Sensor, HeartRate, true, {
+            Characteristic(Measurement, 0x10, L"Heart rate", { WellKnownUuids::UserDescription, GuidCodec::FromShortUuid(0x2902) }),
+            // outside the BMP, stored as a surrogate pair
+            Characteristic(Location, 0x02, L"Temp\u00E9rature \U0001F321", {}),
+        });
+        StoreGattCharacteristics(Sensor, Custom, false, { Characteristic(Custom, 0x0C, L"", {}) });
+    }
+
+    bool SensorIsStored()
+    {
+        vector<BleGuid> services;
+        if (!LookupGattServices(Sensor, services))
+            return false;
+        CHECK((services == vector<BleGuid>{ HeartRate, Battery, Custom }));
+
+        vector<GattCharacteristicLayout> characteristics;
+        CHECK(LookupGattCharacteristics(Sensor, HeartRate, true, characteristics));
+        CHECK(characteristics.size() == 2);
+        if (characteristics.size() == 2)
+        {
+            CHECK(characteristics[0].uuid == Measurement && characteristics[0].properties == 0x10);
+            CHECK(characteristics[0].userDescription == L"Heart rate");
+            CHECK((characteristics[0].descriptors == vector<BleGuid>{ WellKnownUuids::UserDescription, GuidCodec::FromShortUuid(0x2902) }));
+            CHECK(characteristics[1].uuid == Location && characteristics[1].properties == 0x02);
+            CHECK(characteristics[1].userDescription == L"Temp\u00E9rature \U0001F321");
+            CHECK(characteristics[1].descriptors.empty());
+        }
+        // known without descriptions only, and not at all
+        CHECK(!LookupGattCharacteristics(Sensor, Custom, true, characteristics));
+        CHECK(LookupGattCharacteristics(Sensor, Custom, false, characteristics) && characteristics.size() == 1);
+        CHECK(!LookupGattCharacteristics(Sensor, Battery, false, characteristics));
+        return true;
+    }
+
+    void WriteAndReload()
+    {
+        Open(CachePath());
+        CHECK(!fs::exists(CachePath()));
+        StoreSensor();
+        Flush();
+        CHECK(fs::exists(CachePath()));
+        // the temporary file was moved over the real one
+        CHECK(!fs::exists(fs::path(CachePath()).concat(".tmp")));
+        auto bytes = ReadBytes(CachePath());
+        CHECK(bytes.size() > HEADER_SIZE && memcmp(bytes.data(), "BLEGATT", 8) == 0);
+
+        // reopening drops the memory copy and loads the file
+        Open(fs::path());
+        Open(CachePath());
+        CHECK(SensorIsStored());
+        GattCacheStats stats{};
+        GetGattCacheStats(&stats);
+        CHECK(stats.devices == 1);
+
+        // a second device is added to the same file
+        StoreGattServices(Other, { Battery });
+        Flush();
+        Open(fs::path());
+        Open(CachePath());
+        CHECK(SensorIsStored());
+        vector<BleGuid> services;
+        CHECK(LookupGattServices(Other, services) && services.size() == 1);
+    }
+
+    // Writes a damaged copy of good, opens it and checks that it was ignored and that the next store replaces it.
+    void Rejects(vector<uint8_t> const& good, function<void(vector<uint8_t>&)> damage)
+    {
+        auto bytes = good;
+        damage(bytes);
+        WriteBytes(CachePath(), bytes);
+        Open(CachePath());
+        vector<BleGuid> services;
+        CHECK(!LookupGattServices(Sensor, services));
+        CHECK(!LookupGattServices(Other, services));
+        GattCacheStats stats{};
+        GetGattCacheStats(&stats);
+        CHECK(stats.devices == 0);
+
+        StoreSensor();
+        Flush();
+        Open(fs::path());
+        Open(CachePath());
+        CHECK(SensorIsStored());
+        CHECK(!LookupGattServices(Other, services));
+        Open(fs::path());
+        // restore the reference for the next case
+        WriteBytes(CachePath(), good);
+    }
+
+    void DamagedFiles()
+    {
+        Open(fs::path());
+        fs::remove(CachePath());
+        Open(CachePath());
+        StoreSensor();
+        Flush();
+        Open(fs::path());
+        auto good = ReadBytes(CachePath());
+        CHECK(good.size() > FIRST_DEVICE_SERVICE_OFFSET + 8);
+
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes[0] = 'X'; });
+        Rejects(good, [](vector<uint8_t>& bytes) { WriteUint32(bytes, VERSION_OFFSET, ReadUint32(bytes, VERSION_OFFSET) + 1); });
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.back() ^= 0x01; });
+        Rejects(good, [](vector<uint8_t>& bytes) { WriteUint32(bytes, CHECKSUM_OFFSET, ReadUint32(bytes, CHECKSUM_OFFSET) ^ 1); });
+        // truncated within the records, within the header, and empty
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.resize(bytes.size() - 2); });
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.resize(HEADER_SIZE + 8); Reseal(bytes); });
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.resize(HEADER_SIZE / 2); });
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.clear(); });
+        // counts that don't add up to the size
+        Rejects(good, [](vector<uint8_t>& bytes) { WriteUint32(bytes, SERVICE_COUNT_OFFSET, ReadUint32(bytes, SERVICE_COUNT_OFFSET) + 1); });
+        // a record that points past its section, behind a valid checksum
+        Rejects(good, [](vector<uint8_t>& bytes) { WriteUint32(bytes, FIRST_DEVICE_SERVICE_OFFSET, 1000); Reseal(bytes); });
+        // not a database at all
+        Rejects(good, [](vector<uint8_t>& bytes) { bytes.assign(4096, 0xA5); });
+
+        // the reference itself still loads
+        Open(CachePath());
+        CHECK(SensorIsStored());
+        Open(fs::path());
+    }
+
+    void MissingFile()
+    {
+        fs::remove(CachePath());
+        Open(CachePath());
+        vector<BleGuid> services;
+        CHECK(!LookupGattServices(Sensor, services));
+        // nothing is written until something is stored
+        Flush();
+        CHECK(!fs::exists(CachePath()));
+        Open(fs::path());
+    }
+
+    void Disabled()
+    {
+        Open(fs::path());
+        CHECK(!GattCacheEnabled());
+        StoreGattServices(Sensor, { HeartRate });
+        vector<BleGuid> services;
+        CHECK(!LookupGattServices(Sensor, services));
+    }
+}
+
+int main()
+{
+    fs::create_directories(Directory());
+    WriteAndReload();
+    DamagedFiles();
+    MissingFile();
+    Disabled();
+    Flush();
+    fs::remove_all(Directory());
+    return CheckResult("GattCacheTests");
+}
@@ -0,0 +1,213 @@
+// GuidCodecTests.cpp : round trips and rejections of the GUID parser and formatter, see GuidCodec.h.
+
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <string>
+
+#include "Check.h"
+#include "GuidCodec.h"
+
+using namespace std;
+
+namespace
+{
+    const char HexDigits[] = "0123456789abcdefABCDEF";
+    const wchar_t Reference[] = L"f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4";
+    const size_t HyphenPositions[4] = { 8, 13, 18, 23 };
+
+    // the same text as UTF-16 code units, which is what the SSE2 path parses
+    u16string ToUtf16(wstring const& text)
+    {
+        return u16string(text.begin(), text.end());
+    }
+
+    bool ParseUtf16(wstring const& text, BleGuid& out)
+    {
+        auto units = ToUtf16(text);
+        return GuidCodec::TryParse(reinterpret_cast<const uint16_t*>(units.c_str()), units.size(), out);
+    }
+
+    // parses text with every parser and checks that they agree; returns the wide result
+    bool ParseAll(wstring const& text, BleGuid& out)
+    {
+        bool parsed = GuidCodec::TryParse(text.c_str(), text.size(), out);
+        BleGuid utf16{};
+        CHECK(ParseUtf16(text, utf16) == parsed);
+        if (parsed)
+            CHECK(utf16 == out);
+        return parsed;
+    }
+
+    wstring Lower(wstring text)
+    {
+        for (auto& c : text)
+            if (c >= L'A' && c <= L'F')
+                c = wchar_t(c - L'A' + L'a');
+        return text;
+    }
+
+    void RoundTrip(wstring const& canonical)
+    {
+        BleGuid g{};
+        CHECK(ParseAll(canonical, g));
+        BleGuid braced{};
+        CHECK(ParseAll(L"{" + canonical + L"}", braced));
+        CHECK(braced == g);
+
+        wchar_t formatted[GuidCodec::FormattedCapacity];
+        CHECK(GuidCodec::Format(g, formatted, GuidCodec::FormattedCapacity, false) == GuidCodec::CanonicalLength);
+        CHECK(Lower(canonical) == formatted);
+        CHECK(GuidCodec::Format(g, formatted, GuidCodec::FormattedCapacity) == GuidCodec::CanonicalLength + 2);
+        CHECK(L"{" + Lower(canonical) + L"}" == formatted);
+        CHECK(GuidCodec::Parse(formatted) == g);
+    }
+
+    // every hex digit, in both cases, at every digit position of both forms
+    void EveryDigitAtEveryPosition()
+    {
+        for (auto position : GuidCodec::DigitPositions)
+        {
+            for (const char* digit = HexDigits; *digit; digit++)
+            {
+                wstring text = Reference;
+                text[position] = wchar_t(*digit);
+                RoundTrip(text);
+            }
+        }
+    }
+
+    void PseudoRandomGuids()
+    {
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (int i = 0; i < 10000; i++)
+        {
+            BleGuid g{};
+            uint8_t* bytes = reinterpret_cast<uint8_t*>(&g);
+            for (size_t b = 0; b < sizeof(g); b++)
+            {
+                state = state * 6364136223846793005ull + 1442695040888963407ull;
+                bytes[b] = uint8_t(state >> 56);
+            }
+            wchar_t formatted[GuidCodec::FormattedCapacity];
+            GuidCodec::Format(g, formatted, GuidCodec::FormattedCapacity, (i & 1) != 0);
+            BleGuid parsed{};
+            CHECK(ParseAll(formatted, parsed));
+            CHECK(parsed == g);
+        }
+    }
+
+    void Rejects(wstring const& text)
+    {
+        BleGuid g{};
+        CHECK(!ParseAll(text, g));
+    }
+
+    void WrongLength()
+    {
+        wstring canonical = Reference;
+        Rejects(L"");
+        Rejects(canonical.substr(0, 35));
+        Rejects(canonical + L"0");
+        Rejects(L"{" + canonical.substr(0, 35) + L"}");
+        Rejects(L"{" + canonical + L"0}");
+        Rejects(L"{{" + canonical + L"}}");
+        // the lenient fallback still accepts them
+        CHECK(GuidCodec::Parse((canonical + L"0").c_str()) == GuidCodec::Parse(Reference));
+    }
+
+    void MisplacedHyphens()
+    {
+        for (auto position : HyphenPositions)
+        {
+            for (int shift : { -1, 1 })
+            {
+                wstring text = Reference;
+                swap(text[position], text[position + shift]);
+                Rejects(text);
+                Rejects(L"{" + text + L"}");
+            }
+            wstring missing = Reference;
+            missing[position] = L'0';
+            Rejects(missing);
+        }
+        Rejects(L"f6f04ffa9a6111e9a2a32a2ae2dbcce4");
+    }
+
+    void NonHexCharacters()
+    {
+        // neighbours of the hex ranges, a hyphen where a digit belongs, and code units whose low byte is a digit
+        const wchar_t invalid[] = { L'/', L':', L'@', L'G', L'`', L'g', L' ', L'-', L'{', L'\0',
+                                    wchar_t(0x0130), wchar_t(0x0161), wchar_t(0x7F30), wchar_t(0xFF10) };
+        for (auto position : GuidCodec::DigitPositions)
+        {
+            for (auto c : invalid)
+            {
+                wstring text = Reference;
+                text[position] = c;
+                Rejects(text);
+                Rejects(L"{" + text + L"}");
+            }
+        }
+    }
+
+    void MissingBraces()
+    {
+        wstring canonical = Reference;
+        Rejects(L"{" + canonical);
+        Rejects(canonical + L"}");
+        Rejects(L"{" + canonical + L")");
+        Rejects(L"(" + canonical + L"}");
+        Rejects(L"0" + canonical + L"0");
+        Rejects(L"[" + canonical + L"]");
+    }
+
+    // The wide parser of this platform may never reach the SSE2 path (wchar_t has 32 bits outside Windows), so compare
+    // it against the scalar one directly on UTF-16 input, valid or not.
+    void Sse2MatchesScalar()
+    {
+#ifdef BLE_GUID_SSE2
+        auto compare = [](wstring const& text)
+        {
+            auto units = ToUtf16(text);
+            const uint16_t* data = reinterpret_cast<const uint16_t*>(units.c_str());
+            BleGuid simd{}, scalar{};
+            bool simdParsed = GuidCodec::ParseCanonicalSse2(data, simd);
+            bool scalarParsed = GuidCodec::ParseCanonicalScalar(data, scalar);
+            CHECK(simdParsed == scalarParsed);
+            if (simdParsed && scalarParsed)
+                CHECK(simd == scalar);
+        };
+        for (size_t position = 0; position < GuidCodec::CanonicalLength; position++)
+        {
+            for (uint32_t c = 0; c < 0x80; c++)
+            {
+                wstring text = Reference;
+                text[position] = wchar_t(c);
+                compare(text);
+            }
+            for (uint32_t high : { 0x0100u, 0x3000u, 0x8000u, 0xFF00u })
+            {
+                wstring text = Reference;
+                text[position] = wchar_t(high | uint32_t(text[position]));
+                compare(text);
+            }
+        }
+#else
+        std::printf("SSE2 parser not available on this target\n");
+#endif
+    }
+}
+
+int main()
+{
+    EveryDigitAtEveryPosition();
+    PseudoRandomGuids();
+    WrongLength();
+    MisplacedHyphens();
+    NonHexCharacters();
+    MissingBraces();
+    Sse2MatchesScalar();
+    static_assert(GuidCodec::Literal("{00002901-0000-1000-8000-00805f9b34fb}") == WellKnownUuids::UserDescription, "literal");
+    return CheckResult("GuidCodecTests");
+}
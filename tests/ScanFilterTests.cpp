@@ -0,0 +1,360 @@
+// ScanFilterTests.cpp : the compiled scan filter on recorded advertising payloads, see ScanFilter.h.
+
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <vector>
+
+#include "Check.h"
+#include "ScanFilter.h"
+
+using namespace std;
+
+namespace
+{
+    // heart rate sensor: flags, complete 16-bit service list, TX power, complete name
+    const uint8_t HeartRateSensor[] = {
+        0x02, 0x01, 0x06,
+        0x05, 0x03, 0x0D, 0x18, 0x0A, 0x18,
+        0x02, 0x0A, 0xF4,
+        0x08, 0x09, 'H', 'R', 'M', ' ', 'P', 'r', 'o',
+    };
+
+    // Apple iBeacon: flags and manufacturer data with company 0x004C
+    const uint8_t IBeacon[] = {
+        0x02, 0x01, 0x1A,
+        0x1A, 0xFF, 0x4C, 0x00, 0x02, 0x15,
+        0xF7, 0x82, 0x6D, 0xA6, 0x4F, 0xA2, 0x4E, 0x98, 0x80, 0x24, 0xBC, 0x5B, 0x71, 0xE0, 0x89, 0x3E,
+        0x00, 0x01, 0x00, 0x02, 0xC5,
+    };
+
+    // custom peripheral: complete 128-bit service list and a shortened name
+    const uint8_t CustomService[] = {
+        0x02, 0x01, 0x06,
+        0x11, 0x07, 0xE4, 0xCC, 0xDB, 0xE2, 0x2A, 0x2A, 0xA3, 0xA2, 0xE9, 0x11, 0x61, 0x9A, 0xFA, 0x4F, 0xF0, 0xF6,
+        0x05, 0x08, 'C', 'u', 's', 't',
+    };
+
+    // 32-bit service list and 16-bit service data of the environmental sensing service
+    const uint8_t ShortServices[] = {
+        0x05, 0x05, 0xCD, 0xAB, 0x34, 0x12,
+        0x05, 0x16, 0x1A, 0x18, 0x2A, 0x01,
+    };
+
+    // keeps a payload and its parse together, as the scan callbacks do
+    struct Recorded
+    {
+        template <size_t N>
+        explicit Recorded(const uint8_t (&bytes)[N], int16_t rssi = -60, uint64_t address = 0)
+        {
+            CHECK(AdParser::ParseAdvertisement(bytes, N, ad));
+            subject.address = address;
+            subject.hasRssi = true;
+            subject.rssi = rssi;
+            subject.payload = bytes;
+            subject.advertisement = &ad;
+            if (ad.name.Present())
+            {
+                subject.nameUtf8 = bytes + ad.name.offset;
+                subject.nameUtf8Size = ad.name.size;
+            }
+        }
+
+        AdParser::Advertisement ad;
+        ScanSubject subject;
+    };
+
+    // what the device watcher reports
+    ScanSubject Device(uint64_t address, const wchar_t* name)
+    {
+        ScanSubject subject;
+        subject.address = address;
+        subject.name = name;
+        return subject;
+    }
+
+    ScanFilterRule Rule(ScanFilterAction action, uint32_t criteria)
+    {
+        ScanFilterRule rule{};
+        rule.action = action;
+        rule.criteria = criteria;
+        return rule;
+    }
+
+    ScanFilterRule NameRule(ScanFilterAction action, const wchar_t* name, bool prefix = false)
+    {
+        auto rule = Rule(action, SCAN_FILTER_NAME);
+        wcsncpy(rule.name, name, sizeof(rule.name) / sizeof(rule.name[0]) - 1);
+        rule.namePrefix = prefix;
+        return rule;
+    }
+
+    ScanFilterRule ServiceRule(ScanFilterAction action, const wchar_t* uuid)
+    {
+        auto rule = Rule(action, SCAN_FILTER_SERVICE);
+        wcsncpy(rule.serviceUuid, uuid, sizeof(rule.serviceUuid) / sizeof(rule.serviceUuid[0]) - 1);
+        return rule;
+    }
+
+    ScanFilterRule AddressRule(ScanFilterAction action, uint64_t address)
+    {
+        auto rule = Rule(action, SCAN_FILTER_ADDRESS);
+        rule.address = address;
+        return rule;
+    }
+
+    ScanFilterRule ManufacturerRule(uint16_t companyId, vector<uint8_t> const& mask, vector<uint8_t> const& value)
+    {
+        auto rule = Rule(ScanFilterAction::ACCEPT, SCAN_FILTER_MANUFACTURER);
+        rule.companyId = companyId;
+        rule.dataSize = static_cast<uint8_t>(mask.size());
+        memcpy(rule.dataMask, mask.data(), mask.size());
+        memcpy(rule.dataValue, value.data(), value.size());
+        return rule;
+    }
+
+    // whether a matcher of rule alone, rejecting everything else, accepts subject
+    bool Accepts(ScanFilterRule const& rule, ScanSubject const& subject)
+    {
+        ScanMatcher matcher(&rule, 1, ScanFilterAction::REJECT);
+        return matcher.Accepts(subject);
+    }
+
+    vector<uint64_t> Hits(ScanMatcher const& matcher, ScanFilterStats& stats)
+    {
+        vector<uint64_t> hits(SCAN_FILTER_MAX_RULES);
+        hits.resize(matcher.Snapshot(stats, hits.data(), static_cast<uint32_t>(hits.size())));
+        return hits;
+    }
+
+    void FirstMatchingRuleDecides()
+    {
+        ScanFilterRule rules[] = {
+            NameRule(ScanFilterAction::REJECT, L"HRM", true),
+            ServiceRule(ScanFilterAction::ACCEPT, L"0000180d-0000-1000-8000-00805f9b34fb"),
+            Rule(ScanFilterAction::ACCEPT, 0),
+        };
+        Recorded heartRate(HeartRateSensor);
+        Recorded beacon(IBeacon);
+        CHECK(!ScanMatcher(rules, 3, ScanFilterAction::REJECT).Accepts(heartRate.subject));
+        // the rule matching everything ends the list
+        CHECK(ScanMatcher(rules, 3, ScanFilterAction::REJECT).Accepts(beacon.subject));
+        // without the name rule the service rule decides
+        CHECK(ScanMatcher(rules + 1, 1, ScanFilterAction::REJECT).Accepts(heartRate.subject));
+        CHECK(!ScanMatcher(rules + 1, 1, ScanFilterAction::REJECT).Accepts(beacon.subject));
+        CHECK(ScanMatcher(rules + 1, 1, ScanFilterAction::ACCEPT).Accepts(beacon.subject));
+    }
+
+    void Names()
+    {
+        Recorded custom(CustomService);
+        CHECK(Accepts(NameRule(ScanFilterAction::ACCEPT, L"Cust"), custom.subject));
+        CHECK(Accepts(NameRule(ScanFilterAction::ACCEPT, L"Cu", true), custom.subject));
+        CHECK(!Accepts(NameRule(ScanFilterAction::ACCEPT, L"Cu"), custom.subject));
+        CHECK(!Accepts(NameRule(ScanFilterAction::ACCEPT, L"Custom", true), custom.subject));
+        CHECK(Accepts(NameRule(ScanFilterAction::ACCEPT, L"Thérmo"), Device(1, L"Thérmo")));
+        CHECK(!Accepts(NameRule(ScanFilterAction::ACCEPT, L"Thermo"), Device(1, L"Thérmo")));
+        // a payload without a name doesn't match
+        Recorded beacon(IBeacon);
+        CHECK(!Accepts(NameRule(ScanFilterAction::ACCEPT, L"", true), beacon.subject));
+    }
+
+    void AddressLists()
+    {
+        // deny list: everything but the listed addresses
+        vector<ScanFilterRule> deny;
+        for (uint64_t address = 0x100; address < 0x100 + 500; address++)
+            deny.push_back(AddressRule(ScanFilterAction::REJECT, address));
+        ScanMatcher denied(deny.data(), static_cast<uint32_t>(deny.size()), ScanFilterAction::ACCEPT);
+        CHECK(!denied.Accepts(Device(0x100, L"a")));
+        CHECK(!denied.Accepts(Device(0x100 + 499, L"b")));
+        CHECK(denied.Accepts(Device(0x100 + 500, L"c")));
+        CHECK(denied.Accepts(Device(0xFF, L"d")));
+
+        // allow list: only the listed addresses
+        vector<ScanFilterRule> allow;
+        for (uint64_t address = 0xA000; address < 0xA000 + 500; address += 5)
+            allow.push_back(AddressRule(ScanFilterAction::ACCEPT, address));
+        ScanMatcher allowed(allow.data(), static_cast<uint32_t>(allow.size()), ScanFilterAction::REJECT);
+        CHECK(allowed.Accepts(Device(0xA005, L"")));
+        CHECK(!allowed.Accepts(Device(0xA006, L"")));
+        Recorded beacon(IBeacon, -60, 0xA000);
+        CHECK(allowed.Accepts(beacon.subject));
+
+        // Address rules are looked up, not scanned, but keep their place in the order: a rule before them still wins,
+        // one after them doesn't, and of two rules for the same address the first counts.
+        ScanFilterRule rules[] = {
+            NameRule(ScanFilterAction::REJECT, L"Blocked"),
+            AddressRule(ScanFilterAction::ACCEPT, 0x42),
+            AddressRule(ScanFilterAction::REJECT, 0x42),
+            Rule(ScanFilterAction::REJECT, 0),
+        };
+        ScanMatcher ordered(rules, 4, ScanFilterAction::ACCEPT);
+        CHECK(!ordered.Accepts(Device(0x42, L"Blocked")));
+        CHECK(ordered.Accepts(Device(0x42, L"Fine")));
+        CHECK(!ordered.Accepts(Device(0x43, L"Fine")));
+        ScanFilterStats stats{};
+        auto hits = Hits(ordered, stats);
+        CHECK(hits.size() == 4);
+        CHECK(hits[0] == 1 && hits[1] == 1 && hits[2] == 0 && hits[3] == 1);
+
+        // an address combined with another criterion is an ordinary rule
+        auto both = AddressRule(ScanFilterAction::ACCEPT, 0x42);
+        both.criteria |= SCAN_FILTER_NAME;
+        wcscpy(both.name, L"Fine");
+        CHECK(Accepts(both, Device(0x42, L"Fine")));
+        CHECK(!Accepts(both, Device(0x42, L"Other")));
+        CHECK(!Accepts(both, Device(0x43, L"Fine")));
+    }
+
+    void ServiceUuids()
+    {
+        Recorded heartRate(HeartRateSensor);
+        Recorded custom(CustomService);
+        Recorded shortServices(ShortServices);
+        auto heartRateService = ServiceRule(ScanFilterAction::ACCEPT, L"0000180d-0000-1000-8000-00805f9b34fb");
+        auto batteryService = ServiceRule(ScanFilterAction::ACCEPT, L"{0000180A-0000-1000-8000-00805F9B34FB}");
+        auto thirtyTwoBit = ServiceRule(ScanFilterAction::ACCEPT, L"1234abcd-0000-1000-8000-00805f9b34fb");
+        auto fullUuid = ServiceRule(ScanFilterAction::ACCEPT, L"f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4");
+        auto serviceData = ServiceRule(ScanFilterAction::ACCEPT, L"0000181a-0000-1000-8000-00805f9b34fb");
+
+        // 16-bit list, second entry too
+        CHECK(Accepts(heartRateService, heartRate.subject));
+        CHECK(Accepts(batteryService, heartRate.subject));
+        CHECK(!Accepts(heartRateService, custom.subject));
+        // 32-bit list
+        CHECK(Accepts(thirtyTwoBit, shortServices.subject));
+        CHECK(!Accepts(thirtyTwoBit, heartRate.subject));
+        // 128-bit list, advertised little endian
+        CHECK(Accepts(fullUuid, custom.subject));
+        CHECK(!Accepts(fullUuid, heartRate.subject));
+        // service data
+        CHECK(Accepts(serviceData, shortServices.subject));
+        CHECK(!Accepts(serviceData, heartRate.subject));
+
+        // a 16-bit UUID advertised in the 32 or 128-bit form
+        const uint8_t as32[] = { 0x05, 0x05, 0x0D, 0x18, 0x00, 0x00 };
+        const uint8_t as128[] = {
+            0x11, 0x07, 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0x0D, 0x18, 0x00, 0x00,
+        };
+        Recorded expanded32(as32);
+        Recorded expanded128(as128);
+        CHECK(Accepts(heartRateService, expanded32.subject));
+        CHECK(Accepts(heartRateService, expanded128.subject));
+        // but a UUID outside the base never matches a short form with the same leading bytes
+        const uint8_t offBase[] = {
+            0x11, 0x07, 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0x0D, 0x18, 0x00, 0x00,
+            0x03, 0x03, 0x0D, 0x18,
+        };
+        Recorded offBaseAd(offBase);
+        auto lookalike = ServiceRule(ScanFilterAction::ACCEPT, L"0000180d-0000-1000-8000-00805f9b34fc");
+        CHECK(!Accepts(lookalike, offBaseAd.subject));
+        CHECK(!Accepts(lookalike, heartRate.subject));
+
+        // the device watcher has no service list
+        CHECK(!Accepts(heartRateService, Device(1, L"HRM Pro")));
+    }
+
+    void ManufacturerMask()
+    {
+        Recorded beacon(IBeacon);
+        // iBeacon type and length
+        CHECK(Accepts(ManufacturerRule(0x004C, { 0xFF, 0xFF }, { 0x02, 0x15 }), beacon.subject));
+        CHECK(!Accepts(ManufacturerRule(0x004C, { 0xFF, 0xFF }, { 0x02, 0x16 }), beacon.subject));
+        // bits outside the mask are ignored, in the value too
+        CHECK(Accepts(ManufacturerRule(0x004C, { 0xF0, 0xFF }, { 0x0F, 0x15 }), beacon.subject));
+        CHECK(Accepts(ManufacturerRule(0x004C, { 0x00, 0x00, 0xF0 }, { 0xAA, 0xAA, 0xF3 }), beacon.subject));
+        CHECK(!Accepts(ManufacturerRule(0x004C, { 0x00, 0x00, 0xFF }, { 0xAA, 0xAA, 0xF3 }), beacon.subject));
+        // company only
+        CHECK(Accepts(ManufacturerRule(0x004C, {}, {}), beacon.subject));
+        CHECK(!Accepts(ManufacturerRule(0x0059, {}, {}), beacon.subject));
+        // the iBeacon carries 25 bytes after the company identifier; a longer mask can't match
+        vector<uint8_t> wide(SCAN_FILTER_DATA_SIZE, 0x00);
+        CHECK(Accepts(ManufacturerRule(0x004C, wide, wide), beacon.subject));
+        const uint8_t shortData[] = { 0x05, 0xFF, 0x4C, 0x00, 0x02, 0x15 };
+        Recorded truncated(shortData);
+        CHECK(Accepts(ManufacturerRule(0x004C, { 0xFF, 0xFF }, { 0x02, 0x15 }), truncated.subject));
+        CHECK(!Accepts(ManufacturerRule(0x004C, { 0xFF, 0xFF, 0x00 }, { 0x02, 0x15, 0x00 }), truncated.subject));
+        // no manufacturer data at all
+        Recorded heartRate(HeartRateSensor);
+        CHECK(!Accepts(ManufacturerRule(0x004C, {}, {}), heartRate.subject));
+    }
+
+    void MinimumRssi()
+    {
+        auto rule = Rule(ScanFilterAction::ACCEPT, SCAN_FILTER_MIN_RSSI);
+        rule.minRssi = -60;
+        CHECK(Accepts(rule, Recorded(HeartRateSensor, -60).subject));
+        CHECK(Accepts(rule, Recorded(HeartRateSensor, -20).subject));
+        CHECK(!Accepts(rule, Recorded(HeartRateSensor, -61).subject));
+        // the device watcher reports no RSSI
+        CHECK(!Accepts(rule, Device(1, L"HRM Pro")));
+
+        // combined with a service, both have to match
+        auto near = ServiceRule(ScanFilterAction::ACCEPT, L"0000180d-0000-1000-8000-00805f9b34fb");
+        near.criteria |= SCAN_FILTER_MIN_RSSI;
+        near.minRssi = -70;
+        CHECK(Accepts(near, Recorded(HeartRateSensor, -65).subject));
+        CHECK(!Accepts(near, Recorded(HeartRateSensor, -75).subject));
+        CHECK(!Accepts(near, Recorded(IBeacon, -65).subject));
+    }
+
+    void HitCounters()
+    {
+        ScanFilterRule rules[] = {
+            ServiceRule(ScanFilterAction::ACCEPT, L"0000180d-0000-1000-8000-00805f9b34fb"),
+            ManufacturerRule(0x004C, {}, {}),
+            AddressRule(ScanFilterAction::REJECT, 7),
+        };
+        rules[1].action = ScanFilterAction::REJECT;
+        ScanMatcher matcher(rules, 3, ScanFilterAction::ACCEPT);
+        for (int i = 0; i < 5; i++)
+            CHECK(matcher.Accepts(Recorded(HeartRateSensor).subject));
+        for (int i = 0; i < 3; i++)
+            CHECK(!matcher.Accepts(Recorded(IBeacon).subject));
+        CHECK(!matcher.Accepts(Device(7, L"x")));
+        CHECK(matcher.Accepts(Device(8, L"x")));
+        CHECK(matcher.Accepts(Recorded(CustomService).subject));
+
+        ScanFilterStats stats{};
+        auto hits = Hits(matcher, stats);
+        CHECK(stats.rules == 3);
+        CHECK(stats.evaluated == 11);
+        CHECK(stats.accepted == 7);
+        CHECK(stats.rejected == 4);
+        CHECK(stats.unmatched == 2);
+        CHECK(hits.size() == 3 && hits[0] == 5 && hits[1] == 3 && hits[2] == 1);
+
+        // capacity limits what is copied, not the count returned
+        uint64_t first = 0;
+        CHECK(matcher.Snapshot(stats, &first, 1) == 3);
+        CHECK(first == 5);
+        CHECK(matcher.Snapshot(stats, nullptr, 0) == 3);
+    }
+
+    void EmptyFilter()
+    {
+        ScanMatcher acceptAll(nullptr, 0, ScanFilterAction::ACCEPT);
+        ScanMatcher rejectAll(nullptr, 0, ScanFilterAction::REJECT);
+        Recorded heartRate(HeartRateSensor);
+        CHECK(acceptAll.Accepts(heartRate.subject));
+        CHECK(!rejectAll.Accepts(heartRate.subject));
+        CHECK(!rejectAll.Accepts(Device(1, L"a")));
+        ScanFilterStats stats{};
+        CHECK(rejectAll.Snapshot(stats, nullptr, 0) == 0);
+        CHECK(stats.unmatched == 2 && stats.rejected == 2);
+    }
+}
+
+int main()
+{
+    FirstMatchingRuleDecides();
+    Names();
+    AddressLists();
+    ServiceUuids();
+    ManufacturerMask();
+    MinimumRssi();
+    HitCounters();
+    EmptyFilter();
+    return CheckResult("ScanFilterTests");
+}